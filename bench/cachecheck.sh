@@ -0,0 +1,80 @@
+#!/bin/sh
+
+# Check that the expense cache stays the size of a freshly built one over
+# repeated saves and loads.
+#
+# Expenses in a few mixed case categories are added one at a time, with a
+# report loaded after each add and every tenth expense deleted again. Each
+# save rewrites <expfile>.cache from the loaded table, so anything the
+# cache carries over from load to load (ex. sort keys, strings of deleted
+# expenses) makes it grow. At the end the cache is compared with the one
+# built from parsing the expense file. Exits with 1 if they differ.
+
+usage() {
+    echo 'cachecheck.sh - Check that the expense cache size stays bounded.
+
+Usage:
+
+    bench/cachecheck.sh [options] [COUNT]
+
+    COUNT      number of expenses to add (default 300)
+
+Options:
+
+    -e EXP2    exp2 binary (default ./exp2)
+' >&2
+}
+
+EXP2=./exp2
+
+while getopts "e:h" opt; do
+    case "$opt" in
+    e) EXP2=$OPTARG ;;
+    *) usage; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+COUNT=${1:-300}
+
+TMPDIR=$(mktemp -d "${TMPDIR:-/tmp}/cachecheck.XXXXXX") || exit 1
+trap 'rm -rf "$TMPDIR"' EXIT INT TERM
+
+EXP2FILE=$TMPDIR/exp.txt
+export EXP2FILE
+unset EXP2STATS
+cache=$EXP2FILE.cache
+
+cache_size() {
+    wc -c < "$cache" | tr -d ' '
+}
+
+set -- Food Transport Groceries Rent Utilities Dining Health Entertainment
+i=1
+while [ $i -le "$COUNT" ]; do
+    shift $(( (i - 1) % 8 ))
+    cat=$1
+    set -- Food Transport Groceries Rent Utilities Dining Health Entertainment
+    day=$(( i % 28 + 1 ))
+    "$EXP2" add "Expense $i" "$i.00" "$cat" "2025-01-$(printf %02d $day)" >/dev/null || exit 1
+    "$EXP2" ytd 2025 >/dev/null || exit 1
+    if [ $(( i % 10 )) -eq 0 ]; then
+        echo y | "$EXP2" del $i >/dev/null || exit 1
+    fi
+    i=$((i + 1))
+done
+
+if [ ! -f "$cache" ]; then
+    echo "No cache written for $EXP2FILE" >&2
+    exit 1
+fi
+saved=$(cache_size)
+rm -f "$cache"
+"$EXP2" ytd 2025 >/dev/null || exit 1
+fresh=$(cache_size)
+
+echo "{\"count\":$COUNT,\"cache_bytes\":$saved,\"fresh_bytes\":$fresh,\"match\":$([ "$saved" -eq "$fresh" ] && echo true || echo false)}"
+if [ "$saved" -ne "$fresh" ]; then
+    echo "Cache grew to $saved bytes, a fresh one is $fresh bytes" >&2
+    exit 1
+fi
+exit 0
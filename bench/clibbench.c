@@ -0,0 +1,594 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "../clib.h"
+
+// Microbenchmarks of the clib date and string functions that run once per
+// record or per report row.
+//
+// Each function is timed over a set of inputs:
+//   ledger  dates a few hours apart in order, as in an expense file
+//   dst     times around each DST transition of the timezone, including
+//           times skipped or repeated by the transition
+// Functions are run in batches until a batch takes long enough to time,
+// and the fastest of several batches is reported as ns per call.
+//
+// Fast path candidates are timed next to the clib function they would
+// replace, and their results are checked against it on the same inputs.
+// A candidate only counts if it has no mismatches. Where clib already has
+// the fast path, the plain libc version is timed next to it instead.
+
+const char USAGE[] =
+R"(clibbench - Time clib date and string functions.
+
+Usage:
+
+    clibbench [options] [FILTER]
+
+Options:
+
+    -z TZ      timezone (default America/New_York, so that DST applies)
+    -n RUNS    batches per function, the fastest is reported (default 5)
+    -r REV     revision label for the results (ex. git commit)
+    -o FILE    also append results to FILE
+
+Only functions with names containing FILTER are run.
+Results are written as JSON lines, one per function, impl and input set.
+
+)";
+
+#define NDATES      4096
+#define NSTRS       2000
+#define NCATS       20
+#define MIN_BATCH_MS 20.0
+
+typedef struct {
+    const char *name;
+    int n;
+    char (*iso)[ISO_DATE_LEN+1];
+    char (*hhmm)[HHMM_TIME_LEN+1];
+    time_t *dt;
+} dateset_t;
+
+typedef struct {
+    const char *fn;
+    const char *impl;
+    dateset_t *set;
+    long (*run)(long iters);
+    int (*check)();
+} benchdef_t;
+
+static dateset_t g_ledger;
+static dateset_t g_dst;
+static dateset_t *g_set;
+
+static char g_strs[NSTRS][32];
+static int g_lookups[NDATES];
+static strtbl_t g_desctbl;
+static strtbl_t g_cattbl;
+static arena_t g_tblarena;
+static arena_t g_arena;
+
+static uint64_t g_rng = 0x9e3779b97f4a7c15ULL;
+
+// xorshift64*
+static uint64_t next_rand() {
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 2685821657736338717ULL;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void init_dateset(dateset_t *set, const char *name, int n) {
+    set->name = name;
+    set->n = 0;
+    set->iso = malloc(sizeof(*set->iso) * n);
+    set->hhmm = malloc(sizeof(*set->hhmm) * n);
+    set->dt = malloc(sizeof(*set->dt) * n);
+}
+static void add_date(dateset_t *set, const char *iso, const char *hhmm) {
+    int i = set->n++;
+    snprintf(set->iso[i], sizeof(set->iso[i]), "%s", iso);
+    snprintf(set->hhmm[i], sizeof(set->hhmm[i]), "%s", hhmm);
+    set->dt[i] = date_from_sdatetime(set->iso[i], set->hhmm[i]);
+}
+
+static void init_inputs() {
+    char iso[ISO_DATE_LEN+1], hhmm[HHMM_TIME_LEN+1];
+
+    // Ledger: about 5 expenses per day starting 2000-01-01.
+    init_dateset(&g_ledger, "ledger", NDATES);
+    time_t dt = date_from_cal(2000, 1, 1);
+    for (int i=0; i < NDATES; i++) {
+        dt += (next_rand() % (10*60)) * 60;
+        date_to_iso(dt, iso, sizeof(iso));
+        date_to_hhmm(dt, hhmm, sizeof(hhmm));
+        add_date(&g_ledger, iso, hhmm);
+    }
+
+    // DST: days from 2000 to 2037 where the UTC offset changes, at each
+    // half hour from 00:30 to 03:30.
+    static const char *times[] = {"00:30", "01:00", "01:30", "02:00", "02:30", "03:00", "03:30"};
+    init_dateset(&g_dst, "dst", NDATES);
+    struct tm tm;
+    dt = date_from_cal(2000, 1, 1);
+    localtime_r(&dt, &tm);
+    long prevoff = tm.tm_gmtoff;
+    for (int day=0; day < 38*366 && g_dst.n + countof(times) <= NDATES; day++) {
+        time_t noon = dt + day*24*60*60 + 12*60*60;
+        localtime_r(&noon, &tm);
+        if (tm.tm_gmtoff == prevoff)
+            continue;
+        prevoff = tm.tm_gmtoff;
+        strftime(iso, sizeof(iso), "%F", &tm);
+        for (int k=0; k < countof(times); k++)
+            add_date(&g_dst, iso, times[k]);
+    }
+
+    // Strings like expense descriptions, and lookups of them in random order.
+    for (int i=0; i < NSTRS; i++)
+        snprintf(g_strs[i], sizeof(g_strs[i]), "%s %d", i % 3 ? "Description" : "description", i);
+    for (int i=0; i < NDATES; i++)
+        g_lookups[i] = next_rand() % NSTRS;
+
+    init_arena(&g_tblarena, SIZE_MB*16);
+    init_strtbl(&g_desctbl, &g_tblarena, NSTRS+1);
+    for (int i=0; i < NSTRS; i++)
+        strtbl_add(&g_desctbl, g_strs[i]);
+    init_strtbl(&g_cattbl, &g_tblarena, NCATS+1);
+    for (int i=0; i < NCATS; i++)
+        strtbl_add(&g_cattbl, g_strs[i]);
+    strtbl_intern(&g_desctbl, g_strs[0]);
+    strtbl_intern(&g_cattbl, g_strs[0]);
+    strtbl_build_keys(&g_desctbl);
+
+    init_arena(&g_arena, SIZE_MB*64);
+}
+
+// Fast path candidates
+
+static int parse_digits(const char *s, int n) {
+    int v = 0;
+    for (int i=0; i < n; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+        v = v*10 + s[i]-'0';
+    }
+    return v;
+}
+// Parse "YYYY-MM-DD" and "HH:MM" directly instead of through snprintf()
+// and strptime().
+static time_t fast_date_from_sdatetime(char *sdate, char *stime) {
+    if (strlen(sdate) != ISO_DATE_LEN || sdate[4] != '-' || sdate[7] != '-')
+        return date_from_sdatetime(sdate, stime);
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = parse_digits(sdate, 4) - 1900;
+    tm.tm_mon = parse_digits(sdate+5, 2) - 1;
+    tm.tm_mday = parse_digits(sdate+8, 2);
+    if (stime[0] != '\0') {
+        if (strlen(stime) != HHMM_TIME_LEN || stime[2] != ':')
+            return date_from_sdatetime(sdate, stime);
+        tm.tm_hour = parse_digits(stime, 2);
+        tm.tm_min = parse_digits(stime+3, 2);
+    }
+    if (tm.tm_mon < 0 || tm.tm_mday < 0 || tm.tm_hour < 0 || tm.tm_min < 0)
+        return date_from_sdatetime(sdate, stime);
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    return t < 0 ? 0 : t;
+}
+static time_t fast_date_from_iso(char *isodate) {
+    return fast_date_from_sdatetime(isodate, "");
+}
+
+// Plain libc versions of the clib date formatting functions, which cache
+// the current day. Timed to show what the cache saves, and checked to
+// agree with clib.
+static void libc_date_to_iso(time_t dt, char *buf, size_t buf_len) {
+    struct tm tm;
+    localtime_r(&dt, &tm);
+    strftime(buf, buf_len, "%F", &tm);
+}
+static void libc_date_to_hhmm(time_t dt, char *buf, size_t buf_len) {
+    struct tm tm;
+    localtime_r(&dt, &tm);
+    strftime(buf, buf_len, "%H:%M", &tm);
+}
+static void libc_date_to_cal(time_t dt, short *retyear, short *retmonth, short *retday) {
+    struct tm tm;
+    localtime_r(&dt, &tm);
+    *retyear = tm.tm_year + 1900;
+    *retmonth = tm.tm_mon+1;
+    *retday = tm.tm_mday;
+}
+
+static str_t memcpy_new_str(arena_t *a, const char *s) {
+    str_t retstr;
+    retstr.len = strlen(s);
+    retstr.bytes = aalloc(a, retstr.len+1);
+    memcpy(retstr.bytes, s, retstr.len+1);
+    return retstr;
+}
+
+// Benchmarks. Each runs iters calls and returns a sum of the results so
+// that the calls can't be optimized out.
+
+static long run_date_from_iso(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += date_from_iso(g_set->iso[i % g_set->n]);
+    return sum;
+}
+static long run_fast_date_from_iso(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += fast_date_from_iso(g_set->iso[i % g_set->n]);
+    return sum;
+}
+static long run_date_from_sdatetime(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        int k = i % g_set->n;
+        sum += date_from_sdatetime(g_set->iso[k], g_set->hhmm[k]);
+    }
+    return sum;
+}
+static long run_fast_date_from_sdatetime(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        int k = i % g_set->n;
+        sum += fast_date_from_sdatetime(g_set->iso[k], g_set->hhmm[k]);
+    }
+    return sum;
+}
+static long run_to_iso(long iters, void (*fn)(time_t, char *, size_t)) {
+    char buf[ISO_DATE_LEN+1];
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        fn(g_set->dt[i % g_set->n], buf, sizeof(buf));
+        sum += buf[9];
+    }
+    return sum;
+}
+static long run_date_to_iso(long iters) {
+    return run_to_iso(iters, date_to_iso);
+}
+static long run_libc_date_to_iso(long iters) {
+    return run_to_iso(iters, libc_date_to_iso);
+}
+static long run_date_to_hhmm(long iters) {
+    return run_to_iso(iters, date_to_hhmm);
+}
+static long run_libc_date_to_hhmm(long iters) {
+    return run_to_iso(iters, libc_date_to_hhmm);
+}
+static long run_to_cal(long iters, void (*fn)(time_t, short *, short *, short *)) {
+    short year, month, day;
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        fn(g_set->dt[i % g_set->n], &year, &month, &day);
+        sum += year + month + day;
+    }
+    return sum;
+}
+static long run_date_to_cal(long iters) {
+    return run_to_cal(iters, date_to_cal);
+}
+static long run_libc_date_to_cal(long iters) {
+    return run_to_cal(iters, libc_date_to_cal);
+}
+static long run_date_next_month(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += date_next_month(g_set->dt[i % g_set->n]);
+    return sum;
+}
+
+// Adds NSTRS strings to a new table per round, so the table grows from
+// its initial capacity as it does while loading.
+static long run_strtbl_add(long iters) {
+    strtbl_t st;
+    long sum = 0;
+    reset_arena(&g_arena);
+    init_strtbl(&st, &g_arena, 0);
+    for (long i=0; i < iters; i++) {
+        if (st.len > NSTRS) {
+            reset_arena(&g_arena);
+            init_strtbl(&st, &g_arena, 0);
+        }
+        sum += strtbl_add(&st, g_strs[i % NSTRS]);
+    }
+    return sum;
+}
+static long run_strtbl_find_cats(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += strtbl_find(g_cattbl, g_strs[g_lookups[i % NDATES] % NCATS]);
+    return sum;
+}
+static long run_strtbl_intern_cats(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += strtbl_intern(&g_cattbl, g_strs[g_lookups[i % NDATES] % NCATS]);
+    return sum;
+}
+static long run_strtbl_find_descs(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += strtbl_find(g_desctbl, g_strs[g_lookups[i % NDATES]]);
+    return sum;
+}
+static long run_strtbl_intern_descs(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++)
+        sum += strtbl_intern(&g_desctbl, g_strs[g_lookups[i % NDATES]]);
+    return sum;
+}
+static long run_strcasecmp_descs(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        int k1 = g_lookups[i % NDATES], k2 = g_lookups[(i+1) % NDATES];
+        sum += strcasecmp(strtbl_get(g_desctbl, k1+1).bytes, strtbl_get(g_desctbl, k2+1).bytes) < 0;
+    }
+    return sum;
+}
+static long run_strtbl_casecmp_descs(long iters) {
+    long sum = 0;
+    for (long i=0; i < iters; i++) {
+        int k1 = g_lookups[i % NDATES], k2 = g_lookups[(i+1) % NDATES];
+        sum += strtbl_casecmp(&g_desctbl, k1+1, k2+1) < 0;
+    }
+    return sum;
+}
+static long run_new_str(long iters) {
+    long sum = 0;
+    reset_arena(&g_arena);
+    for (long i=0; i < iters; i++) {
+        if (g_arena.pos > g_arena.cap - 64)
+            reset_arena(&g_arena);
+        sum += new_str(&g_arena, g_strs[i % NSTRS]).len;
+    }
+    return sum;
+}
+static long run_memcpy_new_str(long iters) {
+    long sum = 0;
+    reset_arena(&g_arena);
+    for (long i=0; i < iters; i++) {
+        if (g_arena.pos > g_arena.cap - 64)
+            reset_arena(&g_arena);
+        sum += memcpy_new_str(&g_arena, g_strs[i % NSTRS]).len;
+    }
+    return sum;
+}
+
+// Checks of fast paths against clib. Return the number of mismatches.
+
+static int check_date_from_iso() {
+    int nerrs = 0;
+    for (int i=0; i < g_set->n; i++)
+        nerrs += fast_date_from_iso(g_set->iso[i]) != date_from_iso(g_set->iso[i]);
+    return nerrs;
+}
+static int check_date_from_sdatetime() {
+    int nerrs = 0;
+    for (int i=0; i < g_set->n; i++)
+        nerrs += fast_date_from_sdatetime(g_set->iso[i], g_set->hhmm[i]) != date_from_sdatetime(g_set->iso[i], g_set->hhmm[i]);
+    return nerrs;
+}
+// Dates are also checked a second and a minute either side, to catch
+// errors at day boundaries.
+static int check_to_str(void (*fn)(time_t, char *, size_t), void (*libcfn)(time_t, char *, size_t)) {
+    static const int deltas[] = {-60, -1, 0, 1, 60};
+    char buf1[ISO_DATE_LEN+1], buf2[ISO_DATE_LEN+1];
+    int nerrs = 0;
+    for (int i=0; i < g_set->n; i++) {
+        for (int k=0; k < countof(deltas); k++) {
+            fn(g_set->dt[i] + deltas[k], buf1, sizeof(buf1));
+            libcfn(g_set->dt[i] + deltas[k], buf2, sizeof(buf2));
+            nerrs += strcmp(buf1, buf2) != 0;
+        }
+    }
+    return nerrs;
+}
+static int check_date_to_iso() {
+    return check_to_str(date_to_iso, libc_date_to_iso);
+}
+static int check_date_to_hhmm() {
+    return check_to_str(date_to_hhmm, libc_date_to_hhmm);
+}
+static int check_date_to_cal() {
+    static const int deltas[] = {-60, -1, 0, 1, 60};
+    short y1, m1, d1, y2, m2, d2;
+    int nerrs = 0;
+    for (int i=0; i < g_set->n; i++) {
+        for (int k=0; k < countof(deltas); k++) {
+            date_to_cal(g_set->dt[i] + deltas[k], &y1, &m1, &d1);
+            libc_date_to_cal(g_set->dt[i] + deltas[k], &y2, &m2, &d2);
+            nerrs += y1 != y2 || m1 != m2 || d1 != d2;
+        }
+    }
+    return nerrs;
+}
+static int check_strtbl_intern_cats() {
+    int nerrs = 0;
+    for (int i=0; i < NCATS; i++)
+        nerrs += strtbl_intern(&g_cattbl, g_strs[i]) != strtbl_find(g_cattbl, g_strs[i]);
+    return nerrs;
+}
+static int check_strtbl_intern_descs() {
+    int nerrs = 0;
+    for (int i=0; i < NSTRS; i++)
+        nerrs += strtbl_intern(&g_desctbl, g_strs[i]) != strtbl_find(g_desctbl, g_strs[i]);
+    return nerrs;
+}
+static int sign(int v) {
+    return (v > 0) - (v < 0);
+}
+static int check_strtbl_casecmp_descs() {
+    int nerrs = 0;
+    for (int i=0; i < NDATES; i++) {
+        int k1 = g_lookups[i] + 1, k2 = g_lookups[(i+1) % NDATES] + 1;
+        nerrs += sign(strtbl_casecmp(&g_desctbl, k1, k2)) !=
+                 sign(strcasecmp(strtbl_get(g_desctbl, k1).bytes, strtbl_get(g_desctbl, k2).bytes));
+    }
+    return nerrs;
+}
+static int check_memcpy_new_str() {
+    int nerrs = 0;
+    reset_arena(&g_arena);
+    for (int i=0; i < NSTRS; i++) {
+        str_t s1 = new_str(&g_arena, g_strs[i]);
+        str_t s2 = memcpy_new_str(&g_arena, g_strs[i]);
+        nerrs += s1.len != s2.len || strcmp(s1.bytes, s2.bytes) != 0;
+    }
+    return nerrs;
+}
+
+static benchdef_t g_benches[] = {
+    {"date_from_iso",       "clib",   &g_ledger, run_date_from_iso, NULL},
+    {"date_from_iso",       "fast",   &g_ledger, run_fast_date_from_iso, check_date_from_iso},
+    {"date_from_iso",       "clib",   &g_dst,    run_date_from_iso, NULL},
+    {"date_from_iso",       "fast",   &g_dst,    run_fast_date_from_iso, check_date_from_iso},
+    {"date_from_sdatetime", "clib",   &g_ledger, run_date_from_sdatetime, NULL},
+    {"date_from_sdatetime", "fast",   &g_ledger, run_fast_date_from_sdatetime, check_date_from_sdatetime},
+    {"date_from_sdatetime", "clib",   &g_dst,    run_date_from_sdatetime, NULL},
+    {"date_from_sdatetime", "fast",   &g_dst,    run_fast_date_from_sdatetime, check_date_from_sdatetime},
+    {"date_to_iso",         "clib",   &g_ledger, run_date_to_iso, check_date_to_iso},
+    {"date_to_iso",         "libc",   &g_ledger, run_libc_date_to_iso, NULL},
+    {"date_to_iso",         "clib",   &g_dst,    run_date_to_iso, check_date_to_iso},
+    {"date_to_iso",         "libc",   &g_dst,    run_libc_date_to_iso, NULL},
+    {"date_to_hhmm",        "clib",   &g_ledger, run_date_to_hhmm, check_date_to_hhmm},
+    {"date_to_hhmm",        "libc",   &g_ledger, run_libc_date_to_hhmm, NULL},
+    {"date_to_hhmm",        "clib",   &g_dst,    run_date_to_hhmm, check_date_to_hhmm},
+    {"date_to_hhmm",        "libc",   &g_dst,    run_libc_date_to_hhmm, NULL},
+    {"date_to_cal",         "clib",   &g_ledger, run_date_to_cal, check_date_to_cal},
+    {"date_to_cal",         "libc",   &g_ledger, run_libc_date_to_cal, NULL},
+    {"date_to_cal",         "clib",   &g_dst,    run_date_to_cal, check_date_to_cal},
+    {"date_to_cal",         "libc",   &g_dst,    run_libc_date_to_cal, NULL},
+    {"date_next_month",     "clib",   &g_ledger, run_date_next_month, NULL},
+    {"date_next_month",     "clib",   &g_dst,    run_date_next_month, NULL},
+    {"strtbl_add",          "clib",   NULL,      run_strtbl_add, NULL},
+    {"strtbl_find_cats",    "clib",   NULL,      run_strtbl_find_cats, NULL},
+    {"strtbl_find_cats",    "intern", NULL,      run_strtbl_intern_cats, check_strtbl_intern_cats},
+    {"strtbl_find_descs",   "clib",   NULL,      run_strtbl_find_descs, NULL},
+    {"strtbl_find_descs",   "intern", NULL,      run_strtbl_intern_descs, check_strtbl_intern_descs},
+    {"strtbl_casecmp_descs", "strcasecmp", NULL,  run_strcasecmp_descs, NULL},
+    {"strtbl_casecmp_descs", "keys",   NULL,      run_strtbl_casecmp_descs, check_strtbl_casecmp_descs},
+    {"new_str",             "clib",   NULL,      run_new_str, NULL},
+    {"new_str",             "memcpy", NULL,      run_memcpy_new_str, check_memcpy_new_str},
+};
+
+static volatile long g_sink;
+
+// Returns ns per call, fastest of nruns batches.
+static double time_bench(benchdef_t *b, int nruns) {
+    long iters = 1000;
+    double ms;
+    for (;;) {
+        double start = now_ms();
+        g_sink += b->run(iters);
+        ms = now_ms() - start;
+        if (ms >= MIN_BATCH_MS || iters > (1L << 40))
+            break;
+        iters *= 2;
+    }
+
+    double best = ms;
+    for (int r=1; r < nruns; r++) {
+        double start = now_ms();
+        g_sink += b->run(iters);
+        ms = now_ms() - start;
+        if (ms < best)
+            best = ms;
+    }
+    return best * 1e6 / iters;
+}
+
+int main(int argc, char *argv[]) {
+    char *tz = "America/New_York";
+    char *rev = "";
+    char *outpath = NULL;
+    char *filter = NULL;
+    int nruns = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "z:n:r:o:h")) != -1) {
+        switch (opt) {
+        case 'z': tz = optarg; break;
+        case 'n': nruns = atoi(optarg); break;
+        case 'r': rev = optarg; break;
+        case 'o': outpath = optarg; break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    if (nruns <= 0) {
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (outpath != NULL) {
+        out = fopen(outpath, "a");
+        if (out == NULL) {
+            perror(outpath);
+            return 1;
+        }
+    }
+
+    setenv("TZ", tz, 1);
+    tzset();
+    init_inputs();
+    if (g_dst.n == 0)
+        fprintf(stderr, "No DST transitions in timezone %s\n", tz);
+
+    char *timestamp_env = getenv("SOURCE_DATE_EPOCH");
+    time_t timestamp = timestamp_env ? atol(timestamp_env) : time(NULL);
+    int status = 0;
+
+    for (int i=0; i < (int)countof(g_benches); i++) {
+        benchdef_t *b = &g_benches[i];
+        if (filter != NULL && strstr(b->fn, filter) == NULL)
+            continue;
+        if (b->set != NULL && b->set->n == 0)
+            continue;
+        g_set = b->set;
+
+        int nerrs = b->check ? b->check() : 0;
+        if (nerrs > 0) {
+            fprintf(stderr, "%s %s: %d mismatches on %s inputs\n",
+                    b->fn, b->impl, nerrs, b->set ? b->set->name : "string");
+            status = 1;
+        }
+        double ns = time_bench(b, nruns);
+
+        char line[512];
+        snprintf(line, sizeof(line),
+                 "{\"time\":%ld,\"rev\":\"%s\",\"tz\":\"%s\",\"fn\":\"%s\",\"impl\":\"%s\",\"inputs\":\"%s\","
+                 "\"ns_per_op\":%.1f,\"mismatches\":%d}\n",
+                 (long)timestamp, rev, tz, b->fn, b->impl, b->set ? b->set->name : "strings", ns, nerrs);
+        fputs(line, stdout);
+        fflush(stdout);
+        if (out != NULL)
+            fputs(line, out);
+    }
+
+    if (out != NULL)
+        fclose(out);
+    return status;
+}
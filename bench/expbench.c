@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// End-to-end benchmark of exp2 commands on generated ledgers.
+//
+// For each ledger size, a ledger is generated with expgen (and kept in the
+// data dir for later runs), copied to a work file, then each command is run
+// against it as a separate process. Commands that change the ledger get a
+// fresh copy before each run, so every run measures the same ledger. Wall
+// time and peak RSS are measured with wait4(). The sort and save phases of
+// add are taken from its --stats output. Results are written as JSON lines,
+// one per size and command or phase.
+
+const char USAGE[] =
+R"(expbench - Time exp2 commands on generated ledgers.
+
+Usage:
+
+    expbench [options] SIZE...
+
+Options:
+
+    -e EXP2    exp2 binary (default ./exp2)
+    -g EXPGEN  expgen binary (default bench/expgen)
+    -d DIR     dir for generated ledgers (default bench/data)
+    -n RUNS    runs per command, the median is reported (default 3)
+    -r REV     revision label for the results (ex. git commit)
+    -o FILE    also append results to FILE
+
+Commands timed:
+
+    load   exp2 list 1900-01-01 (load and sort, nothing listed)
+    list   exp2 list 1900 2100
+    cat    exp2 cat 1900 2100
+    ytd    exp2 ytd 2000
+    add    exp2 add (load, sort and save)
+    sort   sort phases of add (after load and before save)
+    save   save phase of add
+
+)";
+
+#define MAX_RUNS 32
+
+typedef struct {
+    const char *name;
+    int update;         // changes the ledger, run on a fresh copy
+    char *args[8];
+} benchcmd_t;
+
+static benchcmd_t g_cmds[] = {
+    {"load", 0, {"list", "1900-01-01", NULL}},
+    {"list", 0, {"list", "1900", "2100", NULL}},
+    {"cat",  0, {"cat", "1900", "2100", NULL}},
+    {"ytd",  0, {"ytd", "2000", NULL}},
+    {"add",  1, {"--stats", "add", "bench", "1.00", "misc", "2000-06-15", NULL}},
+};
+
+// Phases of update commands reported on their own, from --stats output.
+// Times of all phases with the same name are added up.
+static const char *g_phases[] = {"sort", "save"};
+#define NPHASES (int)(sizeof(g_phases) / sizeof(g_phases[0]))
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Run argv with stdout redirected to outfile and stderr to errfile, if not
+// NULL. Returns exit status, or -1.
+static int run(char *argv[], const char *outfile, const char *errfile, double *wall_ms, long *maxrss_kb) {
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork() error");
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            perror(outfile);
+            _exit(127);
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        if (errfile != NULL) {
+            fd = open(errfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1) {
+                perror(errfile);
+                _exit(127);
+            }
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4() error");
+        return -1;
+    }
+    *wall_ms = now_ms() - start;
+    *maxrss_kb = ru.ru_maxrss;
+    if (!WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static int copy_file(const char *src, const char *dst) {
+    char buf[1 << 16];
+    FILE *fin = fopen(src, "rb");
+    if (fin == NULL)
+        return 1;
+    FILE *fout = fopen(dst, "wb");
+    if (fout == NULL) {
+        fclose(fin);
+        return 1;
+    }
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fin)) > 0)
+        fwrite(buf, 1, n, fout);
+    fclose(fin);
+    return fclose(fout) != 0;
+}
+
+// Copy ledger to the work file, and drop the work file's journal and cache
+// left by earlier runs.
+static int restore_work(const char *ledger, const char *work) {
+    char path[2048];
+    snprintf(path, sizeof(path), "%s.journal", work);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.cache", work);
+    remove(path);
+    return copy_file(ledger, work);
+}
+
+// Add the ms of each phase in g_phases found in --stats output statsfile
+// to phase_ms[]. Phase lines are "    NAME  MS ...".
+static void read_phases(const char *statsfile, double phase_ms[]) {
+    char line[512], name[64];
+    double ms;
+    FILE *f = fopen(statsfile, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, " %63s %lf", name, &ms) != 2)
+            continue;
+        for (int i=0; i < NPHASES; i++) {
+            if (strcmp(name, g_phases[i]) == 0)
+                phase_ms[i] += ms;
+        }
+    }
+    fclose(f);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// Write the result line of nruns times[] of cmd, sorting times[].
+static void report(FILE *out, time_t timestamp, const char *rev, const char *cmd, long nrecs, long bytes,
+                   double times[], int nruns, long maxrss_kb) {
+    qsort(times, nruns, sizeof(double), cmp_double);
+    double median = times[nruns/2];
+
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"time\":%ld,\"rev\":\"%s\",\"cmd\":\"%s\",\"records\":%ld,\"bytes\":%ld,"
+             "\"runs\":%d,\"wall_ms\":%.3f,\"min_ms\":%.3f,\"recs_per_s\":%.0f,\"maxrss_kb\":%ld}\n",
+             (long)timestamp, rev, cmd, nrecs, bytes,
+             nruns, median, times[0], median > 0 ? nrecs / (median / 1000.0) : 0.0, maxrss_kb);
+    fputs(line, stdout);
+    fflush(stdout);
+    if (out != NULL)
+        fputs(line, out);
+}
+
+int main(int argc, char *argv[]) {
+    char *exp2 = "./exp2";
+    char *expgen = "bench/expgen";
+    char *datadir = "bench/data";
+    char *rev = "";
+    char *outpath = NULL;
+    int nruns = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:g:d:n:r:o:h")) != -1) {
+        switch (opt) {
+        case 'e': exp2 = optarg; break;
+        case 'g': expgen = optarg; break;
+        case 'd': datadir = optarg; break;
+        case 'n': nruns = atoi(optarg); break;
+        case 'r': rev = optarg; break;
+        case 'o': outpath = optarg; break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+    if (optind >= argc || nruns <= 0 || nruns > MAX_RUNS) {
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+
+    FILE *out = NULL;
+    if (outpath != NULL) {
+        out = fopen(outpath, "a");
+        if (out == NULL) {
+            perror(outpath);
+            return 1;
+        }
+    }
+    mkdir(datadir, 0777);
+
+    char ledger[1024], work[1024], statsfile[1024], devnull[] = "/dev/null";
+    char *timestamp_env = getenv("SOURCE_DATE_EPOCH");
+    time_t timestamp = timestamp_env ? atol(timestamp_env) : time(NULL);
+
+    // Time the work file itself, with synchronous saves.
+    unsetenv("EXP2ASYNC");
+    unsetenv("EXP2MEMLIMIT");
+    unsetenv("EXP2STATS");
+
+    for (int s=optind; s < argc; s++) {
+        long nrecs = atol(argv[s]);
+        snprintf(ledger, sizeof(ledger), "%s/ledger-%ld.exp", datadir, nrecs);
+        snprintf(work, sizeof(work), "%s/work.exp", datadir);
+        snprintf(statsfile, sizeof(statsfile), "%s/work.stats", datadir);
+
+        struct stat st;
+        if (stat(ledger, &st) != 0) {
+            fprintf(stderr, "Generating %s\n", ledger);
+            char *genargv[] = {expgen, argv[s], NULL};
+            double ms;
+            long rss;
+            if (run(genargv, ledger, NULL, &ms, &rss) != 0 || stat(ledger, &st) != 0) {
+                fprintf(stderr, "Error generating %s\n", ledger);
+                return 1;
+            }
+        }
+        if (restore_work(ledger, work) != 0) {
+            fprintf(stderr, "Error copying %s to %s\n", ledger, work);
+            return 1;
+        }
+        setenv("EXP2FILE", work, 1);
+
+        for (int c=0; c < (int)(sizeof(g_cmds) / sizeof(g_cmds[0])); c++) {
+            benchcmd_t *cmd = &g_cmds[c];
+            char *cmdargv[10] = {exp2};
+            for (int i=0; cmd->args[i] != NULL; i++)
+                cmdargv[i+1] = cmd->args[i];
+
+            double times[MAX_RUNS];
+            double phase_ms[NPHASES][MAX_RUNS];
+            long maxrss_kb = 0;
+            for (int r=0; r < nruns; r++) {
+                long rss;
+                if (cmd->update && restore_work(ledger, work) != 0) {
+                    fprintf(stderr, "Error copying %s to %s\n", ledger, work);
+                    return 1;
+                }
+                if (run(cmdargv, devnull, cmd->update ? statsfile : NULL, &times[r], &rss) != 0) {
+                    fprintf(stderr, "exp2 %s failed on %s\n", cmd->name, ledger);
+                    return 1;
+                }
+                if (rss > maxrss_kb)
+                    maxrss_kb = rss;
+                if (cmd->update) {
+                    double ms[NPHASES] = {0};
+                    read_phases(statsfile, ms);
+                    for (int i=0; i < NPHASES; i++)
+                        phase_ms[i][r] = ms[i];
+                }
+            }
+            report(out, timestamp, rev, cmd->name, nrecs, st.st_size, times, nruns, maxrss_kb);
+            for (int i=0; cmd->update && i < NPHASES; i++)
+                report(out, timestamp, rev, g_phases[i], nrecs, st.st_size, phase_ms[i], nruns, maxrss_kb);
+        }
+    }
+    char path[2048];
+    remove(work);
+    remove(statsfile);
+    snprintf(path, sizeof(path), "%s.journal", work);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.cache", work);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.bak", work);
+    remove(path);
+    snprintf(path, sizeof(path), "%s.lock", work);
+    remove(path);
+
+    if (out != NULL)
+        fclose(out);
+    return 0;
+}
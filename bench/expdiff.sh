@@ -0,0 +1,193 @@
+#!/bin/sh
+
+# Differential test of exp2 against the awk implementation in exp/.
+#
+# For each ledger size, a ledger is generated with expgen (shared with
+# expbench in the data dir), then each report is run with both exp2 and the
+# awk script. Outputs are normalized to the lines both print (headers,
+# separators and column padding removed) and compared:
+#
+#   list   rows must match as a set, and dates must come out in the same order
+#          (ties on the same date may be ordered differently)
+#   cat    category totals must match, in the same order
+#   ytd    month totals must match
+#
+# Wall time of each run is recorded, and results with the speedup of exp2
+# over awk are written as JSON lines. Exits with 1 if any output differs.
+
+usage() {
+    echo 'expdiff.sh - Compare exp2 and the awk exp scripts on generated ledgers.
+
+Usage:
+
+    bench/expdiff.sh [options] SIZE...
+
+Options:
+
+    -e EXP2    exp2 binary (default ./exp2)
+    -g EXPGEN  expgen binary (default bench/expgen)
+    -a AWKDIR  dir of the awk scripts (default exp)
+    -d DIR     dir for generated ledgers (default bench/data)
+    -r REV     revision label for the results (ex. git commit)
+    -o FILE    also append results to FILE
+
+Set AWK to choose the awk to run the scripts with (default gawk if
+installed, else awk).
+' >&2
+}
+
+EXP2=./exp2
+EXPGEN=bench/expgen
+AWKDIR=exp
+DATADIR=bench/data
+REV=
+OUT=
+
+while getopts "e:g:a:d:r:o:h" opt; do
+    case "$opt" in
+    e) EXP2=$OPTARG ;;
+    g) EXPGEN=$OPTARG ;;
+    a) AWKDIR=$OPTARG ;;
+    d) DATADIR=$OPTARG ;;
+    r) REV=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) usage; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    usage
+    exit 1
+fi
+
+if [ -z "$AWK" ]; then
+    AWK=awk
+    command -v gawk >/dev/null 2>&1 && AWK=gawk
+fi
+
+TMPDIR=$(mktemp -d "${TMPDIR:-/tmp}/expdiff.XXXXXX") || exit 1
+trap 'rm -rf "$TMPDIR"' EXIT INT TERM
+
+# The scripts use regex intervals ([0-9]{4}), which some awks (ex. mawk
+# 1.3.3) don't support. Run copies with the intervals expanded instead.
+mkdir "$TMPDIR/awk"
+for f in exp-list.awk exp-cat.awk exp-ytd.awk; do
+    if [ ! -f "$AWKDIR/$f" ]; then
+        echo "$AWKDIR/$f not found" >&2
+        exit 1
+    fi
+    if echo 2000 | $AWK '$0 ~ /^[0-9]{4}$/ { found=1 } END { exit !found }'; then
+        cp "$AWKDIR/$f" "$TMPDIR/awk/$f"
+    else
+        sed -e 's/\[0-9\]{4}/[0-9][0-9][0-9][0-9]/g' -e 's/\[0-9\]{2}/[0-9][0-9]/g' \
+            "$AWKDIR/$f" > "$TMPDIR/awk/$f"
+    fi
+done
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Normalize report output to one line per row, fields separated by '|'.
+# Amounts are the last field of each row.
+normalize() {
+    case "$1" in
+    list)
+        # date  desc  amt  cat  #id
+        $AWK '/^[0-9][0-9][0-9][0-9]-/ {
+                  date = substr($0, 1, 12); desc = substr($0, 14, 30)
+                  rest = substr($0, 45); n = split(rest, f, " ")
+                  sub(/ +$/, "", date); sub(/ +$/, "", desc)
+                  printf("%s|%s|%s|%s|%s\n", date, desc, f[2], f[3], f[1])
+              }
+              /^Totals/ { printf("Totals|%s\n", $NF) }'
+        ;;
+    *)
+        # name  amt
+        # exp2 cuts category names to 12 chars and labels ytd totals "Total".
+        $AWK '/^Display:|^Date range|^Year:|^---|^ *$/ { next }
+              { amt = $NF; $NF = ""; sub(/ +$/, "")
+                name = substr($0, 1, 12); if (name == "Total") name = "Totals"
+                printf("%s|%s\n", name, amt) }'
+        ;;
+    esac
+}
+
+# Run "exp2 CMD ARGS..." and the matching awk script, compare outputs.
+# Prints a result line, returns 1 if outputs differ.
+compare() {
+    cmd=$1
+    shift
+
+    t0=$(now_ms)
+    "$EXP2" "$cmd" "$@" > "$TMPDIR/exp2.out" 2>&1
+    t1=$(now_ms)
+    $AWK -f "$TMPDIR/awk/exp-$cmd.awk" "$@" > "$TMPDIR/awk.out" 2>&1
+    t2=$(now_ms)
+
+    normalize "$cmd" < "$TMPDIR/exp2.out" > "$TMPDIR/exp2.norm"
+    normalize "$cmd" < "$TMPDIR/awk.out" > "$TMPDIR/awk.norm"
+
+    match=true
+    if [ "$cmd" = list ]; then
+        sort "$TMPDIR/exp2.norm" > "$TMPDIR/exp2.sorted"
+        sort "$TMPDIR/awk.norm" > "$TMPDIR/awk.sorted"
+        cut -d'|' -f1 "$TMPDIR/exp2.norm" > "$TMPDIR/exp2.dates"
+        cut -d'|' -f1 "$TMPDIR/awk.norm" > "$TMPDIR/awk.dates"
+        if ! cmp -s "$TMPDIR/exp2.sorted" "$TMPDIR/awk.sorted" ||
+           ! cmp -s "$TMPDIR/exp2.dates" "$TMPDIR/awk.dates"; then
+            match=false
+        fi
+    elif ! cmp -s "$TMPDIR/exp2.norm" "$TMPDIR/awk.norm"; then
+        match=false
+    fi
+    if [ ! -s "$TMPDIR/awk.norm" ]; then
+        echo "awk $cmd $* printed no rows:" >&2
+        head -5 "$TMPDIR/awk.out" >&2
+        match=false
+    fi
+    if [ $match = false ]; then
+        echo "Output of $cmd $* differs on $ledger:" >&2
+        diff "$TMPDIR/awk.norm" "$TMPDIR/exp2.norm" | head -20 >&2
+    fi
+
+    exp2_ms=$((t1 - t0))
+    awk_ms=$((t2 - t1))
+    line=$(printf '{"time":%s,"rev":"%s","cmd":"%s","args":"%s","records":%s,"match":%s,"exp2_ms":%s,"awk_ms":%s,"speedup":%s}' \
+        "$TIMESTAMP" "$REV" "$cmd" "$*" "$nrecs" "$match" "$exp2_ms" "$awk_ms" \
+        "$(echo "$awk_ms $exp2_ms" | $AWK '{ printf("%.1f", $2 > 0 ? $1 / $2 : 0) }')")
+    echo "$line"
+    if [ -n "$OUT" ]; then
+        echo "$line" >> "$OUT"
+    fi
+    [ $match = true ]
+}
+
+TIMESTAMP=${SOURCE_DATE_EPOCH:-$(date +%s)}
+status=0
+mkdir -p "$DATADIR"
+unset EXP2STATS
+
+for nrecs in "$@"; do
+    ledger=$DATADIR/ledger-$nrecs.exp
+    if [ ! -f "$ledger" ]; then
+        echo "Generating $ledger" >&2
+        if ! "$EXPGEN" "$nrecs" > "$ledger"; then
+            rm -f "$ledger"
+            echo "Error generating $ledger" >&2
+            exit 1
+        fi
+    fi
+    # Read only, so both tools can use the shared ledger directly.
+    EXP2FILE=$ledger
+    EXPFILE=$ledger
+    export EXP2FILE EXPFILE
+
+    compare list 1900-01-01 2100-12-31 || status=1
+    compare list groceries 2000 || status=1
+    compare cat 1900-01-01 2100-12-31 || status=1
+    compare cat 2000-06 || status=1
+    compare ytd 2000 || status=1
+done
+
+exit $status
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+// Generate a synthetic expense file with realistic shape:
+// - dates spread over a number of years in order, a few expenses per day
+// - categories and descriptions drawn from Zipf distributions, so a few
+//   are very common and most are rare
+// - amounts log-uniform, most are small and some are large
+// Output only depends on the options, so the same ledger can be generated
+// again to compare runs across commits.
+
+const char USAGE[] =
+R"(expgen - Generate a synthetic expense file.
+
+Usage:
+
+    expgen [options] NRECS
+
+Options:
+
+    -y YEAR    first year (default 2000)
+    -Y YEARS   number of years (default: about 5 expenses per day)
+    -c NCATS   number of categories (default 20)
+    -d NDESCS  number of descriptions (default 2000)
+    -z SKEW    Zipf skew of categories and descriptions (default 1.0)
+    -s SEED    random seed (default 1)
+
+Expenses are written to stdout in expense file format.
+
+)";
+
+static const char *g_catnames[] = {
+    "groceries", "dining", "coffee", "transport", "fuel", "rent", "utilities",
+    "phone", "internet", "health", "clothing", "books", "entertainment",
+    "travel", "gifts", "household", "insurance", "education", "pets", "misc"
+};
+static const char *g_words[] = {
+    "supermarket", "cafe", "bakery", "gas station", "pharmacy", "bookstore",
+    "restaurant", "taxi", "train ticket", "bus pass", "electric bill",
+    "water bill", "cinema", "concert", "hardware store", "pet food",
+    "lunch", "dinner", "breakfast", "snacks", "hotel", "flight", "parking",
+    "haircut", "dentist", "gym", "streaming", "newspaper", "laundry", "repairs"
+};
+
+static uint64_t g_rng;
+
+// xorshift64*
+static uint64_t next_rand() {
+    g_rng ^= g_rng >> 12;
+    g_rng ^= g_rng << 25;
+    g_rng ^= g_rng >> 27;
+    return g_rng * 2685821657736338717ULL;
+}
+// Uniform in [0, 1)
+static double next_unit() {
+    return (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Cumulative Zipf weights of n items.
+static double *zipf_cdf(int n, double skew) {
+    double *cdf = malloc(sizeof(double) * n);
+    double sum = 0.0;
+    for (int i=0; i < n; i++) {
+        sum += 1.0 / pow(i+1, skew);
+        cdf[i] = sum;
+    }
+    for (int i=0; i < n; i++)
+        cdf[i] /= sum;
+    return cdf;
+}
+static int zipf_pick(double *cdf, int n) {
+    double u = next_unit();
+    int lo = 0, hi = n-1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void get_catname(int i, char *buf, size_t buf_len) {
+    int nnames = sizeof(g_catnames) / sizeof(g_catnames[0]);
+    if (i < nnames)
+        snprintf(buf, buf_len, "%s", g_catnames[i]);
+    else
+        snprintf(buf, buf_len, "%s%d", g_catnames[i % nnames], i / nnames);
+}
+static void get_desc(int i, char *buf, size_t buf_len) {
+    int nwords = sizeof(g_words) / sizeof(g_words[0]);
+    if (i < nwords)
+        snprintf(buf, buf_len, "%s", g_words[i]);
+    else
+        snprintf(buf, buf_len, "%s %d", g_words[i % nwords], i / nwords);
+}
+
+int main(int argc, char *argv[]) {
+    int year = 2000;
+    int nyears = 0;
+    int ncats = 20;
+    int ndescs = 2000;
+    double skew = 1.0;
+    long seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "y:Y:c:d:z:s:h")) != -1) {
+        switch (opt) {
+        case 'y': year = atoi(optarg); break;
+        case 'Y': nyears = atoi(optarg); break;
+        case 'c': ncats = atoi(optarg); break;
+        case 'd': ndescs = atoi(optarg); break;
+        case 'z': skew = atof(optarg); break;
+        case 's': seed = atol(optarg); break;
+        default:
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+    }
+    if (optind >= argc || ncats <= 0 || ndescs <= 0) {
+        fprintf(stderr, USAGE);
+        return 1;
+    }
+    long nrecs = atol(argv[optind]);
+    if (nyears <= 0)
+        nyears = nrecs / (5*365) + 1;
+
+    g_rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t)seed;
+    if (g_rng == 0)
+        g_rng = 1;
+    double *catcdf = zipf_cdf(ncats, skew);
+    double *desccdf = zipf_cdf(ndescs, skew);
+
+    // Spread expenses evenly in minutes from the first to the last year.
+    struct tm tm = {0};
+    tm.tm_year = year - 1900;
+    tm.tm_mday = 1;
+    tm.tm_isdst = -1;
+    time_t startdt = mktime(&tm);
+    tm.tm_year += nyears;
+    tm.tm_isdst = -1;
+    time_t enddt = mktime(&tm);
+    double step = (double)(enddt - startdt) / 60.0 / (nrecs > 0 ? nrecs : 1);
+
+    static char iobuf[1 << 16];
+    setvbuf(stdout, iobuf, _IOFBF, sizeof(iobuf));
+
+    char isodate[16], hhmm[8], cat[64], desc[128];
+    double minutes = 0.0;
+    for (long i=0; i < nrecs; i++) {
+        minutes += step * 2.0 * next_unit();
+        time_t dt = startdt + (time_t)minutes * 60;
+        if (dt >= enddt)
+            dt = enddt - 60;
+        struct tm *ltm = localtime(&dt);
+        strftime(isodate, sizeof(isodate), "%Y-%m-%d", ltm);
+        strftime(hhmm, sizeof(hhmm), "%H:%M", ltm);
+
+        get_catname(zipf_pick(catcdf, ncats), cat, sizeof(cat));
+        get_desc(zipf_pick(desccdf, ndescs), desc, sizeof(desc));
+        double amt = exp(log(1.0) + next_unit() * (log(2000.0) - log(1.0)));
+
+        printf("%s; %s; %s; %.2f; %s; #%ld\n", isodate, hhmm, desc, amt, cat, i+1);
+    }
+
+    free(catcdf);
+    free(desccdf);
+    return 0;
+}
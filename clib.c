@@ -10,24 +10,35 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <ctype.h>
+#include <strings.h>
 #include <time.h>
 #include "clib.h"
 
 void panic(char *s) {
     if (s)
-        fprintf(stderr, "%s\n", s);
+        fprintf(errout(), "%s\n", s);
     abort();
 }
 void panic_err(char *s) {
     if (s)
-        fprintf(stderr, "%s: %s\n", s, strerror(errno));
+        fprintf(errout(), "%s: %s\n", s, strerror(errno));
     abort();
 }
+static __thread FILE *t_errout = NULL;
+
+FILE *errout() {
+    return t_errout != NULL ? t_errout : stderr;
+}
+void set_errout(FILE *f) {
+    t_errout = f;
+}
+
 void print_error(const char *s) {
     if (s)
-        fprintf(stderr, "%s: %s\n", s, strerror(errno));
+        fprintf(errout(), "%s: %s\n", s, strerror(errno));
     else
-        fprintf(stderr, "%s\n", strerror(errno));
+        fprintf(errout(), "%s\n", strerror(errno));
 }
 
 void init_arena(arena_t *a, unsigned long cap) {
@@ -35,14 +46,17 @@ void init_arena(arena_t *a, unsigned long cap) {
         cap = SIZE_MEDIUM;
 
     a->base = malloc(cap);
-    if (!a->base)
+    a->peak = malloc(sizeof(unsigned long));
+    if (!a->base || !a->peak)
         panic("Not enough memory to initialize arena");
 
     a->pos = 0;
     a->cap = cap;
+    *a->peak = 0;
 }
 void free_arena(arena_t *a) {
     free(a->base);
+    free(a->peak);
 }
 void reset_arena(arena_t *a) {
     a->pos = 0;
@@ -53,8 +67,16 @@ void *aalloc(arena_t *a, unsigned long size) {
 
     char *p = (char*)a->base + a->pos;
     a->pos += size;
+    if (a->peak != NULL && a->pos > *a->peak)
+        *a->peak = a->pos;
     return (void*) p;
 }
+// Highest pos reached by the arena or any copy of it.
+unsigned long arena_peak(arena_t *a) {
+    if (a->peak == NULL || *a->peak < a->pos)
+        return a->pos;
+    return *a->peak;
+}
 
 str_t new_str(arena_t *a, const char *s) {
     str_t retstr;
@@ -76,83 +98,284 @@ int str_equals(str_t s, const char *sz) {
     return !strcmp(s.bytes, sz);
 }
 
-void init_strtbl(strtbl_t *st, arena_t *a, short cap) {
+void init_strtbl(strtbl_t *st, arena_t *a, int cap) {
     if (cap == 0)
         cap = SIZE_TINY;
 
     st->arena = a;
-    st->base = aalloc(a, sizeof(str_t) * cap);
-    st->base[0] = STR("");
+    st->base = aalloc(a, sizeof(strref_t) * cap);
     st->len = 1;
     st->cap = cap;
+    st->pool_cap = cap * 16;
+    st->pool = aalloc(a, st->pool_cap);
+    st->pool_len = 1;
+    st->hidx = NULL;
+    st->hcap = 0;
+    st->keys = NULL;
+
+    // [0] is always ""
+    st->pool[0] = 0;
+    st->base[0].off = 0;
+    st->base[0].len = 0;
 }
 strtbl_t dup_strtbl(strtbl_t st, arena_t *a) {
     strtbl_t dupst;
-    init_strtbl(&dupst, a, st.cap);
+    dupst.arena = a;
+    dupst.base = aalloc(a, sizeof(strref_t) * st.cap);
+    memcpy(dupst.base, st.base, sizeof(strref_t) * st.len);
     dupst.len = st.len;
-    memcpy(dupst.base, st.base, sizeof(str_t) * st.cap);
+    dupst.cap = st.cap;
+    dupst.pool = aalloc(a, st.pool_cap);
+    memcpy(dupst.pool, st.pool, st.pool_len);
+    dupst.pool_len = st.pool_len;
+    dupst.pool_cap = st.pool_cap;
+    dupst.hidx = NULL;
+    dupst.hcap = 0;
+    dupst.keys = NULL;
     return dupst;
 }
-short strtbl_add(strtbl_t *st, const char *s) {
+// Make st a table of the len entries of base[] with their strings in
+// pool[0, pool_len), as written out from the base and pool blocks of
+// another table. The blocks are used in place and must be allocated from a
+// with room for cap entries and pool_cap bytes.
+// Returns 0, or -1 if an entry isn't a NUL terminated string in the pool.
+int init_strtbl_blocks(strtbl_t *st, arena_t *a, strref_t *base, int len, int cap, char *pool, uint32_t pool_len, uint32_t pool_cap) {
+    if (len < 1 || len > cap || pool_len < 1 || pool_len > pool_cap)
+        return -1;
+    for (int i=0; i < len; i++) {
+        strref_t ref = base[i];
+        if (ref.off >= pool_len || ref.len >= pool_len - ref.off || pool[ref.off + ref.len] != 0)
+            return -1;
+    }
+
+    st->arena = a;
+    st->base = base;
+    st->len = len;
+    st->cap = cap;
+    st->pool = pool;
+    st->pool_len = pool_len;
+    st->pool_cap = pool_cap;
+    st->hidx = NULL;
+    st->hcap = 0;
+    st->keys = NULL;
+    return 0;
+}
+static str_t strtbl_view(strtbl_t *st, strref_t ref) {
+    str_t s;
+    s.bytes = st->pool + ref.off;
+    s.len = ref.len;
+    return s;
+}
+// Copy s to the end of the pool, growing it if needed.
+// Strings already returned by strtbl_get() stay valid when the pool grows,
+// since the old pool isn't freed from the arena.
+static strref_t strtbl_put_pool(strtbl_t *st, const char *s) {
+    strref_t ref;
+    size_t len = strlen(s);
+    if (len > SHRT_MAX)
+        len = SHRT_MAX;
+
+    if (st->pool_len + len+1 > st->pool_cap) {
+        unsigned long newcap = (unsigned long)st->pool_cap * 2;
+        while (newcap < st->pool_len + len+1)
+            newcap *= 2;
+        if (newcap > UINT32_MAX) {
+            if (st->pool_len + len+1 > UINT32_MAX) {
+                fprintf(errout(), "strtbl_add() Maximum string pool size reached %u\n", st->pool_cap);
+                abort();
+            }
+            newcap = UINT32_MAX;
+        }
+        char *newpool = aalloc(st->arena, newcap);
+        memcpy(newpool, st->pool, st->pool_len);
+        st->pool = newpool;
+        st->pool_cap = newcap;
+    }
+
+    ref.off = st->pool_len;
+    ref.len = len;
+    memcpy(st->pool + ref.off, s, len);
+    st->pool[ref.off + len] = 0;
+    st->pool_len += len+1;
+    return ref;
+}
+static void strtbl_hash_put(strtbl_t *st, int idx);
+static void strtbl_put_key(strtbl_t *st, int idx);
+
+int strtbl_add(strtbl_t *st, const char *s) {
     assert(st->cap > 0);
     assert(st->len >= 0);
 
     // If out of space, double the capacity.
     // Create a new memory block with double capacity and copy existing string table to it.
     if (st->len >= st->cap) {
-        if (st->cap == SHRT_MAX) {
-            fprintf(stderr, "strtbl_add() Maximum capacity reached %d\n", st->cap);
+        if (st->cap == INT_MAX) {
+            fprintf(errout(), "strtbl_add() Maximum capacity reached %d\n", st->cap);
             abort();
         }
-        int newcap = (int)st->cap * 2;
-        if (newcap > SHRT_MAX)
-            newcap = SHRT_MAX;
+        int newcap = st->cap > INT_MAX/2 ? INT_MAX : st->cap * 2;
 
-        str_t *newbase = aalloc(st->arena, sizeof(str_t) * newcap);
-        memcpy(newbase, st->base, sizeof(str_t) * st->cap);
+        strref_t *newbase = aalloc(st->arena, sizeof(strref_t) * newcap);
+        memcpy(newbase, st->base, sizeof(strref_t) * st->len);
         st->base = newbase;
+        if (st->keys != NULL) {
+            strkey_t *newkeys = aalloc(st->arena, sizeof(strkey_t) * newcap);
+            memcpy(newkeys, st->keys, sizeof(strkey_t) * st->len);
+            st->keys = newkeys;
+        }
         st->cap = newcap;
     }
 
-    st->base[st->len] = new_str(st->arena, s);
+    st->base[st->len] = strtbl_put_pool(st, s);
     st->len++;
+    if (st->hidx != NULL)
+        strtbl_hash_put(st, st->len-1);
+    if (st->keys != NULL)
+        strtbl_put_key(st, st->len-1);
     return st->len-1;
 }
-void strtbl_replace(strtbl_t *st, short idx, const char *s) {
+void strtbl_replace(strtbl_t *st, int idx, const char *s) {
     assert(idx < st->len);
     if (idx >= st->len)
         return;
-    st->base[idx] = new_str(st->arena, s);
+    st->base[idx] = strtbl_put_pool(st, s);
+    st->hidx = NULL;
+    if (st->keys != NULL)
+        strtbl_put_key(st, idx);
 }
-str_t strtbl_get(strtbl_t st, short idx) {
+str_t strtbl_get(strtbl_t st, int idx) {
     if (idx >= st.len)
         return STR("");
-    return st.base[idx];
+    return strtbl_view(&st, st.base[idx]);
 }
-short strtbl_find(strtbl_t st, const char *s) {
+int strtbl_find(strtbl_t st, const char *s) {
     for (int i=1; i < st.len; i++) {
-        if (strcmp(s, st.base[i].bytes) == 0)
+        if (strcmp(s, st.pool + st.base[i].off) == 0)
             return i;
     }
     return 0;
 }
 
-static void swap_str(str_t *strs, int i, int j) {
-    str_t tmp = strs[i];
-    strs[i] = strs[j];
-    strs[j] = tmp;
+static unsigned int hash_sz(const char *s) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
+    }
+    return h;
+}
+// Add table index idx to hash index. Index must have room.
+static void strtbl_hash_put(strtbl_t *st, int idx) {
+    // Rebuild when over half full.
+    if (st->len * 2 > st->hcap) {
+        st->hidx = NULL;
+        return;
+    }
+    unsigned int mask = st->hcap-1;
+    unsigned int i = hash_sz(st->pool + st->base[idx].off) & mask;
+    while (st->hidx[i] != 0)
+        i = (i+1) & mask;
+    st->hidx[i] = idx;
+}
+static void strtbl_build_hash(strtbl_t *st) {
+    int cap = 64;
+    while (cap < st->len * 4)
+        cap *= 2;
+    if (cap > st->hcap || st->hidx == NULL) {
+        st->hidx = aalloc(st->arena, sizeof(int) * cap);
+        st->hcap = cap;
+    }
+    memset(st->hidx, 0, sizeof(int) * st->hcap);
+    for (int i=1; i < st->len; i++)
+        strtbl_hash_put(st, i);
+}
+// Return index of s in table, adding it if not there yet.
+// Lookups go through a hash index, so interning n strings is O(n).
+int strtbl_intern(strtbl_t *st, const char *s) {
+    if (st->hidx == NULL)
+        strtbl_build_hash(st);
+
+    unsigned int mask = st->hcap-1;
+    unsigned int i = hash_sz(s) & mask;
+    while (st->hidx[i] != 0) {
+        int idx = st->hidx[i];
+        if (strcmp(st->pool + st->base[idx].off, s) == 0)
+            return idx;
+        i = (i+1) & mask;
+    }
+    return strtbl_add(st, s);
+}
+
+// Set sort key of table entry idx. The lowercased string is allocated
+// from the table's arena, unless the string is already all lowercase.
+// Strings in the pool stay valid when it grows, so keys can point to them.
+static void strtbl_put_key(strtbl_t *st, int idx) {
+    strkey_t *key = &st->keys[idx];
+    strref_t ref = st->base[idx];
+    const char *s = st->pool + ref.off;
+
+    key->folded = s;
+    for (uint32_t i=0; i < ref.len; i++) {
+        if (tolower((unsigned char) s[i]) != (unsigned char) s[i]) {
+            char *folded = aalloc(st->arena, ref.len+1);
+            for (uint32_t k=0; k < ref.len; k++)
+                folded[k] = tolower((unsigned char) s[k]);
+            folded[ref.len] = 0;
+            key->folded = folded;
+            break;
+        }
+    }
+
+    const unsigned char *f = (const unsigned char *) key->folded;
+    key->prefix = 0;
+    for (uint32_t i=0; i < 8; i++) {
+        key->prefix <<= 8;
+        if (i < ref.len)
+            key->prefix |= f[i];
+    }
+}
+// Build sort keys of all strings. Strings added later get keys as they
+// are added, until the table is sorted.
+void strtbl_build_keys(strtbl_t *st) {
+    st->keys = aalloc(st->arena, sizeof(strkey_t) * st->cap);
+    for (int i=0; i < st->len; i++)
+        strtbl_put_key(st, i);
+}
+// Compare entries idx1 and idx2 ignoring case, like strcasecmp().
+// With sort keys built, most comparisons are settled by comparing the
+// 8 byte prefixes.
+int strtbl_casecmp(strtbl_t *st, int idx1, int idx2) {
+    if (idx1 == idx2)
+        return 0;
+    if (st->keys == NULL || idx1 >= st->len || idx2 >= st->len)
+        return strcasecmp(strtbl_get(*st, idx1).bytes, strtbl_get(*st, idx2).bytes);
+
+    strkey_t *key1 = &st->keys[idx1];
+    strkey_t *key2 = &st->keys[idx2];
+    if (key1->prefix != key2->prefix)
+        return key1->prefix < key2->prefix ? -1 : 1;
+    return strcmp(key1->folded, key2->folded);
+}
+
+static void swap_strref(strref_t *refs, int i, int j) {
+    strref_t tmp = refs[i];
+    refs[i] = refs[j];
+    refs[j] = tmp;
 }
+// Strings are compared as str_t views, so cmp is the same as for str_t arrays.
 static int sort_strtbl_partition(strtbl_t *t, int start, int end, cmpfunc_t cmp) {
     int imid = start;
-    str_t pivot = t->base[end];
+    str_t pivot = strtbl_view(t, t->base[end]);
 
     for (int i=start; i < end; i++) {
-        if (cmp(&t->base[i], &pivot) < 0) {
-            swap_str(t->base, imid, i);
+        str_t s = strtbl_view(t, t->base[i]);
+        if (cmp(&s, &pivot) < 0) {
+            swap_strref(t->base, imid, i);
             imid++;
         }
     }
-    swap_str(t->base, imid, end);
+    swap_strref(t->base, imid, end);
     return imid;
 }
 void sort_strtbl_part(strtbl_t *t, int start, int end, cmpfunc_t cmp) {
@@ -165,6 +388,8 @@ void sort_strtbl_part(strtbl_t *t, int start, int end, cmpfunc_t cmp) {
 void sort_strtbl(strtbl_t *t, cmpfunc_t cmp) {
     // [0] element is always "" so don't include in sorting.
     sort_strtbl_part(t, 1, t->len-1, cmp);
+    t->hidx = NULL;
+    t->keys = NULL;
 }
 int cmp_str(void *a, void *b) {
     str_t *stra = a;
@@ -172,7 +397,7 @@ int cmp_str(void *a, void *b) {
     return strcmp(stra->bytes, strb->bytes);
 }
 
-void init_entrytbl(entrytbl_t *t, arena_t *a, short cap) {
+void init_entrytbl(entrytbl_t *t, arena_t *a, int cap) {
     if (cap == 0)
         cap = SIZE_TINY;
 
@@ -181,20 +406,18 @@ void init_entrytbl(entrytbl_t *t, arena_t *a, short cap) {
     t->len = 0;
     t->cap = cap;
 }
-short entrytbl_add(entrytbl_t *t, entry_t e) {
+int entrytbl_add(entrytbl_t *t, entry_t e) {
     assert(t->cap > 0);
     assert(t->len >= 0);
 
     // If out of space, double the capacity.
     // Create a new memory block with double capacity and copy existing entry table to it.
     if (t->len >= t->cap) {
-        if (t->cap == SHRT_MAX) {
-            fprintf(stderr, "entrytbl_add() Maximum capacity reached %d\n", t->cap);
+        if (t->cap == INT_MAX) {
+            fprintf(errout(), "entrytbl_add() Maximum capacity reached %d\n", t->cap);
             abort();
         }
-        int newcap = (int)t->cap * 2;
-        if (newcap > SHRT_MAX)
-            newcap = SHRT_MAX;
+        int newcap = t->cap > INT_MAX/2 ? INT_MAX : t->cap * 2;
 
         entry_t *newbase = aalloc(t->arena, sizeof(entry_t) * newcap);
         memcpy(newbase, t->base, sizeof(entry_t) * t->cap);
@@ -258,9 +481,10 @@ time_t date_from_cal(short year, short month, short day) {
     tm.tm_year = year - 1900;
     tm.tm_mon = month-1;
     tm.tm_mday = day;
+    tm.tm_isdst = -1;
     t = mktime(&tm);
     if (t == -1) {
-        fprintf(stderr, "date_from_cal(%d, %d, %d) mktime() error\n", year, month, day);
+        fprintf(errout(), "date_from_cal(%d, %d, %d) mktime() error\n", year, month, day);
         return 0;
     }
     return t;
@@ -271,12 +495,14 @@ time_t date_from_iso(char *isodate) {
     memset(&tm, 0, sizeof(struct tm));
 
     if (strptime(isodate, "%F", &tm) == NULL) {
-        fprintf(stderr, "date_from_iso('%s') strptime() error\n", isodate);
+        fprintf(errout(), "date_from_iso('%s') strptime() error\n", isodate);
         return 0;
     }
+    // Let mktime() work out whether DST is in effect on the date.
+    tm.tm_isdst = -1;
     t = mktime(&tm);
     if (t < 0) {
-        fprintf(stderr, "date_assign_iso('%s') mktime() error\n", isodate);
+        fprintf(errout(), "date_assign_iso('%s') mktime() error\n", isodate);
         return 0;
     }
     return t;
@@ -287,12 +513,13 @@ time_t date_from_iso_datetime(char *isodatetime) {
     memset(&tm, 0, sizeof(struct tm));
 
     if (strptime(isodatetime, "%FT%H:%M", &tm) == NULL) {
-        fprintf(stderr, "date_from_iso_datetime('%s') strptime() error\n", isodatetime);
+        fprintf(errout(), "date_from_iso_datetime('%s') strptime() error\n", isodatetime);
         return 0;
     }
+    tm.tm_isdst = -1;
     t = mktime(&tm);
     if (t < 0) {
-        fprintf(stderr, "date_assign_iso_datetime('%s') mktime() error\n", isodatetime);
+        fprintf(errout(), "date_assign_iso_datetime('%s') mktime() error\n", isodatetime);
         return 0;
     }
     return t;
@@ -324,25 +551,113 @@ void date_strftime(time_t dt, const char *fmt, char *buf, size_t buf_len) {
     localtime_r(&dt, &tm);
     strftime(buf, buf_len, fmt, &tm);
 }
+
+// Local day containing the last date converted by date_to_iso(),
+// date_to_hhmm() or date_to_cal(), with its date already rendered.
+// Dates are mostly converted in order (saving, listing), so most fall on
+// the same day as the one before and skip localtime_r() and strftime().
+// Days where the clock changes (DST) aren't cached.
+// The timezone is assumed not to change while running.
+typedef struct {
+    time_t start;
+    time_t end;
+    int cached;     // 0 if [start, end) is around a clock change
+    short year, month, day;
+    char iso[ISO_DATE_LEN+1];
+} dateday_t;
+
+static __thread dateday_t t_dateday = {1, 0, 0};
+
+static void put_digits(char *buf, int v, int ndigits) {
+    for (int i=ndigits-1; i >= 0; i--) {
+        buf[i] = '0' + v % 10;
+        v /= 10;
+    }
+}
+// Return cached day of dt, or NULL if dt's day can't be cached.
+static dateday_t *get_dateday(time_t dt) {
+    dateday_t *d = &t_dateday;
+    if (dt >= d->start && dt < d->end)
+        return d->cached ? d : NULL;
+
+    struct tm tm, tmstart, tmend;
+    if (localtime_r(&dt, &tm) == NULL)
+        return NULL;
+    int year = tm.tm_year + 1900;
+    if (year < 0 || year > 9999)
+        return NULL;
+
+    // The day is cached only if it is exactly 24 hours long by the clock,
+    // so that the time of day is the seconds since start.
+    time_t start = dt - (tm.tm_hour*60*60 + tm.tm_min*60 + tm.tm_sec);
+    time_t last = start + 24*60*60 - 1;
+    if (localtime_r(&start, &tmstart) == NULL || localtime_r(&last, &tmend) == NULL)
+        return NULL;
+    d->start = start;
+    d->end = last+1;
+    d->cached = 0;
+    if (tmstart.tm_mday != tm.tm_mday || tmstart.tm_hour != 0 || tmstart.tm_min != 0 || tmstart.tm_sec != 0)
+        return NULL;
+    if (tmend.tm_mday != tm.tm_mday || tmend.tm_hour != 23 || tmend.tm_min != 59 || tmend.tm_sec != 59)
+        return NULL;
+
+    d->cached = 1;
+    d->year = year;
+    d->month = tm.tm_mon+1;
+    d->day = tm.tm_mday;
+    put_digits(d->iso, d->year, 4);
+    d->iso[4] = '-';
+    put_digits(d->iso+5, d->month, 2);
+    d->iso[7] = '-';
+    put_digits(d->iso+8, d->day, 2);
+    d->iso[10] = '\0';
+    return d;
+}
 void date_to_iso(time_t dt, char *buf, size_t buf_len) {
+    dateday_t *d = get_dateday(dt);
+    if (d != NULL && buf_len >= sizeof(d->iso)) {
+        memcpy(buf, d->iso, sizeof(d->iso));
+        return;
+    }
     struct tm tm;
     localtime_r(&dt, &tm);
-    strftime(buf, buf_len, "%F", &tm);
+    if (strftime(buf, buf_len, "%F", &tm) == 0 && buf_len > 0)
+        buf[0] = '\0';
 }
 void date_to_hhmm(time_t dt, char *buf, size_t buf_len) {
+    dateday_t *d = get_dateday(dt);
+    if (d != NULL && buf_len >= HHMM_TIME_LEN+1) {
+        int mins = (dt - d->start) / 60;
+        put_digits(buf, mins / 60, 2);
+        buf[2] = ':';
+        put_digits(buf+3, mins % 60, 2);
+        buf[5] = '\0';
+        return;
+    }
     struct tm tm;
     localtime_r(&dt, &tm);
     strftime(buf, buf_len, "%H:%M", &tm);
 }
 void date_to_cal(time_t dt, short *retyear, short *retmonth, short *retday) {
-    struct tm tm;
-    localtime_r(&dt, &tm);
+    short year, month, day;
+    dateday_t *d = get_dateday(dt);
+    if (d != NULL) {
+        year = d->year;
+        month = d->month;
+        day = d->day;
+    } else {
+        struct tm tm;
+        localtime_r(&dt, &tm);
+        year = tm.tm_year + 1900;
+        month = tm.tm_mon+1;
+        day = tm.tm_mday;
+    }
     if (retyear)
-        *retyear = tm.tm_year + 1900;
+        *retyear = year;
     if (retmonth)
-        *retmonth = tm.tm_mon+1;
+        *retmonth = month;
     if (retday)
-        *retday = tm.tm_mday;
+        *retday = day;
 }
 time_t date_prev_month(time_t dt) {
     short year, month, day;
@@ -46,6 +46,11 @@ typedef ptrdiff_t idx_t;
 void panic(char *s);
 void panic_err(char *s);
 void print_error(const char *s);
+
+// Error messages go to stderr, or to the stream set for the calling
+// thread by set_errout().
+FILE *errout();
+void set_errout(FILE *f);
 int szequals(const char *s1, const char *s2);
 #define szequals(s1, s2) (!strcmp(s1, s2))
 
@@ -53,12 +58,17 @@ typedef struct {
     void *base;
     unsigned long pos;
     unsigned long cap;
+
+    // High-water mark of pos, shared by copies of the arena.
+    // NULL if not tracked.
+    unsigned long *peak;
 } arena_t;
 
 void init_arena(arena_t *a, unsigned long cap);
 void free_arena(arena_t *a);
 void reset_arena(arena_t *a);
 void *aalloc(arena_t *a, unsigned long size);
+unsigned long arena_peak(arena_t *a);
 
 #define STR(sz) (str_t){(char *)sz, (countof(sz)-1)}
 typedef struct {
@@ -72,19 +82,52 @@ int str_equals(str_t s, const char *sz);
 
 typedef int (*cmpfunc_t)(void *a, void *b);
 
+// String table entry, string at pool[off] of len bytes (plus a NUL).
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} strref_t;
+
+// Case-folded sort key of a string table entry: the first 8 bytes of the
+// lowercased string as a big endian integer, and the whole lowercased
+// string. Folded copies are allocated outside the pool, so keys don't
+// change the strings written out from the table.
+typedef struct {
+    uint64_t prefix;
+    const char *folded;
+} strkey_t;
+
+// Strings are packed one after another in one pool, so the table can be
+// written out or read back as two blocks (base and pool).
+// strtbl_get() returns a view into the pool.
 typedef struct {
     arena_t *arena;
-    str_t *base;
-    short cap;
-    short len;
+    strref_t *base;
+    int cap;
+    int len;
+
+    char *pool;
+    uint32_t pool_len;
+    uint32_t pool_cap;
+
+    // Optional hash index of string to table index, built by strtbl_intern().
+    int *hidx;
+    int hcap;
+
+    // Optional sort keys, built by strtbl_build_keys().
+    strkey_t *keys;
 } strtbl_t;
 
-void init_strtbl(strtbl_t *st, arena_t *a, short cap);
+void init_strtbl(strtbl_t *st, arena_t *a, int cap);
 strtbl_t dup_strtbl(strtbl_t st, arena_t *a);
-short strtbl_add(strtbl_t *st, const char *s);
-void strtbl_replace(strtbl_t *st, short idx, const char *s);
-str_t strtbl_get(strtbl_t st, short idx);
-short strtbl_find(strtbl_t st, const char *s);
+int init_strtbl_blocks(strtbl_t *st, arena_t *a, strref_t *base, int len, int cap, char *pool, uint32_t pool_len, uint32_t pool_cap);
+int strtbl_add(strtbl_t *st, const char *s);
+void strtbl_replace(strtbl_t *st, int idx, const char *s);
+str_t strtbl_get(strtbl_t st, int idx);
+int strtbl_find(strtbl_t st, const char *s);
+int strtbl_intern(strtbl_t *st, const char *s);
+void strtbl_build_keys(strtbl_t *st);
+int strtbl_casecmp(strtbl_t *st, int idx1, int idx2);
 
 void sort_strtbl(strtbl_t *t, cmpfunc_t cmp);
 int cmp_str(void *a, void *b);
@@ -92,18 +135,18 @@ int cmp_str(void *a, void *b);
 #define ENTRY(sz, f) (entry_t){STR(sz), f}
 typedef struct {
     str_t desc;
-    float val;
+    double val;
 } entry_t;
 
 typedef struct {
     arena_t *arena;
     entry_t *base;
-    short cap;
-    short len;
+    int cap;
+    int len;
 } entrytbl_t;
 
-void init_entrytbl(entrytbl_t *t, arena_t *a, short cap);
-short entrytbl_add(entrytbl_t *t, entry_t e);
+void init_entrytbl(entrytbl_t *t, arena_t *a, int cap);
+int entrytbl_add(entrytbl_t *t, entry_t e);
 
 void sort_entrytbl(entrytbl_t *t, cmpfunc_t cmp);
 int cmp_entry_val(void *a, void *b);
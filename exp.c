@@ -1,49 +1,92 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <ctype.h>
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
+#ifndef WINDOWS
+#include <pthread.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #include "clib.h"
 #include "exp.h"
+#include "exparc.h"
+#include "expext.h"
 
+static void idindex_put(exptbl_t *et, int id, int slot);
+static int save_partitions(const char *dir, exptbl_t *et);
+static void get_dir_state(const char *dir, expfile_state_t *fs);
+static void add_expense_path_size(const char *path, unsigned long *textsize, unsigned long *arcsize);
+static unsigned long arena_size_for(unsigned long textsize, unsigned long arcsize);
+static int write_expenses(const char *expfile, exptbl_t *et, int istart, int iend, expfile_state_t *fs, int archive);
 static exp_t read_expense(char *buf, exptbl_t *et);
+static int read_exprec(char *buf, exprec_t *rec);
+static int read_csv_exprec(char *buf, exprec_t *rec);
+static int read_import_record(FILE *f, char **buf, size_t *cap, int *nlines, exprec_t *rec);
+static int read_text_line(FILE *f, char **buf, size_t *cap, int whole_lines);
 static void chomp(char *buf);
 static char *skip_ws(char *startp);
 static char *next_field(char *startp);
+static int read_expense_journal(const char *expfile, exptbl_t *et);
+static long get_journal_size(const char *expfile);
+static void remove_expense_journal(const char *expfile);
 
-void init_exptbl(exptbl_t *et, short cap, arena_t *a) {
+void init_exptbl(exptbl_t *et, int cap, arena_t *a) {
     et->arena = a;
     et->base = aalloc(a, sizeof(exp_t) * cap);
     et->len = 0;
     et->cap = cap;
     init_strtbl(&et->strings, a, 512);
     init_strtbl(&et->cats, a, 8);
+    et->next_id = 1;
+    et->idindex = NULL;
+    et->idindex_cap = 0;
+    et->idindex_valid = 0;
+    memset(&et->fstate, 0, sizeof(et->fstate));
+    et->nfiles = 1;
+    et->ledgers = NULL;
+    et->partitioned = 0;
+    memset(et->part_loaded, 0, sizeof(et->part_loaded));
+    memset(et->part_dirty, 0, sizeof(et->part_dirty));
+    memset(et->part_archived, 0, sizeof(et->part_archived));
+    et->changes = NULL;
+    et->nchanges = -1;
+    et->journal_size = 0;
 }
-exp_t *get_exp(exptbl_t *et, short idx) {
+exp_t *get_exp(exptbl_t *et, int idx) {
     if (idx < 0 || idx >= et->len)
         return NULL;
     return &et->base[idx];
 }
-short add_exp(exptbl_t *et, exp_t exp) {
+int add_exp(exptbl_t *et, exp_t exp) {
     assert(et->cap > 0);
     assert(et->len >= 0);
 
     // If out of space, double the capacity.
     // Create a new memory block with double capacity and copy existing string table to it.
     if (et->len >= et->cap) {
-        if (et->cap == SHRT_MAX) {
-            fprintf(stderr, "add_exp() Maximum capacity reached %d\n", et->cap);
+        if (et->cap == INT_MAX) {
+            fprintf(errout(), "add_exp() Maximum capacity reached %d\n", et->cap);
             abort();
         }
-        int newcap = (int)et->cap * 2;
-        if (newcap > SHRT_MAX)
-            newcap = SHRT_MAX;
+        int newcap = et->cap > INT_MAX/2 ? INT_MAX : et->cap * 2;
 
         exp_t *newbase = aalloc(et->arena, sizeof(exp_t) * newcap);
         memcpy(newbase, et->base, sizeof(exp_t) * et->cap);
@@ -53,23 +96,116 @@ short add_exp(exptbl_t *et, exp_t exp) {
 
     et->base[et->len] = exp;
     et->len++;
+    mark_exp_dirty(et, exp);
+    if (exp.id >= et->next_id)
+        et->next_id = exp.id+1;
+    if (et->idindex_valid)
+        idindex_put(et, exp.id, et->len-1);
     return et->len-1;
 }
-void replace_exp(exptbl_t *et, short idx, exp_t exp) {
+void replace_exp(exptbl_t *et, int idx, exp_t exp) {
     assert(idx < et->len);
     if (idx >= et->len)
         return;
+    mark_exp_dirty(et, et->base[idx]);
+    mark_exp_dirty(et, exp);
     et->base[idx] = exp;
+    et->idindex_valid = 0;
 }
-void del_exp(exptbl_t *et, short idx) {
+void del_exp(exptbl_t *et, int idx) {
     assert(idx < et->len);
     if (idx >= et->len)
         return;
 
+    mark_exp_dirty(et, et->base[idx]);
+
     // Move last expense into slot for expense to delete.
     exp_t lastexp = et->base[et->len-1];
     et->base[idx] = lastexp;
     et->len--;
+    et->idindex_valid = 0;
+}
+int new_exp_id(exptbl_t *et) {
+    return et->next_id++;
+}
+
+static unsigned int hash_id(int id) {
+    return (unsigned int)id * 2654435761u;
+}
+// Set idindex entry for id to slot. Index must have room.
+static void idindex_put(exptbl_t *et, int id, int slot) {
+    // Keep load factor under 1/2.
+    if ((et->len+1) * 2 > et->idindex_cap) {
+        et->idindex_valid = 0;
+        return;
+    }
+    unsigned int mask = et->idindex_cap-1;
+    unsigned int i = hash_id(id) & mask;
+    while (et->idindex[i] != -1) {
+        if (et->base[et->idindex[i]].id == id)
+            break;
+        i = (i+1) & mask;
+    }
+    et->idindex[i] = slot;
+}
+static void build_idindex(exptbl_t *et) {
+    int cap = et->idindex_cap;
+    if (cap < 64)
+        cap = 64;
+    while (cap < (et->len+1) * 4)
+        cap *= 2;
+    if (cap > et->idindex_cap) {
+        et->idindex = aalloc(et->arena, sizeof(int) * cap);
+        et->idindex_cap = cap;
+    }
+    memset(et->idindex, 0xff, sizeof(int) * et->idindex_cap);
+    // Go backwards so that the first of any duplicate ids is indexed.
+    for (int i=et->len-1; i >= 0; i--)
+        idindex_put(et, et->base[i].id, i);
+    et->idindex_valid = 1;
+}
+// Return slot of expense with id, or -1 if not found.
+int find_exp_id(exptbl_t *et, int id) {
+    if (id <= 0)
+        return -1;
+    if (!et->idindex_valid)
+        build_idindex(et);
+
+    unsigned int mask = et->idindex_cap-1;
+    unsigned int i = hash_id(id) & mask;
+    while (et->idindex[i] != -1) {
+        int slot = et->idindex[i];
+        if (et->base[slot].id == id)
+            return slot;
+        i = (i+1) & mask;
+    }
+    return -1;
+}
+// Amount in whole cents. Totals are summed in cents so that they don't
+// drift from the float amounts.
+long long exp_cents(exp_t exp) {
+    return exp.amt * 100.0 + (exp.amt < 0 ? -0.5 : 0.5);
+}
+// Give expenses without an id, or with an id already taken by an earlier
+// expense, a new unique id. Expenses are visited in file order.
+static void assign_exp_ids(exptbl_t *et) {
+    int maxid = 0;
+    for (int i=0; i < et->len; i++) {
+        if (et->base[i].id > maxid)
+            maxid = et->base[i].id;
+    }
+    if (maxid+1 > et->next_id)
+        et->next_id = maxid+1;
+
+    et->idindex_valid = 0;
+    build_idindex(et);
+    for (int i=0; i < et->len; i++) {
+        exp_t *exp = &et->base[i];
+        if (exp->id > 0 && find_exp_id(et, exp->id) == i)
+            continue;
+        exp->id = new_exp_id(et);
+        idindex_put(et, exp->id, i);
+    }
 }
 
 // Order by expense date
@@ -87,56 +223,565 @@ int cmp_exp_date_cat(exptbl_t *et, void *a, void *b) {
     if (expa->date < expb->date) return -1;
     if (expa->date > expb->date) return 1;
 
-    str_t cata = strtbl_get(et->cats, expa->catid);
-    str_t catb = strtbl_get(et->cats, expb->catid);
-    return strcasecmp(cata.bytes, catb.bytes);
+    return strtbl_casecmp(&et->cats, expa->catid, expb->catid);
 }
 // Order by category name
 int cmp_exp_cat(exptbl_t *et, void *a, void *b) {
     exp_t *expa = a;
     exp_t *expb = b;
-    str_t cata = strtbl_get(et->cats, expa->catid);
-    str_t catb = strtbl_get(et->cats, expb->catid);
-
-    return strcasecmp(cata.bytes, catb.bytes);
+    return strtbl_casecmp(&et->cats, expa->catid, expb->catid);
 }
 static void swap_exp(exp_t *exps, int i, int j) {
     exp_t tmp = exps[i];
     exps[i] = exps[j];
     exps[j] = tmp;
 }
+// Compare by cmp, then by id, then by the rest of the fields. Sorts order
+// by all of them, so that the order doesn't depend on how expenses were
+// sorted (sequential or parallel, full or merged tail), even when ids
+// aren't unique. Expenses that compare equal are identical.
+static inline int cmp_exp_id(exptbl_t *et, exptbl_cmpfunc_t cmp, exp_t *a, exp_t *b) {
+    int z = cmp(et, a, b);
+    if (z != 0)
+        return z;
+    if (a->id != b->id)
+        return (a->id > b->id) - (a->id < b->id);
+    if (a->date != b->date)
+        return (a->date > b->date) - (a->date < b->date);
+    z = memcmp(&a->amt, &b->amt, sizeof(a->amt));
+    if (z != 0)
+        return z;
+    if (a->descid != b->descid)
+        return (a->descid > b->descid) - (a->descid < b->descid);
+    return (a->catid > b->catid) - (a->catid < b->catid);
+}
+// Hoare partition around the middle expense. Returns p such that
+// [start, p] <= pivot <= [p+1, end].
+// Already sorted expenses with a few new ones appended (the usual case when
+// saving) split evenly, and so do runs of equal keys (ex. sorting by
+// category), so neither degrades to O(n^2).
 static int sort_exptbl_partition(exptbl_t *et, int start, int end, exptbl_cmpfunc_t cmp) {
-    int imid = start;
-    exp_t pivot = et->base[end];
+    exp_t pivot = et->base[start + (end-start)/2];
+    int i = start-1;
+    int j = end+1;
 
-    for (int i=start; i < end; i++) {
-        if (cmp(et, &et->base[i], &pivot) < 0) {
-            swap_exp(et->base, imid, i);
-            imid++;
+    for (;;) {
+        do {
+            i++;
+        } while (cmp_exp_id(et, cmp, &et->base[i], &pivot) < 0);
+        do {
+            j--;
+        } while (cmp_exp_id(et, cmp, &et->base[j], &pivot) > 0);
+        if (i >= j)
+            return j;
+        swap_exp(et->base, i, j);
+    }
+}
+static void sort_exptbl_seq(exptbl_t *et, int start, int end, exptbl_cmpfunc_t cmp) {
+    // Recurse into the smaller part and loop on the larger one to keep
+    // the stack depth O(log n).
+    while (start < end) {
+        int p = sort_exptbl_partition(et, start, end, cmp);
+        if (p - start < end - p) {
+            sort_exptbl_seq(et, start, p, cmp);
+            start = p+1;
+        } else {
+            sort_exptbl_seq(et, p+1, end, cmp);
+            end = p;
+        }
+    }
+}
+
+// Expense tables with at least this many expenses are sorted in parallel
+// when there is more than one worker thread.
+#define SORT_PARALLEL_MIN 100000
+#define SORT_MAX_CHUNKS   64
+
+typedef struct {
+    exptbl_t *et;
+    exptbl_cmpfunc_t cmp;
+    int start;
+    int bounds[SORT_MAX_CHUNKS+1];  // chunk k is start + [bounds[k], bounds[k+1])
+    exp_t *src;
+    exp_t *dst;
+    int width;                      // chunks per run at this level
+    int parts;                      // tasks per merge of two runs
+} psort_t;
+
+static void psort_chunk_task(void *ctx, int k) {
+    psort_t *ps = ctx;
+    sort_exptbl_seq(ps->et, ps->start + ps->bounds[k], ps->start + ps->bounds[k+1]-1, ps->cmp);
+}
+
+// Merge one part of two adjacent runs from src into dst. The output of the
+// merge is split into equal parts, and the start of each part in both runs
+// is found by binary search (merge path), so that one large merge can still
+// be shared by all threads.
+static void psort_merge_task(void *ctx, int task) {
+    psort_t *ps = ctx;
+    int k = task / ps->parts * 2*ps->width;
+    int part = task % ps->parts;
+    int lo = ps->bounds[k];
+    int mid = ps->bounds[k + ps->width];
+    int hi = ps->bounds[k + 2*ps->width];
+    exp_t *a = ps->src + lo;
+    exp_t *b = ps->src + mid;
+    int na = mid - lo;
+    int nb = hi - mid;
+
+    long d0 = (long)(hi-lo) * part / ps->parts;
+    long d1 = (long)(hi-lo) * (part+1) / ps->parts;
+    int i0 = 0, i1 = 0;
+    for (int s=0; s < 2; s++) {
+        long d = s == 0 ? d0 : d1;
+        // Count of expenses from a among the first d of the merge, ties
+        // taken from a first.
+        long ilo = d > nb ? d - nb : 0;
+        long ihi = d < na ? d : na;
+        while (ilo < ihi) {
+            long i = (ilo + ihi) / 2;
+            long j = d - i;
+            if (cmp_exp_id(ps->et, ps->cmp, &a[i], &b[j-1]) <= 0)
+                ilo = i+1;
+            else
+                ihi = i;
         }
+        if (s == 0)
+            i0 = ilo;
+        else
+            i1 = ilo;
+    }
+
+    exp_t *out = ps->dst + lo + d0;
+    int i = i0, j = d0 - i0;
+    int iend = i1, jend = d1 - i1;
+    while (i < iend && j < jend) {
+        if (cmp_exp_id(ps->et, ps->cmp, &a[i], &b[j]) <= 0)
+            *out++ = a[i++];
+        else
+            *out++ = b[j++];
+    }
+    memcpy(out, a+i, sizeof(exp_t) * (iend-i));
+    out += iend-i;
+    memcpy(out, b+j, sizeof(exp_t) * (jend-j));
+}
+
+// Sort [start, end] with a merge sort on the worker pool: chunks are sorted
+// in parallel, then runs are merged pairwise, ping-ponging between the
+// table and a temp buffer. Returns 1 if the range wasn't sorted (no memory
+// for the temp buffer).
+static int sort_exptbl_parallel(exptbl_t *et, int start, int end, exptbl_cmpfunc_t cmp, int nthreads) {
+    int n = end-start+1;
+    exp_t *tmp = malloc(sizeof(exp_t) * n);
+    if (tmp == NULL)
+        return 1;
+
+    psort_t ps;
+    ps.et = et;
+    ps.cmp = cmp;
+    ps.start = start;
+    int nchunks = 2;
+    while (nchunks < 2*nthreads && nchunks < SORT_MAX_CHUNKS)
+        nchunks *= 2;
+    for (int k=0; k <= nchunks; k++)
+        ps.bounds[k] = (long)n * k / nchunks;
+
+    ps.src = et->base + start;
+    ps.dst = tmp;
+    run_parallel(nchunks, psort_chunk_task, &ps);
+
+    for (ps.width=1; ps.width < nchunks; ps.width *= 2) {
+        int nmerges = nchunks / (2*ps.width);
+        ps.parts = (2*nthreads + nmerges-1) / nmerges;
+        run_parallel(nmerges * ps.parts, psort_merge_task, &ps);
+        exp_t *t = ps.src;
+        ps.src = ps.dst;
+        ps.dst = t;
     }
-    swap_exp(et->base, imid, end);
-    return imid;
+    if (ps.src != et->base + start)
+        memcpy(et->base + start, ps.src, sizeof(exp_t) * n);
+    free(tmp);
+    return 0;
 }
+
+// Sort expenses [start, end] by cmp, then by id.
 void sort_exptbl_part(exptbl_t *et, int start, int end, exptbl_cmpfunc_t cmp) {
-    if (start >= end)
-        return;
-    int pivot = sort_exptbl_partition(et, start, end, cmp);
-    sort_exptbl_part(et, start, pivot-1, cmp);
-    sort_exptbl_part(et, pivot+1, end, cmp);
+    et->idindex_valid = 0;
+
+    if (end-start+1 >= SORT_PARALLEL_MIN && parallel_threads() > 1) {
+        if (sort_exptbl_parallel(et, start, end, cmp, parallel_threads()) == 0)
+            return;
+    }
+    sort_exptbl_seq(et, start, end, cmp);
 }
 void sort_exptbl(exptbl_t *et, exptbl_cmpfunc_t cmp) {
     sort_exptbl_part(et, 0, et->len-1, cmp);
 }
 
+// Merge expenses [istart, et->len) into the already sorted expenses [0, istart)
+// in a single pass. Both runs must be sorted by cmp.
+void merge_exptbl_tail(exptbl_t *et, int istart, exptbl_cmpfunc_t cmp) {
+    int ntail = et->len - istart;
+    if (istart <= 0 || ntail <= 0)
+        return;
+    // Nothing to do if tail already comes after head.
+    if (cmp_exp_id(et, cmp, &et->base[istart-1], &et->base[istart]) <= 0)
+        return;
+
+    // Copy tail to unused space at the end of the expense arena, then merge
+    // from the back so head items are moved at most once.
+    arena_t scratch = *et->arena;
+    exp_t *tail = aalloc(&scratch, sizeof(exp_t) * ntail);
+    memcpy(tail, et->base + istart, sizeof(exp_t) * ntail);
+
+    et->idindex_valid = 0;
+    int i = istart-1;
+    int j = ntail-1;
+    int k = et->len-1;
+    while (j >= 0) {
+        if (i >= 0 && cmp_exp_id(et, cmp, &et->base[i], &tail[j]) > 0)
+            et->base[k--] = et->base[i--];
+        else
+            et->base[k--] = tail[j--];
+    }
+}
+
+// Duplicates
+//
+// Expenses with the same amount and the same description ignoring case,
+// spaces and punctuation, no more than window seconds apart, are near
+// duplicates. They're exact duplicates if date, description and category
+// are the same too.
+//
+// Expenses are hashed by (date / window, description, amount) into an
+// open addressing table that keeps the latest expense of each key. In one
+// pass in date order, each expense is only compared with the latest
+// expense of its key in its own and the previous date bucket, which is the
+// closest earlier candidate. When checking imported expenses, a backward
+// pass first finds the earliest existing expense of the key in the same
+// and the next bucket, since an import can duplicate later expenses too.
+
+typedef struct {
+    uint32_t hash;
+    int idx;            // -1 if empty
+} dupeslot_t;
+
+typedef struct {
+    exptbl_t *et;
+    long width;         // of a date bucket
+    uint32_t *deschash; // by descid, 0 until computed
+    dupeslot_t *slots;
+    int mask;
+} dupetbl_t;
+
+// Next char of *ps ignoring case, spaces and punctuation, 0 at the end.
+static int next_norm_char(const char **ps) {
+    const unsigned char *p = (const unsigned char *)*ps;
+    while (*p != 0 && *p < 0x80 && !isalnum(*p))
+        p++;
+    *ps = (const char *)(*p != 0 ? p+1 : p);
+    return tolower(*p);
+}
+static uint32_t hash_norm_desc(const char *s) {
+    uint32_t h = 2166136261u;
+    int c;
+    while ((c = next_norm_char(&s)) != 0)
+        h = (h ^ c) * 16777619u;
+    return h != 0 ? h : 1;
+}
+static int equal_norm_desc(const char *a, const char *b) {
+    int ca, cb;
+    do {
+        ca = next_norm_char(&a);
+        cb = next_norm_char(&b);
+        if (ca != cb)
+            return 0;
+    } while (ca != 0);
+    return 1;
+}
+
+static uint32_t get_desc_hash(dupetbl_t *dt, int descid) {
+    if (dt->deschash[descid] == 0)
+        dt->deschash[descid] = hash_norm_desc(strtbl_get(dt->et->strings, descid).bytes);
+    return dt->deschash[descid];
+}
+static int same_norm_desc(dupetbl_t *dt, int descid1, int descid2) {
+    if (descid1 == descid2)
+        return 1;
+    if (get_desc_hash(dt, descid1) != get_desc_hash(dt, descid2))
+        return 0;
+    return equal_norm_desc(strtbl_get(dt->et->strings, descid1).bytes, strtbl_get(dt->et->strings, descid2).bytes);
+}
+
+static long long date_bucket(time_t date, long width) {
+    long long d = date;
+    return d >= 0 ? d / width : -((-d + width-1) / width);
+}
+static uint32_t dupe_key_hash(uint32_t deschash, long long bucket, long long cents) {
+    uint64_t h = deschash;
+    h ^= (uint64_t)bucket * 0x9e3779b97f4a7c15ULL;
+    h ^= (uint64_t)cents * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Slot of the key of exp with date bucket: the slot of the latest expense
+// with that key, or the empty slot where it goes.
+static int find_dupe_slot(dupetbl_t *dt, exp_t *exp, long long bucket, uint32_t hash) {
+    int i = hash & dt->mask;
+    while (dt->slots[i].idx != -1) {
+        exp_t *other = &dt->et->base[dt->slots[i].idx];
+        if (dt->slots[i].hash == hash && date_bucket(other->date, dt->width) == bucket &&
+            exp_cents(*other) == exp_cents(*exp) && same_norm_desc(dt, other->descid, exp->descid))
+            return i;
+        i = (i+1) & dt->mask;
+    }
+    return i;
+}
+
+// Call func for each expense in [istart, iend) of et that duplicates an
+// earlier one, with the index of the closest earlier match and DUPE_EXACT
+// or DUPE_NEAR, in index order. et must be sorted by date. If new_id isn't
+// 0, only expenses with ids new_id and up are checked, and only against the
+// ones with lower ids (ex. imported expenses against existing ones), which
+// can be up to window earlier or later.
+// Returns the number of duplicates.
+int find_exp_dupes(exptbl_t *et, int istart, int iend, long window, int new_id, dupe_func_t func, void *ctx) {
+    // Borrow the unused end of the expense arena for the table.
+    arena_t tmp = *et->arena;
+    dupetbl_t dt;
+    dt.et = et;
+    dt.width = window > 0 ? window : 1;
+    dt.deschash = aalloc(&tmp, sizeof(uint32_t) * (et->strings.len+1));
+    memset(dt.deschash, 0, sizeof(uint32_t) * (et->strings.len+1));
+    int nslots = 16;
+    while (nslots < 2*(iend-istart))
+        nslots *= 2;
+    dt.slots = aalloc(&tmp, sizeof(dupeslot_t) * nslots);
+    for (int i=0; i < nslots; i++)
+        dt.slots[i].idx = -1;
+    dt.mask = nslots-1;
+
+    // Closest later existing match of each checked expense, -1 if none.
+    int *later = NULL;
+    if (new_id != 0) {
+        later = aalloc(&tmp, sizeof(int) * (iend-istart));
+        for (int i=iend-1; i >= istart; i--) {
+            exp_t *exp = &et->base[i];
+            long long bucket = date_bucket(exp->date, dt.width);
+            long long cents = exp_cents(*exp);
+            uint32_t deschash = get_desc_hash(&dt, exp->descid);
+            uint32_t hash = dupe_key_hash(deschash, bucket, cents);
+            int slot = find_dupe_slot(&dt, exp, bucket, hash);
+            if (exp->id < new_id) {
+                dt.slots[slot].hash = hash;
+                dt.slots[slot].idx = i;
+                continue;
+            }
+            int match = dt.slots[slot].idx;
+            if (match == -1) {
+                int next = find_dupe_slot(&dt, exp, bucket+1, dupe_key_hash(deschash, bucket+1, cents));
+                match = dt.slots[next].idx;
+            }
+            if (match != -1 && et->base[match].date - exp->date > window)
+                match = -1;
+            later[i-istart] = match;
+        }
+        for (int i=0; i < nslots; i++)
+            dt.slots[i].idx = -1;
+    }
+
+    int ndupes = 0;
+    for (int i=istart; i < iend; i++) {
+        exp_t *exp = &et->base[i];
+        long long bucket = date_bucket(exp->date, dt.width);
+        long long cents = exp_cents(*exp);
+        uint32_t deschash = get_desc_hash(&dt, exp->descid);
+        uint32_t hash = dupe_key_hash(deschash, bucket, cents);
+        int slot = find_dupe_slot(&dt, exp, bucket, hash);
+        if (new_id != 0 && exp->id < new_id) {
+            dt.slots[slot].hash = hash;
+            dt.slots[slot].idx = i;
+            continue;
+        }
+        int match = dt.slots[slot].idx;
+        if (match == -1) {
+            int prev = find_dupe_slot(&dt, exp, bucket-1, dupe_key_hash(deschash, bucket-1, cents));
+            match = dt.slots[prev].idx;
+        }
+        if (match != -1 && exp->date - et->base[match].date > window)
+            match = -1;
+        if (later != NULL && later[i-istart] != -1 &&
+            (match == -1 || et->base[later[i-istart]].date - exp->date < exp->date - et->base[match].date))
+            match = later[i-istart];
+        if (match != -1) {
+            exp_t *m = &et->base[match];
+            int exact = m->date == exp->date && m->descid == exp->descid && m->catid == exp->catid;
+            func(ctx, i, match, exact ? DUPE_EXACT : DUPE_NEAR);
+            ndupes++;
+        }
+        if (new_id == 0) {
+            dt.slots[slot].hash = hash;
+            dt.slots[slot].idx = i;
+        }
+    }
+    return ndupes;
+}
+
+// Category statistics
+//
+// Means and variances are updated one amount at a time with Welford's
+// algorithm, which doesn't lose precision to a large sum of squares.
+// Statistics of separate chunks of expenses are merged with Chan's
+// formula, so chunks can be summed in parallel.
+
+// Expense ranges with at least this many expenses get their statistics
+// summed in parallel when there is more than one worker thread.
+#define CATSTAT_PARALLEL_MIN 100000
+#define CATSTAT_MAX_CHUNKS   16
+
+void catstat_add(catstat_t *cs, double amt) {
+    if (cs->count == 0 || amt < cs->min)
+        cs->min = amt;
+    if (cs->count == 0 || amt > cs->max)
+        cs->max = amt;
+    cs->count++;
+    double d = amt - cs->mean;
+    cs->mean += d / cs->count;
+    cs->m2 += d * (amt - cs->mean);
+}
+
+void catstat_merge(catstat_t *cs, catstat_t *other) {
+    if (other->count == 0)
+        return;
+    if (cs->count == 0) {
+        *cs = *other;
+        return;
+    }
+    long n = cs->count + other->count;
+    double d = other->mean - cs->mean;
+    cs->mean += d * other->count / n;
+    cs->m2 += other->m2 + d*d * ((double)cs->count * other->count / n);
+    cs->count = n;
+    if (other->min < cs->min)
+        cs->min = other->min;
+    if (other->max > cs->max)
+        cs->max = other->max;
+}
+
+// Population variance of the amounts.
+double catstat_variance(catstat_t *cs) {
+    if (cs->count == 0)
+        return 0;
+    return cs->m2 / cs->count;
+}
+
+typedef struct {
+    exptbl_t *et;
+    int istart;
+    int iend;
+    int nchunks;
+    int ncats;
+    catstat_t *chunks;  // ncats statistics per chunk
+} catstatjob_t;
+
+static void catstat_chunk_task(void *ctx, int k) {
+    catstatjob_t *job = ctx;
+    long n = job->iend - job->istart;
+    int start = job->istart + n*k / job->nchunks;
+    int end = job->istart + n*(k+1) / job->nchunks;
+    catstat_t *stats = job->chunks + (long)k * job->ncats;
+    for (int i=start; i < end; i++) {
+        exp_t exp = job->et->base[i];
+        catstat_add(&stats[exp.catid], exp_cents(exp) / 100.0);
+    }
+}
+
+// Statistics of expenses [istart, iend) by category into stats, which
+// must have room for et->cats.len+1 entries indexed by catid.
+void get_cat_stats(exptbl_t *et, int istart, int iend, catstat_t *stats) {
+    int ncats = et->cats.len+1;
+    memset(stats, 0, sizeof(catstat_t) * ncats);
+
+    // Each chunk needs its own statistics of every category, so only use
+    // as many chunks as keep those small next to the chunk.
+    int nchunks = 1;
+    if (iend-istart >= CATSTAT_PARALLEL_MIN && parallel_threads() > 1) {
+        nchunks = parallel_threads();
+        if (nchunks > CATSTAT_MAX_CHUNKS)
+            nchunks = CATSTAT_MAX_CHUNKS;
+        while (nchunks > 1 && (long)ncats * nchunks > iend-istart)
+            nchunks--;
+    }
+    catstatjob_t job = {et, istart, iend, nchunks, ncats, stats};
+    if (nchunks > 1)
+        job.chunks = calloc((long)nchunks * ncats, sizeof(catstat_t));
+    if (job.chunks == NULL) {
+        job.nchunks = 1;
+        job.chunks = stats;
+    }
+    run_parallel(job.nchunks, catstat_chunk_task, &job);
+
+    if (job.chunks != stats) {
+        for (int k=0; k < job.nchunks; k++) {
+            for (int c=0; c < ncats; c++)
+                catstat_merge(&stats[c], &job.chunks[(long)k*ncats + c]);
+        }
+        free(job.chunks);
+    }
+}
+
+#ifdef _WIN32
+#define EXPENSE_FILES_SEP ';'
+#else
+#define EXPENSE_FILES_SEP ':'
+#endif
+
+// Get all expense files from $EXP2FILE, which can be a list of files
+// separated by ':' (';' on Windows). The first file is the one that
+// changes are saved to. Returns number of files.
+int get_expense_filenames(arena_t *a, str_t *files, int maxfiles) {
+    char buf[2048];
+    char *path = getenv("EXP2FILE");
+    int nfiles = 0;
+
+    if (path == NULL || strchr(path, EXPENSE_FILES_SEP) == NULL) {
+        files[0] = get_expense_filename(a);
+        return 1;
+    }
+
+    while (*path != '\0' && nfiles < maxfiles) {
+        char *sep = strchr(path, EXPENSE_FILES_SEP);
+        int len = sep ? sep-path : (int)strlen(path);
+        if (len > 0) {
+            snprintf(buf, sizeof(buf), "%.*s", len, path);
+            files[nfiles++] = new_str(a, buf);
+        }
+        if (sep == NULL)
+            break;
+        path = sep+1;
+    }
+    if (nfiles == 0)
+        files[nfiles++] = get_expense_filename(a);
+    return nfiles;
+}
+
 str_t get_expense_filename(arena_t *a) {
     char buf[2048];
     static char expenses_filename[] = "expenses";
     char *path;
 
     path = getenv("EXP2FILE");
-    if (path != NULL && strlen(path) > 0)
-        return new_str(a, path);
+    if (path != NULL && strlen(path) > 0) {
+        // Use first file of a list of expense files.
+        char *sep = strchr(path, EXPENSE_FILES_SEP);
+        if (sep == NULL)
+            return new_str(a, path);
+        snprintf(buf, sizeof(buf), "%.*s", (int)(sep-path), path);
+        return new_str(a, buf);
+    }
 
     // $WINEXPFILE not set, so read expense filename from home directory
 
@@ -163,6 +808,200 @@ str_t get_expense_filename(arena_t *a) {
 #endif
 }
 
+#ifndef WINDOWS
+// fsync the directory containing file so that a rename into it is durable.
+static void sync_parent_dir(const char *file) {
+    char dir[2048];
+    snprintf(dir, sizeof(dir), "%s", file);
+    char *p = strrchr(dir, '/');
+    if (p == NULL)
+        snprintf(dir, sizeof(dir), ".");
+    else if (p == dir)
+        p[1] = 0;
+    else
+        *p = 0;
+
+    int fd = open(dir, O_RDONLY);
+    if (fd == -1)
+        return;
+    fsync(fd);
+    close(fd);
+}
+#endif
+
+// Unix socket used by exp serve, next to the expense file. With more than
+// one expense file, the name also has a hash of the whole list, so a
+// server only answers clients that load the same files.
+str_t get_socket_filename(arena_t *a) {
+    char buf[2048];
+    str_t files[MAX_EXPENSE_FILES];
+    arena_t scratch = *a;
+    int nfiles = get_expense_filenames(&scratch, files, countof(files));
+    if (nfiles == 1) {
+        snprintf(buf, sizeof(buf), "%s.sock", files[0].bytes);
+        return new_str(a, buf);
+    }
+
+    // FNV-1a of the file names, each with its NUL.
+    uint32_t h = 2166136261u;
+    for (int k=0; k < nfiles; k++) {
+        for (int i=0; i <= files[k].len; i++)
+            h = (h ^ (unsigned char) files[k].bytes[i]) * 16777619u;
+    }
+    snprintf(buf, sizeof(buf), "%s.%08x.sock", files[0].bytes, h);
+    return new_str(a, buf);
+}
+
+// Expense file locking
+//
+// Locks are fcntl() record locks on <expfile>.lock, since the expense file
+// itself is replaced on every save. Two bytes of the lock file are used:
+//
+// WRITE_BYTE: held exclusively by a process changing expenses, from before
+//   it loads the expense file until its save is done. Writers wait for each
+//   other so that no change is lost. Readers never take it.
+//
+// COMMIT_BYTE: held shared by readers while they open and parse the expense
+//   file, and exclusively by save while it swaps in the new file. Readers
+//   only wait on each other for the moment it takes to rename a file.
+//
+// Each reader parses a complete snapshot, since saves write a new file and
+// atomically rename it over the old one.
+//
+// Locks are open file description locks where available, owned by the fd
+// they're taken on rather than by the process. The write lock and save's
+// commit lock are taken on g_lockfd, and each thread takes its read lock
+// on its own fd, so that a reader thread (ex. the server's background
+// reload) waits for the main thread's commit and its unlock doesn't
+// release the main thread's locks.
+
+#define LOCK_WRITE_BYTE  0
+#define LOCK_COMMIT_BYTE 1
+
+static int g_lockfd = -1;
+static int g_write_locked = 0;
+static __thread int t_readlockfd = -1;
+static __thread int t_readlocks = 0;
+
+#ifndef WINDOWS
+#ifdef F_OFD_SETLK
+#define LOCK_SET  F_OFD_SETLK
+#define LOCK_SETW F_OFD_SETLKW
+#else
+#define LOCK_SET  F_SETLK
+#define LOCK_SETW F_SETLKW
+#endif
+
+static int set_file_lock(int fd, short type, int byte, const char *waitmsg) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+
+    if (fcntl(fd, LOCK_SET, &fl) == 0)
+        return 0;
+    if (errno != EACCES && errno != EAGAIN)
+        return -1;
+
+    if (waitmsg != NULL)
+        fprintf(errout(), "%s\n", waitmsg);
+    while (fcntl(fd, LOCK_SETW, &fl) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+// Open a new fd on the lock file. Returns -1 on error.
+static int open_lock_fd(const char *expfile) {
+    char lockfile[2048];
+    snprintf(lockfile, sizeof(lockfile), "%s.lock", expfile);
+    return open(lockfile, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+}
+static int open_lock_file() {
+    char buf[2048];
+    arena_t scratch;
+
+    if (g_lockfd != -1)
+        return 0;
+    scratch.base = buf;
+    scratch.pos = 0;
+    scratch.cap = sizeof(buf);
+    scratch.peak = NULL;
+    str_t expfile = get_expense_filename(&scratch);
+    g_lockfd = open_lock_fd(expfile.bytes);
+    if (g_lockfd == -1)
+        return -1;
+    return 0;
+}
+#endif
+
+// Take EXPLOCK_READ before reading the expense file and EXPLOCK_WRITE
+// before loading expenses that will be changed and saved.
+// If the lock file can't be created (ex. read-only directory), expenses
+// are accessed without locking.
+// Read locks nest within a thread.
+int lock_expense_file(int lock) {
+#ifndef WINDOWS
+    if (lock == EXPLOCK_WRITE) {
+        if (open_lock_file() != 0)
+            return 0;
+        if (g_write_locked)
+            return 0;
+        if (set_file_lock(g_lockfd, F_WRLCK, LOCK_WRITE_BYTE, "Waiting for another exp process to save changes...") != 0) {
+            print_error("Error locking expense file");
+            return -1;
+        }
+        g_write_locked = 1;
+    } else if (lock == EXPLOCK_READ) {
+        if (t_readlocks > 0) {
+            t_readlocks++;
+            return 0;
+        }
+#ifdef F_OFD_SETLK
+        char buf[2048];
+        arena_t scratch = {buf, 0, sizeof(buf), NULL};
+        str_t expfile = get_expense_filename(&scratch);
+        t_readlockfd = open_lock_fd(expfile.bytes);
+#else
+        // Closing any fd of the lock file releases all of the process's
+        // locks, so readers share g_lockfd.
+        t_readlockfd = open_lock_file() == 0 ? g_lockfd : -1;
+#endif
+        if (t_readlockfd == -1)
+            return 0;
+        t_readlocks = 1;
+        if (set_file_lock(t_readlockfd, F_RDLCK, LOCK_COMMIT_BYTE, NULL) != 0) {
+            print_error("Error locking expense file");
+            unlock_expense_file(EXPLOCK_READ);
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+void unlock_expense_file(int lock) {
+#ifndef WINDOWS
+    if (lock == EXPLOCK_WRITE) {
+        if (g_lockfd == -1 || !g_write_locked)
+            return;
+        set_file_lock(g_lockfd, F_UNLCK, LOCK_WRITE_BYTE, NULL);
+        g_write_locked = 0;
+    } else if (lock == EXPLOCK_READ) {
+        if (t_readlocks == 0 || --t_readlocks > 0)
+            return;
+#ifdef F_OFD_SETLK
+        // Closing the fd releases its lock.
+        close(t_readlockfd);
+#else
+        set_file_lock(t_readlockfd, F_UNLCK, LOCK_COMMIT_BYTE, NULL);
+#endif
+        t_readlockfd = -1;
+    }
+#endif
+}
+
 static int file_exists(const char *file) {
     struct stat st;
     if (stat(file, &st) == 0)
@@ -176,101 +1015,1548 @@ int touch_expense_file(const char *expfile) {
         FILE *f = fopen(expfile, "a");
         if (f == NULL) {
             print_error("Error creating expense file");
-            exit(1);
+            return 1;
         }
         fclose(f);
-        printf("Expense file created: %s\n", expfile);
+        fprintf(errout(), "Expense file created: %s\n", expfile);
     }
     return 0;
 }
 
-int load_expense_file(arena_t *exp_arena, arena_t scratch, exptbl_t *et) {
-    FILE *f;
-    char buf[1024];
-    int z;
-
-    str_t expfile = get_expense_filename(&scratch);
-    z = touch_expense_file(expfile.bytes);
-    if (z != 0)
-        return z;
+static long read_at(int fd, void *buf, long len, long offset) {
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        return -1;
+    return read(fd, buf, len);
+}
+// Hash of the last block of the first size bytes of file fd.
+// Used to cheaply check that the part of the file already parsed is unchanged.
+static unsigned long long hash_file_tail(int fd, long size) {
+    char buf[4096];
+    long len = size < (long)sizeof(buf) ? size : (long)sizeof(buf);
 
-    f = fopen(expfile.bytes, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Error opening '%s': ", expfile.bytes);
-        print_error(NULL);
-        return 1;
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    if (read_at(fd, buf, len, size-len) != len)
+        return 0;
+    for (long i=0; i < len; i++) {
+        h ^= (unsigned char) buf[i];
+        h *= 1099511628211ULL;
     }
+    return h;
+}
+// Set fs to the state of f where the file was read or written up to the
+// current position of f.
+static void get_file_state(FILE *f, expfile_state_t *fs) {
+    struct stat st;
+    memset(fs, 0, sizeof(*fs));
+    fflush(f);
+    if (fstat(fileno(f), &st) != 0)
+        return;
+    fs->ino = st.st_ino;
+    fs->size = ftell(f);
+    fs->tailhash = hash_file_tail(fileno(f), fs->size);
+}
 
-    init_exptbl(et, 100, exp_arena);
-    while (1) {
-        errno = 0;
-        char *pz = fgets(buf, sizeof(buf), f);
-        if (pz == NULL)
-            break;
+// Expense files are read in chunks of READ_BUF_LEN bytes. When more than
+// one chunk is left to read, a reader thread fills one buffer while the
+// previous one is parsed.
+#define READ_BUF_LEN (1024*1024)
 
-        chomp(buf);
-        if (strlen(buf) == 0)
-            continue;
+typedef struct {
+    exptbl_t *et;
+    int newids;
+    expscan_func_t scan;    // if set, records are passed to scan instead
+    void *ctx;
+    long nrecs;
+    char *carry;        // partial line at the end of the previous chunk
+    long carry_len;
+    long carry_cap;
+    int whole_lines;    // stop at the last newline
+} lineparser_t;
 
-        exp_t exp = read_expense(buf, et);
-        add_exp(et, exp);
+static void parse_expense_line(lineparser_t *lp, char *line) {
+    chomp(line);
+    if (*line == '\0')
+        return;
+
+    lp->nrecs++;
+    if (lp->scan != NULL) {
+        exprec_t rec;
+        read_exprec(line, &rec);
+        lp->scan(lp->ctx, &rec);
+        return;
     }
-    fclose(f);
+    exptbl_t *et = lp->et;
+    exp_t exp = read_expense(line, et);
+    if (lp->newids && (exp.id <= 0 || find_exp_id(et, exp.id) != -1))
+        exp.id = new_exp_id(et);
+    add_exp(et, exp);
+}
 
-    // Sort expenses by date.
-    sort_exptbl(et, cmp_exp_date);
+static void carry_bytes(lineparser_t *lp, char *p, long len) {
+    if (lp->carry_len + len + 1 > lp->carry_cap) {
+        lp->carry_cap = (lp->carry_len + len + 1) * 2;
+        lp->carry = realloc(lp->carry, lp->carry_cap);
+        if (lp->carry == NULL)
+            panic("realloc() error");
+    }
+    memcpy(lp->carry + lp->carry_len, p, len);
+    lp->carry_len += len;
+    lp->carry[lp->carry_len] = '\0';
+}
 
-    // Sort categories table alphabetically
-    strtbl_t tmpcats = dup_strtbl(et->cats, &scratch);
-    sort_strtbl(&et->cats, cmp_str);
+// Parse the lines of chunk buf[0, len). A line left unfinished at the end
+// of the chunk is carried over and completed by the next chunk.
+static void parse_expense_chunk(lineparser_t *lp, char *buf, long len) {
+    char *p = buf;
+    char *end = buf + len;
 
-    // Re-set exp catid's to new sorted categories table.
-    for (int i=0; i < et->len; i++) {
-        exp_t *exp = &et->base[i];
-        str_t catname = strtbl_get(tmpcats, exp->catid);
-        exp->catid = strtbl_find(et->cats, catname.bytes);
+    if (lp->carry_len > 0) {
+        char *nl = memchr(p, '\n', end-p);
+        if (nl == NULL) {
+            carry_bytes(lp, p, end-p);
+            return;
+        }
+        carry_bytes(lp, p, nl-p);
+        parse_expense_line(lp, lp->carry);
+        lp->carry_len = 0;
+        p = nl+1;
+    }
+    while (p < end) {
+        char *nl = memchr(p, '\n', end-p);
+        if (nl == NULL) {
+            carry_bytes(lp, p, end-p);
+            break;
+        }
+        *nl = '\0';
+        parse_expense_line(lp, p);
+        p = nl+1;
     }
-    return 0;
 }
 
-static exp_t read_expense(char *buf, exptbl_t *et) {
-    exp_t retexp;
-    char *pdate, *ptime;
+// Parse the last line if the file doesn't end with a newline.
+// With whole_lines set, it's left unread instead.
+static void finish_expense_chunks(lineparser_t *lp) {
+    if (lp->carry_len > 0 && !lp->whole_lines)
+        parse_expense_line(lp, lp->carry);
+    free(lp->carry);
+}
 
-    // Sample expense line:
-    // 2016-05-01; 00:00; Mochi Cream coffee; 100.00; coffee
+static char *alloc_read_buf() {
+    void *buf = NULL;
+#ifdef WINDOWS
+    buf = malloc(READ_BUF_LEN);
+#else
+    if (posix_memalign(&buf, 4096, READ_BUF_LEN) != 0)
+        buf = NULL;
+#endif
+    if (buf == NULL)
+        panic("Out of memory for read buffer");
+    return buf;
+}
 
-    char *pfield;
-    char *nextp;
+#ifndef WINDOWS
+typedef struct {
+    int fd;
+    off_t pos;                  // file offset of the next chunk
+    char *bufs[2];
+    long lens[2];               // bytes in each buffer, 0 at end of file
+    int full[2];
+    int err;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} chunkreader_t;
 
-    // date
-    pdate = buf;
-    nextp = next_field(pdate);
+// Fill buf with the next chunk, retrying short reads so that a chunk is
+// only short at end of file.
+static long read_chunk(chunkreader_t *cr, char *buf) {
+    long len = 0;
+    while (len < READ_BUF_LEN) {
+        ssize_t n = pread(cr->fd, buf + len, READ_BUF_LEN - len, cr->pos + len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            cr->err = errno;
+            break;
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+    cr->pos += len;
+    return len;
+}
 
-    // time
-    ptime = nextp;
-    nextp = next_field(ptime);
-    retexp.date = date_from_sdatetime(pdate, ptime);
+static void *chunk_reader_thread(void *arg) {
+    chunkreader_t *cr = arg;
+    for (int b=0; ; b ^= 1) {
+        pthread_mutex_lock(&cr->mutex);
+        while (cr->full[b])
+            pthread_cond_wait(&cr->cond, &cr->mutex);
+        pthread_mutex_unlock(&cr->mutex);
 
-    // description
-    pfield = nextp;
-    nextp = next_field(pfield);
-    retexp.descid = strtbl_add(&et->strings, pfield);
+        long len = read_chunk(cr, cr->bufs[b]);
 
-    // amount
-    pfield = nextp;
+        pthread_mutex_lock(&cr->mutex);
+        cr->lens[b] = len;
+        cr->full[b] = 1;
+        pthread_cond_broadcast(&cr->cond);
+        pthread_mutex_unlock(&cr->mutex);
+        if (len < READ_BUF_LEN)
+            break;
+    }
+    return NULL;
+}
+
+// Read f from its current position to the end with a reader thread,
+// parsing each chunk while the next one is read. Leaves f positioned at
+// the end of what was read. Returns the number of bytes read.
+static long read_expense_chunks_async(FILE *f, lineparser_t *lp) {
+    chunkreader_t cr;
+    memset(&cr, 0, sizeof(cr));
+    cr.fd = fileno(f);
+    cr.pos = ftello(f);
+    off_t start = cr.pos;
+    cr.bufs[0] = alloc_read_buf();
+    cr.bufs[1] = alloc_read_buf();
+    pthread_mutex_init(&cr.mutex, NULL);
+    pthread_cond_init(&cr.cond, NULL);
+    posix_fadvise(cr.fd, start, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, chunk_reader_thread, &cr) != 0)
+        panic_err("pthread_create() error");
+
+    for (int b=0; ; b ^= 1) {
+        pthread_mutex_lock(&cr.mutex);
+        while (!cr.full[b])
+            pthread_cond_wait(&cr.cond, &cr.mutex);
+        long len = cr.lens[b];
+        pthread_mutex_unlock(&cr.mutex);
+
+        parse_expense_chunk(lp, cr.bufs[b], len);
+
+        pthread_mutex_lock(&cr.mutex);
+        cr.full[b] = 0;
+        pthread_cond_broadcast(&cr.cond);
+        pthread_mutex_unlock(&cr.mutex);
+        if (len < READ_BUF_LEN)
+            break;
+    }
+    pthread_join(thread, NULL);
+
+    if (cr.err != 0) {
+        errno = cr.err;
+        panic_err("read() error");
+    }
+    fseeko(f, cr.pos, SEEK_SET);
+    pthread_mutex_destroy(&cr.mutex);
+    pthread_cond_destroy(&cr.cond);
+    free(cr.bufs[0]);
+    free(cr.bufs[1]);
+    return cr.pos - start;
+}
+#endif
+
+// Read f from its current position to the end on this thread.
+static long read_expense_chunks(FILE *f, lineparser_t *lp) {
+    char *buf = alloc_read_buf();
+    long nbytes = 0;
+    while (1) {
+        size_t len = fread(buf, 1, READ_BUF_LEN, f);
+        if (ferror(f))
+            panic_err("fread() error");
+        parse_expense_chunk(lp, buf, len);
+        nbytes += len;
+        if (len < READ_BUF_LEN)
+            break;
+    }
+    free(buf);
+    return nbytes;
+}
+
+static void parse_expense_file(FILE *f, lineparser_t *lp) {
+    long nbytes;
+#ifndef WINDOWS
+    struct stat st;
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size - ftello(f) > READ_BUF_LEN)
+        nbytes = read_expense_chunks_async(f, lp);
+    else
+        nbytes = read_expense_chunks(f, lp);
+#else
+    nbytes = read_expense_chunks(f, lp);
+#endif
+    finish_expense_chunks(lp);
+    if (lp->whole_lines && lp->carry_len > 0) {
+        fseeko(f, -lp->carry_len, SEEK_CUR);
+        nbytes -= lp->carry_len;
+    }
+    stats_add_parsed(lp->nrecs, nbytes);
+}
+
+// Read expense lines from f and add them to et.
+// If newids is set, expenses without an id or with an id already in et are
+// given a new id, otherwise ids are assigned afterwards by assign_exp_ids().
+static void read_expense_lines(FILE *f, exptbl_t *et, int newids) {
+    lineparser_t lp = {et, newids, NULL, NULL, 0, NULL, 0, 0};
+    parse_expense_file(f, &lp);
+}
+
+// Compare file path with state fs of when it was read or written.
+// Returns EXPFILE_APPENDED if the only change is data added to the end,
+// EXPFILE_REPLACED for any other change.
+static int check_file_state(const char *path, expfile_state_t *fs) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return EXPFILE_UNCHANGED;
+    if (st.st_ino == fs->ino && st.st_size == fs->size)
+        return EXPFILE_UNCHANGED;
+    if (st.st_ino != fs->ino || st.st_size < fs->size)
+        return EXPFILE_REPLACED;
+
+    // Same file and it grew, make sure the part we've read is the same
+    // and ends on a line boundary.
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return EXPFILE_REPLACED;
+    char lastch = '\n';
+    if (fs->size > 0 && read_at(fd, &lastch, 1, fs->size-1) != 1)
+        lastch = 0;
+    unsigned long long tailhash = hash_file_tail(fd, fs->size);
+    close(fd);
+
+    if (lastch != '\n' || tailhash != fs->tailhash)
+        return EXPFILE_REPLACED;
+    return EXPFILE_APPENDED;
+}
+
+// Compare expense file path with the state it was loaded or saved in.
+static int check_ledger_state(const char *path, ledgerstate_t *ls) {
+    if (ls->partitioned) {
+        expfile_state_t fstate;
+        get_dir_state(path, &fstate);
+        if (memcmp(&fstate, &ls->fstate, sizeof(fstate)) == 0)
+            return EXPFILE_UNCHANGED;
+        return EXPFILE_REPLACED;
+    }
+    if (get_journal_size(path) != ls->journal_size)
+        return EXPFILE_REPLACED;
+    return check_file_state(path, &ls->fstate);
+}
+
+// Check whether the expense file changed since et was loaded or saved.
+// Returns EXPFILE_APPENDED if the only change is data added to the end of
+// the file, EXPFILE_REPLACED for any other change. With more than one
+// expense file, any change to one of them is EXPFILE_REPLACED, since
+// appended expenses aren't merged into combined ledgers.
+int check_expense_file(exptbl_t *et, arena_t scratch) {
+    if (et->nfiles > 1) {
+        str_t files[MAX_EXPENSE_FILES];
+        int nfiles = get_expense_filenames(&scratch, files, countof(files));
+        if (nfiles != et->nfiles || et->ledgers == NULL)
+            return EXPFILE_REPLACED;
+        for (int k=0; k < nfiles; k++) {
+            if (check_ledger_state(files[k].bytes, &et->ledgers[k]) != EXPFILE_UNCHANGED)
+                return EXPFILE_REPLACED;
+        }
+        return EXPFILE_UNCHANGED;
+    }
+
+    str_t expfile = get_expense_filename(&scratch);
+    ledgerstate_t ls = {et->fstate, et->journal_size, et->partitioned};
+    return check_ledger_state(expfile.bytes, &ls);
+}
+
+// Parse expenses appended to the expense file since et was loaded or saved
+// and merge them into et. Call only when check_expense_file() returned
+// EXPFILE_APPENDED.
+int load_expense_tail(exptbl_t *et, arena_t scratch) {
+    str_t expfile = get_expense_filename(&scratch);
+    if (lock_expense_file(EXPLOCK_READ) != 0)
+        return 1;
+    FILE *f = fopen(expfile.bytes, "r");
+    if (f == NULL) {
+        fprintf(errout(), "Error opening '%s': ", expfile.bytes);
+        print_error(NULL);
+        unlock_expense_file(EXPLOCK_READ);
+        return 1;
+    }
+    if (fseek(f, et->fstate.size, SEEK_SET) != 0) {
+        fclose(f);
+        unlock_expense_file(EXPLOCK_READ);
+        return 1;
+    }
+
+    // A last line without a newline may still be being written, leave it
+    // for the next change.
+    int istart = et->len;
+    lineparser_t lp = {et, 1, NULL, NULL, 0, NULL, 0, 0, 1};
+    parse_expense_file(f, &lp);
+    get_file_state(f, &et->fstate);
+    fclose(f);
+    unlock_expense_file(EXPLOCK_READ);
+
+    sort_exptbl_part(et, istart, et->len-1, cmp_exp_date);
+    merge_exptbl_tail(et, istart, cmp_exp_date);
+    return 0;
+}
+
+// Year partitioned expense directory
+//
+// When the expense file is a directory, expenses are stored one file per
+// year, named by the year (ex. expenses.d/2025). Loads with a date range
+// only read the years that overlap it, and saves only rewrite the years
+// whose expenses changed. The next unused expense id is kept in
+// expenses.d/nextid, since not all years are loaded every time.
+
+static int is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+static int is_partition_name(const char *name) {
+    for (int i=0; i < 4; i++) {
+        if (name[i] < '0' || name[i] > '9')
+            return 0;
+    }
+    return name[4] == '\0' || strcmp(name+4, ".xa") == 0;
+}
+static int get_part(unsigned char *bits, short year) {
+    int i = year - PART_MIN_YEAR;
+    if (i < 0 || i >= PART_YEARS)
+        return 0;
+    return (bits[i/8] >> (i%8)) & 1;
+}
+static void set_part(unsigned char *bits, short year, int val) {
+    int i = year - PART_MIN_YEAR;
+    if (i < 0 || i >= PART_YEARS)
+        return;
+    if (val)
+        bits[i/8] |= 1 << (i%8);
+    else
+        bits[i/8] &= ~(1 << (i%8));
+}
+
+// Seal year into a compressed archive partition when expenses are
+// next saved.
+int archive_expense_year(exptbl_t *et, short year) {
+    if (!et->partitioned) {
+        fprintf(errout(), "Only years of a year partitioned expense directory can be archived.\n");
+        return 1;
+    }
+    if (!get_part(et->part_loaded, year)) {
+        fprintf(errout(), "Year %d is out of range.\n", year);
+        return 1;
+    }
+    set_part(et->part_archived, year, 1);
+    set_part(et->part_dirty, year, 1);
+    return 0;
+}
+
+// Note that the partition holding exp needs to be saved, and the id of exp
+// if changes are tracked.
+void mark_exp_dirty(exptbl_t *et, exp_t exp) {
+    if (et->nchanges >= 0) {
+        if (et->nchanges < JOURNAL_MAX_CHANGES)
+            et->changes[et->nchanges] = exp.id;
+        if (et->nchanges <= JOURNAL_MAX_CHANGES)
+            et->nchanges++;
+    }
+    if (!et->partitioned)
+        return;
+    short year;
+    date_to_cal(exp.date, &year, NULL, NULL);
+    set_part(et->part_dirty, year, 1);
+}
+
+// Whether the year of date dt can be saved in et's expense directory.
+// Always true when the expense file isn't year partitioned.
+int is_year_in_range(exptbl_t *et, time_t dt) {
+    if (!et->partitioned)
+        return 1;
+    short year;
+    date_to_cal(dt, &year, NULL, NULL);
+    return year >= PART_MIN_YEAR && year < PART_MIN_YEAR+PART_YEARS;
+}
+
+// Set the bits of the years that have a partition file in dir in textparts
+// and of those that have an archive in arcparts.
+static int list_partitions(const char *dir, unsigned char *textparts, unsigned char *arcparts) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!is_partition_name(de->d_name))
+            continue;
+        short year = atoi(de->d_name);
+        set_part(de->d_name[4] == '\0' ? textparts : arcparts, year, 1);
+    }
+    closedir(d);
+    return 0;
+}
+
+// State of partitioned expense directory: a hash of the names, sizes and
+// modification times of its partition files.
+static void get_dir_state(const char *dir, expfile_state_t *fs) {
+    char path[2048];
+    struct stat st;
+
+    memset(fs, 0, sizeof(*fs));
+    if (stat(dir, &st) != 0)
+        return;
+    fs->ino = st.st_ino;
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    unsigned long long h = 14695981039346656037ULL;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!is_partition_name(de->d_name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0)
+            continue;
+        unsigned long long vals[4] = {atoi(de->d_name), st.st_ino, st.st_size, st.st_mtime};
+        for (int i=0; i < 4; i++) {
+            h ^= vals[i];
+            h *= 1099511628211ULL;
+        }
+        fs->size++;
+    }
+    closedir(d);
+    fs->tailhash = h;
+}
+
+static int read_next_id(const char *dir) {
+    char path[2048];
+    int next_id = 0;
+    snprintf(path, sizeof(path), "%s/nextid", dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%d", &next_id) != 1)
+        next_id = 0;
+    fclose(f);
+    return next_id;
+}
+static void write_next_id(const char *dir, int next_id) {
+    char path[2048];
+    if (next_id <= read_next_id(dir))
+        return;
+    snprintf(path, sizeof(path), "%s/nextid", dir);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        print_error("Error writing nextid");
+        return;
+    }
+    fprintf(f, "%d\n", next_id);
+    fclose(f);
+}
+
+// Read the year partitions of dir that overlap [startdt, enddt) into et.
+// A zero startdt or enddt leaves that end of the range open.
+static int read_partitions(const char *dir, arena_t *exp_arena, exptbl_t *et, time_t startdt, time_t enddt) {
+    char path[2048];
+    unsigned char textparts[PART_YEARS/8] = {0};
+    unsigned char arcparts[PART_YEARS/8] = {0};
+    short minyear = PART_MIN_YEAR;
+    short maxyear = PART_MIN_YEAR + PART_YEARS-1;
+
+    if (startdt != 0)
+        date_to_cal(startdt, &minyear, NULL, NULL);
+    if (enddt != 0)
+        date_to_cal(enddt-1, &maxyear, NULL, NULL);
+
+    // List the directory once, rather than trying to open every year.
+    if (list_partitions(dir, textparts, arcparts) != 0) {
+        fprintf(errout(), "Error reading '%s': ", dir);
+        print_error(NULL);
+        return 1;
+    }
+
+    init_exptbl(et, 100, exp_arena);
+    for (short year=minyear; year <= maxyear; year++) {
+        FILE *f = NULL;
+
+        // Sealed year archive
+        snprintf(path, sizeof(path), "%s/%04d.xa", dir, year);
+        if (get_part(arcparts, year))
+            f = fopen(path, "rb");
+        if (f == NULL && get_part(arcparts, year) && errno != ENOENT) {
+            fprintf(errout(), "Error opening '%s': ", path);
+            print_error(NULL);
+            return 1;
+        }
+        if (f != NULL) {
+            int z = read_archive(f, et, startdt, enddt);
+            fclose(f);
+            if (z < 0) {
+                fprintf(errout(), "Error reading archive '%s'.\n", path);
+                return 1;
+            }
+            set_part(et->part_archived, year, 1);
+            if (z == ARC_FULL)
+                set_part(et->part_loaded, year, 1);
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%04d", dir, year);
+        if (get_part(textparts, year))
+            f = fopen(path, "r");
+        if (f == NULL && get_part(textparts, year) && errno != ENOENT) {
+            fprintf(errout(), "Error opening '%s': ", path);
+            print_error(NULL);
+            return 1;
+        }
+        set_part(et->part_loaded, year, 1);
+        if (f == NULL)
+            continue;
+        read_expense_lines(f, et, 0);
+        fclose(f);
+    }
+    et->next_id = read_next_id(dir);
+    et->partitioned = 1;
+    get_dir_state(dir, &et->fstate);
+    return 0;
+}
+
+// Rewrite partitions of the years marked dirty.
+static int save_partitions(const char *dir, exptbl_t *et) {
+    char path[2048];
+    char arcpath[2048];
+    int i = 0;
+
+    for (short year=PART_MIN_YEAR; year < PART_MIN_YEAR+PART_YEARS; year++) {
+        if (!get_part(et->part_dirty, year))
+            continue;
+        if (!get_part(et->part_loaded, year)) {
+            fprintf(errout(), "Can't save year %d, it wasn't loaded.\n", year);
+            return 1;
+        }
+
+        // Expenses are sorted by date, so the year is a contiguous range.
+        time_t startdt = date_from_cal(year, 1, 1);
+        time_t enddt = date_from_cal(year+1, 1, 1);
+        while (i < et->len && et->base[i].date < startdt)
+            i++;
+        int iend = i;
+        while (iend < et->len && et->base[iend].date < enddt)
+            iend++;
+
+        // Archived years are sealed again after changes.
+        int archived = get_part(et->part_archived, year);
+        snprintf(path, sizeof(path), "%s/%04d", dir, year);
+        snprintf(arcpath, sizeof(arcpath), "%s/%04d.xa", dir, year);
+        if (iend == i) {
+            remove(path);
+            remove(arcpath);
+        } else if (write_expenses(archived ? arcpath : path, et, i, iend, NULL, archived) != 0) {
+            return 1;
+        } else if (archived) {
+            remove(path);
+        }
+        set_part(et->part_dirty, year, 0);
+        i = iend;
+    }
+    write_next_id(dir, et->next_id);
+    get_dir_state(dir, &et->fstate);
+    return 0;
+}
+
+// Add size of expense file path to *textsize, and for a year partitioned
+// directory, size of its archives to *arcsize.
+static void add_expense_path_size(const char *path, unsigned long *textsize, unsigned long *arcsize) {
+    char buf[2048];
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return;
+    if (!S_ISDIR(st.st_mode)) {
+        *textsize += st.st_size;
+        return;
+    }
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (!is_partition_name(de->d_name))
+            continue;
+        snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+        if (stat(buf, &st) != 0)
+            continue;
+        if (de->d_name[4] == '\0')
+            *textsize += st.st_size;
+        else
+            *arcsize += st.st_size;
+    }
+    closedir(d);
+}
+
+// Loaded expenses, strings and the tables left behind when they double take
+// about 4x the size of expense text, and archives expand about 16x.
+static unsigned long arena_size_for(unsigned long textsize, unsigned long arcsize) {
+    return 64*SIZE_MB + textsize*4 + arcsize*16;
+}
+
+// Arena size to reserve for loading the expense files plus extra bytes of
+// expense text (ex. from an import). Pages aren't touched until used.
+unsigned long get_expense_arena_size(arena_t scratch, unsigned long extra) {
+    str_t files[MAX_EXPENSE_FILES];
+    unsigned long textsize = extra;
+    unsigned long arcsize = 0;
+
+    int nfiles = get_expense_filenames(&scratch, files, countof(files));
+    for (int i=0; i < nfiles; i++)
+        add_expense_path_size(files[i].bytes, &textsize, &arcsize);
+    return arena_size_for(textsize, arcsize);
+}
+
+// Expense cache
+//
+// After a text expense file is parsed, the loaded table is written to
+// <expfile>.cache: the expenses sorted by date with their ids assigned,
+// and the base and pool blocks of both string tables, compacted to the
+// strings that expenses still use. The next load
+// checks that the file is the same one and still starts with the part that
+// was cached (size and a hash of its last block, as for appends seen by
+// check_expense_file()), reads the cache and only parses the lines
+// appended since. Saves write the cache of the new file.
+//
+// The cache is native binary, and is rebuilt whenever it doesn't match the
+// expense file or this build. Expense dates are parsed as local time, so
+// the cache is also rebuilt when the timezone changes: its header records
+// TZ and the local time of a few reference dates.
+
+#define CACHE_MAGIC    "EXPC"
+#define CACHE_VERSION  3
+#define CACHE_TZ_LEN   64
+#define CACHE_TZ_DATES 4
+
+// Appended text is only parsed on each load until it reaches this size,
+// then the cache is rewritten.
+#define CACHE_MAX_TAIL SIZE_LARGE
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t exp_size;
+    int32_t nexps;
+    int32_t next_id;
+    int32_t nstrings;
+    uint32_t strings_pool_len;
+    int32_t ncats;
+    uint32_t cats_pool_len;
+    uint32_t unused;
+    int64_t mtime;
+    expfile_state_t fstate;
+    char tz[CACHE_TZ_LEN];
+    int64_t tzclock[CACHE_TZ_DATES];
+} expcache_hdr_t;
+
+static void get_cache_filename(const char *expfile, char *buf, size_t buf_len) {
+    snprintf(buf, buf_len, "%s.cache", expfile);
+}
+
+// Set the timezone identity of hdr: TZ, and the local time in minutes of
+// reference dates in winter and summer, which differ if the rules or the
+// zone of /etc/localtime changed.
+static void get_cache_tz(expcache_hdr_t *hdr) {
+    static const time_t dates[CACHE_TZ_DATES] = {
+        1200000,        // 1970-01-14
+        947808000,      // 2000-01-14
+        963532800,      // 2000-07-14
+        1894665600,     // 2030-01-15
+    };
+    char *tz = getenv("TZ");
+    memset(hdr->tz, 0, sizeof(hdr->tz));
+    if (tz != NULL)
+        snprintf(hdr->tz, sizeof(hdr->tz), "%s", tz);
+    for (int i=0; i < CACHE_TZ_DATES; i++) {
+        struct tm tm;
+        hdr->tzclock[i] = 0;
+        if (localtime_r(&dates[i], &tm) != NULL)
+            hdr->tzclock[i] = ((int64_t)(tm.tm_year*366 + tm.tm_yday)*24 + tm.tm_hour)*60 + tm.tm_min;
+    }
+}
+
+// Number the strings of st marked used in map[] (0, others -1) in table
+// order, so the cache doesn't carry strings orphaned by edits and deletes.
+// map[i] is set to the new index of string i, and base[] to the entries
+// of the compacted table. Returns its length, and its pool size in
+// *pool_len.
+static int compact_cache_strtbl(strtbl_t *st, int *map, strref_t *base, uint32_t *pool_len) {
+    int len = 0;
+    uint32_t off = 0;
+    for (int i=0; i < st->len; i++) {
+        if (map[i] == -1)
+            continue;
+        map[i] = len;
+        base[len].off = off;
+        base[len].len = st->base[i].len;
+        off += st->base[i].len + 1;
+        len++;
+    }
+    *pool_len = off;
+    return len;
+}
+static int write_cache_strtbl(FILE *f, strtbl_t *st, int *map, strref_t *base, int len) {
+    fwrite(base, sizeof(strref_t), len, f);
+    for (int i=0; i < st->len; i++) {
+        if (map[i] != -1)
+            fwrite(st->pool + st->base[i].off, 1, st->base[i].len + 1, f);
+    }
+    return ferror(f);
+}
+static int read_cache_strtbl(FILE *f, arena_t *a, strtbl_t *st, int len, uint32_t pool_len) {
+    int cap = len + len/2 + 8;
+    uint32_t pool_cap = pool_len + pool_len/2 + SIZE_TINY;
+    strref_t *base = aalloc(a, sizeof(strref_t) * cap);
+    char *pool = aalloc(a, pool_cap);
+    if (fread(base, sizeof(strref_t), len, f) != (size_t)len)
+        return -1;
+    if (fread(pool, 1, pool_len, f) != pool_len)
+        return -1;
+    return init_strtbl_blocks(st, a, base, len, cap, pool, pool_len, pool_cap);
+}
+
+// Write the cache of expense file path, whose first et->fstate.size bytes
+// were loaded into et. The cache is replaced atomically, errors are
+// ignored since the next load can always parse the file instead.
+static void write_expense_cache(const char *path, exptbl_t *et) {
+    char cachefile[2048];
+    char tmpfile[2048+32];
+    struct stat st;
+
+    if (et->partitioned || stat(path, &st) != 0 || st.st_ino != et->fstate.ino)
+        return;
+    stats_mark_t t = stats_start();
+    get_cache_filename(path, cachefile, sizeof(cachefile));
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp%d", cachefile, (int)getpid());
+    FILE *f = fopen(tmpfile, "wb");
+    if (f == NULL)
+        return;
+
+    arena_t a;
+    int nstrings = et->strings.len;
+    int ncats = et->cats.len;
+    init_arena(&a, (sizeof(int) + sizeof(strref_t)) * (nstrings + ncats) + SIZE_TINY);
+    int *descmap = aalloc(&a, sizeof(int) * nstrings);
+    int *catmap = aalloc(&a, sizeof(int) * ncats);
+    strref_t *descbase = aalloc(&a, sizeof(strref_t) * nstrings);
+    strref_t *catbase = aalloc(&a, sizeof(strref_t) * ncats);
+    for (int i=0; i < nstrings; i++)
+        descmap[i] = -1;
+    for (int i=0; i < ncats; i++)
+        catmap[i] = -1;
+    descmap[0] = 0;
+    catmap[0] = 0;
+    for (int i=0; i < et->len; i++) {
+        descmap[et->base[i].descid] = 0;
+        catmap[et->base[i].catid] = 0;
+    }
+
+    expcache_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, 4);
+    hdr.version = CACHE_VERSION;
+    hdr.exp_size = sizeof(exp_t);
+    hdr.nexps = et->len;
+    hdr.next_id = et->next_id;
+    hdr.nstrings = compact_cache_strtbl(&et->strings, descmap, descbase, &hdr.strings_pool_len);
+    hdr.ncats = compact_cache_strtbl(&et->cats, catmap, catbase, &hdr.cats_pool_len);
+    hdr.mtime = st.st_mtime;
+    hdr.fstate = et->fstate;
+    get_cache_tz(&hdr);
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    exp_t buf[256];
+    for (int i=0; i < et->len; i += countof(buf)) {
+        int n = et->len - i < (int)countof(buf) ? et->len - i : (int)countof(buf);
+        for (int k=0; k < n; k++) {
+            buf[k] = et->base[i+k];
+            buf[k].descid = descmap[buf[k].descid];
+            buf[k].catid = catmap[buf[k].catid];
+        }
+        fwrite(buf, sizeof(exp_t), n, f);
+    }
+    int z = write_cache_strtbl(f, &et->strings, descmap, descbase, hdr.nstrings);
+    z |= write_cache_strtbl(f, &et->cats, catmap, catbase, hdr.ncats);
+    free_arena(&a);
+    if (fclose(f) != 0)
+        z = 1;
+    if (z != 0) {
+        remove(tmpfile);
+        return;
+    }
+#ifdef WINDOWS
+    remove(cachefile);
+#endif
+    if (rename(tmpfile, cachefile) != 0)
+        remove(tmpfile);
+    stats_end("cache write", t);
+}
+
+// Read the cache of expense file path into et, if it matches the start
+// of f. f is left positioned after the cached part of the file.
+// Returns 0 if the cache was read, or 1 if there is no usable cache.
+static int read_expense_cache(const char *path, FILE *f, arena_t *exp_arena, exptbl_t *et) {
+    char cachefile[2048];
+    struct stat st;
+    expcache_hdr_t hdr;
+    expcache_hdr_t tzhdr;
+
+    get_cache_tz(&tzhdr);
+    get_cache_filename(path, cachefile, sizeof(cachefile));
+    FILE *cf = fopen(cachefile, "rb");
+    if (cf == NULL)
+        return 1;
+    if (fread(&hdr, sizeof(hdr), 1, cf) != 1 || memcmp(hdr.magic, CACHE_MAGIC, 4) != 0 ||
+        hdr.version != CACHE_VERSION || hdr.exp_size != sizeof(exp_t) ||
+        hdr.nexps < 0 || hdr.nstrings < 1 || hdr.ncats < 1 ||
+        memcmp(hdr.tz, tzhdr.tz, sizeof(hdr.tz)) != 0 ||
+        memcmp(hdr.tzclock, tzhdr.tzclock, sizeof(hdr.tzclock)) != 0) {
+        fclose(cf);
+        return 1;
+    }
+
+    // The expense file must be the cached one, or the cached one with
+    // lines appended. A change in place that keeps the size shows up in
+    // the modification time.
+    int z = check_file_state(path, &hdr.fstate);
+    if (z == EXPFILE_REPLACED || fstat(fileno(f), &st) != 0 ||
+        (z == EXPFILE_UNCHANGED && st.st_mtime != hdr.mtime) ||
+        fstat(fileno(cf), &st) != 0 ||
+        st.st_size != (off_t)(sizeof(hdr) + (uint64_t)hdr.nexps * sizeof(exp_t) +
+                              (uint64_t)(hdr.nstrings + hdr.ncats) * sizeof(strref_t) +
+                              hdr.strings_pool_len + hdr.cats_pool_len)) {
+        fclose(cf);
+        return 1;
+    }
+
+    // Undo allocations if the cache turns out to be unusable.
+    unsigned long pos = exp_arena->pos;
+    init_exptbl(et, hdr.nexps + hdr.nexps/2 + 100, exp_arena);
+    z = 0;
+    if (fread(et->base, sizeof(exp_t), hdr.nexps, cf) != (size_t)hdr.nexps)
+        z = -1;
+    if (z == 0)
+        z = read_cache_strtbl(cf, exp_arena, &et->strings, hdr.nstrings, hdr.strings_pool_len);
+    if (z == 0)
+        z = read_cache_strtbl(cf, exp_arena, &et->cats, hdr.ncats, hdr.cats_pool_len);
+    fclose(cf);
+    for (int i=0; z == 0 && i < hdr.nexps; i++) {
+        exp_t *exp = &et->base[i];
+        if (exp->descid < 0 || exp->descid >= hdr.nstrings || exp->catid < 0 || exp->catid >= hdr.ncats)
+            z = -1;
+    }
+    if (z != 0 || fseek(f, hdr.fstate.size, SEEK_SET) != 0) {
+        exp_arena->pos = pos;
+        return 1;
+    }
+    et->len = hdr.nexps;
+    et->next_id = hdr.next_id;
+    et->fstate = hdr.fstate;
+    return 0;
+}
+
+// Read expense file path into et, with expenses sorted by date.
+// If path is a year partitioned directory, only years overlapping
+// [startdt, enddt) are read.
+static int read_expense_path(const char *path, arena_t *exp_arena, exptbl_t *et, time_t startdt, time_t enddt) {
+    FILE *f;
+    int z;
+    int cached = 0;
+    int istart = 0;
+    long cached_size = 0;
+
+    stats_mark_t t = stats_start();
+    z = touch_expense_file(path);
+    if (z != 0)
+        return z;
+
+    if (is_directory(path)) {
+        z = read_partitions(path, exp_arena, et, startdt, enddt);
+        if (z != 0)
+            return z;
+    } else {
+        f = fopen(path, "r");
+        if (f == NULL) {
+            fprintf(errout(), "Error opening '%s': ", path);
+            print_error(NULL);
+            return 1;
+        }
+
+        // With a cache, only lines appended since are parsed, and given
+        // new ids as they're read.
+        cached = read_expense_cache(path, f, exp_arena, et) == 0;
+        if (cached) {
+            istart = et->len;
+            cached_size = et->fstate.size;
+        } else
+            init_exptbl(et, 100, exp_arena);
+        read_expense_lines(f, et, cached);
+        get_file_state(f, &et->fstate);
+        fclose(f);
+    }
+    t = stats_end("read", t);
+    if (!cached) {
+        assign_exp_ids(et);
+        t = stats_end("ids", t);
+    }
+
+    // Sort expenses by date.
+    if (cached) {
+        sort_exptbl_part(et, istart, et->len-1, cmp_exp_date);
+        merge_exptbl_tail(et, istart, cmp_exp_date);
+    } else {
+        sort_exptbl(et, cmp_exp_date);
+    }
+    stats_end("sort", t);
+
+    if (!et->partitioned) {
+        if (!cached || et->fstate.size - cached_size >= CACHE_MAX_TAIL)
+            write_expense_cache(path, et);
+        if (read_expense_journal(path, et))
+            sort_exptbl(et, cmp_exp_date);
+    }
+    return 0;
+}
+
+// Worker threads shared by parallel stages such as sorting, started on
+// first use. There is one per CPU, or $EXP2THREADS, counting the thread
+// that runs a batch of tasks, which takes tasks too.
+#ifndef WINDOWS
+#define POOL_MAX_THREADS 64
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // a batch was started
+    pthread_cond_t done;        // the last task of the batch finished
+    pthread_mutex_t busy;       // held while a batch runs
+    int nthreads;
+
+    // Current batch. Workers take the next task not yet started, so
+    // threads that finish early pick up the remaining work.
+    parallel_func_t func;
+    void *ctx;
+    int ntasks;
+    int next;
+    int nleft;
+} workpool_t;
+
+static workpool_t g_pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+static void *pool_thread(void *arg) {
+    workpool_t *p = arg;
+    pthread_mutex_lock(&p->mutex);
+    while (1) {
+        while (p->next >= p->ntasks)
+            pthread_cond_wait(&p->work, &p->mutex);
+        int i = p->next++;
+        pthread_mutex_unlock(&p->mutex);
+        p->func(p->ctx, i);
+        pthread_mutex_lock(&p->mutex);
+        if (--p->nleft == 0)
+            pthread_cond_signal(&p->done);
+    }
+    return NULL;
+}
+
+// Only the forking thread exists in a forked child, which runs tasks on
+// its own.
+static void pool_after_fork() {
+    g_pool.nthreads = 1;
+    pthread_mutex_init(&g_pool.mutex, NULL);
+    pthread_mutex_init(&g_pool.busy, NULL);
+}
+
+static void start_pool() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    char *env = getenv("EXP2THREADS");
+    if (env != NULL && atoi(env) > 0)
+        n = atoi(env);
+    if (n > POOL_MAX_THREADS)
+        n = POOL_MAX_THREADS;
+    pthread_atfork(NULL, NULL, pool_after_fork);
+
+    g_pool.nthreads = 1;
+    for (int i=1; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, &g_pool) != 0)
+            break;
+        pthread_detach(thread);
+        g_pool.nthreads++;
+    }
+}
+
+int parallel_threads() {
+    pthread_once(&g_pool_once, start_pool);
+    return g_pool.nthreads;
+}
+
+// Run func(ctx, i) for i in [0, ntasks) on the pool, and wait for all of
+// them to finish. If the pool is already running a batch for another
+// thread, the tasks are run on the calling thread instead.
+void run_parallel(int ntasks, parallel_func_t func, void *ctx) {
+    workpool_t *p = &g_pool;
+    if (parallel_threads() <= 1 || pthread_mutex_trylock(&p->busy) != 0) {
+        for (int i=0; i < ntasks; i++)
+            func(ctx, i);
+        return;
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->func = func;
+    p->ctx = ctx;
+    p->ntasks = ntasks;
+    p->next = 0;
+    p->nleft = ntasks;
+    pthread_cond_broadcast(&p->work);
+    while (p->next < p->ntasks) {
+        int i = p->next++;
+        pthread_mutex_unlock(&p->mutex);
+        func(ctx, i);
+        pthread_mutex_lock(&p->mutex);
+        p->nleft--;
+    }
+    while (p->nleft > 0)
+        pthread_cond_wait(&p->done, &p->mutex);
+    p->ntasks = 0;
+    p->next = 0;
+    pthread_mutex_unlock(&p->mutex);
+    pthread_mutex_unlock(&p->busy);
+}
+#else
+int parallel_threads() {
+    return 1;
+}
+void run_parallel(int ntasks, parallel_func_t func, void *ctx) {
+    for (int i=0; i < ntasks; i++)
+        func(ctx, i);
+}
+#endif
+
+#ifndef WINDOWS
+typedef struct {
+    const char *path;
+    time_t startdt;
+    time_t enddt;
+    arena_t arena;
+    exptbl_t et;
+    int k;              // index of the ledger in the expense files
+    int z;
+    pthread_t thread;
+} ledger_load_t;
+
+// Read lock expense file path of a ledger after the first on a new fd,
+// which is closed to unlock it. The first ledger is locked by
+// load_expense_range(). *fd is -1 if there's no lock file.
+static int lock_ledger(const char *path, int *fd) {
+    *fd = open_lock_fd(path);
+    if (*fd == -1)
+        return 0;
+    if (set_file_lock(*fd, F_RDLCK, LOCK_COMMIT_BYTE, NULL) != 0) {
+        fprintf(errout(), "Error locking '%s': ", path);
+        print_error(NULL);
+        close(*fd);
+        *fd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+static void *load_ledger_thread(void *arg) {
+    ledger_load_t *ld = arg;
+    int lockfd = -1;
+    if (ld->k > 0 && lock_ledger(ld->path, &lockfd) != 0)
+        return NULL;
+    ld->z = read_expense_path(ld->path, &ld->arena, &ld->et, ld->startdt, ld->enddt);
+    if (lockfd != -1)
+        close(lockfd);
+    return NULL;
+}
+
+// Combine date sorted ledgers into et with a k-way merge on date.
+// Descriptions and categories are interned into et's string tables once
+// per distinct string of each ledger. Ids of ledger k are offset by
+// k * LEDGER_ID_SPAN.
+static void merge_ledgers(ledger_load_t *lds, int nlds, arena_t *exp_arena, arena_t scratch, exptbl_t *et) {
+    long total = 0;
+    for (int k=0; k < nlds; k++)
+        total += lds[k].et.len;
+    if (total > INT_MAX) {
+        fprintf(errout(), "Too many expenses in expense files (%ld)\n", total);
+        abort();
+    }
+    init_exptbl(et, total > 0 ? total : 100, exp_arena);
+
+    int **descmap = aalloc(&scratch, sizeof(int *) * nlds);
+    int **catmap = aalloc(&scratch, sizeof(int *) * nlds);
+    int *heads = aalloc(&scratch, sizeof(int) * nlds);
+    for (int k=0; k < nlds; k++) {
+        exptbl_t *src = &lds[k].et;
+        descmap[k] = aalloc(&lds[k].arena, sizeof(int) * src->strings.len);
+        catmap[k] = aalloc(&lds[k].arena, sizeof(int) * src->cats.len);
+        descmap[k][0] = 0;
+        catmap[k][0] = 0;
+        for (int i=1; i < src->strings.len; i++)
+            descmap[k][i] = strtbl_intern(&et->strings, strtbl_get(src->strings, i).bytes);
+        for (int i=1; i < src->cats.len; i++)
+            catmap[k][i] = strtbl_intern(&et->cats, strtbl_get(src->cats, i).bytes);
+        heads[k] = 0;
+    }
+
+    while (1) {
+        // Pick ledger with earliest next expense. Ties go to the ledger
+        // listed first, and within a ledger to the lower id, which is the
+        // (date, id) order of the offset ids.
+        int kmin = -1;
+        for (int k=0; k < nlds; k++) {
+            if (heads[k] >= lds[k].et.len)
+                continue;
+            if (kmin == -1 || lds[k].et.base[heads[k]].date < lds[kmin].et.base[heads[kmin]].date)
+                kmin = k;
+        }
+        if (kmin == -1)
+            break;
+
+        exp_t exp = lds[kmin].et.base[heads[kmin]++];
+        exp.descid = descmap[kmin][exp.descid];
+        exp.catid = catmap[kmin][exp.catid];
+        exp.id += kmin * LEDGER_ID_SPAN;
+        add_exp(et, exp);
+    }
+}
+
+// Load ledgers on worker threads, one per file, then merge them.
+static int load_ledgers(str_t *files, int nfiles, time_t startdt, time_t enddt, arena_t *exp_arena, arena_t scratch, exptbl_t *et) {
+    ledger_load_t *lds = aalloc(&scratch, sizeof(ledger_load_t) * nfiles);
+    int z = 0;
+
+    for (int k=0; k < nfiles; k++) {
+        lds[k].path = files[k].bytes;
+        lds[k].k = k;
+        lds[k].startdt = startdt;
+        lds[k].enddt = enddt;
+        unsigned long textsize = 0, arcsize = 0;
+        add_expense_path_size(lds[k].path, &textsize, &arcsize);
+        init_arena(&lds[k].arena, arena_size_for(textsize, arcsize));
+        lds[k].z = 1;
+        if (pthread_create(&lds[k].thread, NULL, load_ledger_thread, &lds[k]) != 0)
+            panic_err("pthread_create() error");
+    }
+    for (int k=0; k < nfiles; k++) {
+        pthread_join(lds[k].thread, NULL);
+        if (lds[k].z != 0)
+            z = lds[k].z;
+        else if (lds[k].et.next_id > LEDGER_ID_SPAN) {
+            fprintf(errout(), "Expense ids of '%s' are too large to combine with other expense files.\n", lds[k].path);
+            z = 1;
+        }
+    }
+
+    if (z == 0) {
+        stats_mark_t t = stats_start();
+        merge_ledgers(lds, nfiles, exp_arena, scratch, et);
+        stats_end("merge", t);
+        et->nfiles = nfiles;
+        et->ledgers = aalloc(exp_arena, sizeof(ledgerstate_t) * nfiles);
+        for (int k=0; k < nfiles; k++) {
+            exptbl_t *src = &lds[k].et;
+            et->ledgers[k] = (ledgerstate_t){src->fstate, src->journal_size, src->partitioned};
+        }
+    }
+    for (int k=0; k < nfiles; k++)
+        free_arena(&lds[k].arena);
+    return z;
+}
+#endif
+
+// Position of a category table entry, to match entries to their index
+// after sorting the table.
+typedef struct {
+    uint32_t off;
+    int idx;
+} catpos_t;
+
+static int cmp_catpos(const void *a, const void *b) {
+    const catpos_t *p1 = a;
+    const catpos_t *p2 = b;
+    if (p1->off != p2->off)
+        return p1->off < p2->off ? -1 : 1;
+    return 0;
+}
+
+// Load expenses from the expense file, or from all expense files when
+// more than one is configured.
+int load_expense_file(arena_t *exp_arena, arena_t scratch, exptbl_t *et) {
+    return load_expense_range(exp_arena, scratch, et, 0, 0);
+}
+
+// Load expenses, skipping year partitions that don't overlap
+// [startdt, enddt) for a year partitioned expense directory.
+// Expenses outside the range may still be loaded.
+int load_expense_range(arena_t *exp_arena, arena_t scratch, exptbl_t *et, time_t startdt, time_t enddt) {
+    str_t files[MAX_EXPENSE_FILES];
+    int z;
+
+    stats_mark_t tload = stats_start();
+    int nfiles = get_expense_filenames(&scratch, files, countof(files));
+    if (lock_expense_file(EXPLOCK_READ) != 0)
+        return 1;
+#ifndef WINDOWS
+    if (nfiles > 1)
+        z = load_ledgers(files, nfiles, startdt, enddt, exp_arena, scratch, et);
+    else
+#endif
+        z = read_expense_path(files[0].bytes, exp_arena, et, startdt, enddt);
+    unlock_expense_file(EXPLOCK_READ);
+    if (z != 0)
+        return z;
+
+    // Sort categories table alphabetically
+    stats_mark_t t = stats_start();
+    int ncats = et->cats.len;
+    arena_t a;
+    init_arena(&a, (sizeof(catpos_t)*2 + sizeof(int)) * ncats + SIZE_TINY);
+    catpos_t *oldpos = aalloc(&a, sizeof(catpos_t) * ncats);
+    catpos_t *newpos = aalloc(&a, sizeof(catpos_t) * ncats);
+    for (int i=0; i < ncats; i++)
+        oldpos[i] = (catpos_t){et->cats.base[i].off, i};
+    sort_strtbl(&et->cats, cmp_str);
+
+    // Re-set exp catid's to new sorted categories table. Sorting only
+    // moves entries, so each one keeps its pool offset: with the old and
+    // new positions both ordered by offset, the k-th of each are the
+    // same entry.
+    for (int i=0; i < ncats; i++)
+        newpos[i] = (catpos_t){et->cats.base[i].off, i};
+    qsort(oldpos, ncats, sizeof(catpos_t), cmp_catpos);
+    qsort(newpos, ncats, sizeof(catpos_t), cmp_catpos);
+    int *catmap = aalloc(&a, sizeof(int) * ncats);
+    for (int i=0; i < ncats; i++)
+        catmap[oldpos[i].idx] = newpos[i].idx;
+    for (int i=0; i < et->len; i++) {
+        exp_t *exp = &et->base[i];
+        exp->catid = catmap[exp->catid];
+    }
+    free_arena(&a);
+    strtbl_build_keys(&et->cats);
+    stats_end("catsort", t);
+    stats_end("load", tload);
+    return 0;
+}
+
+// Read expense records from f and merge them into et.
+// Each line can be in expense file format or CSV format:
+//   2016-05-01; 00:00; Mochi Cream coffee; 100.00; coffee
+//   2016-05-01,00:00,"Mochi Cream coffee",100.00,coffee
+// et must already be sorted by date.
+// Returns the number of records imported, or -1 on error.
+int import_expenses(FILE *f, exptbl_t *et, arena_t scratch) {
+    char *buf = NULL;
+    size_t cap = 0;
+    int nlines = 0;
+    int istart = et->len;
+    exprec_t rec;
+
+    while (read_import_record(f, &buf, &cap, &nlines, &rec)) {
+        if (!is_year_in_range(et, rec.date)) {
+            fprintf(errout(), "Skipping record with year out of range on line %d\n", nlines);
+            continue;
+        }
+        exp_t exp;
+        exp.date = rec.date;
+        exp.descid = strtbl_intern(&et->strings, rec.desc);
+        exp.amt = rec.amt;
+        exp.catid = strtbl_intern(&et->cats, rec.cat);
+        exp.id = new_exp_id(et);
+        add_exp(et, exp);
+    }
+    free(buf);
+    if (ferror(f)) {
+        print_error("Error reading import file");
+        return -1;
+    }
+
+    int nimported = et->len - istart;
+    sort_exptbl_part(et, istart, et->len-1, cmp_exp_date);
+    merge_exptbl_tail(et, istart, cmp_exp_date);
+    return nimported;
+}
+
+// Read the next valid record of an import file into rec, skipping blank
+// lines, a CSV header line and invalid records. Lines of any length are
+// read into *buf, which is grown as needed and freed by the caller.
+// Returns 0 at end of file.
+static int read_import_record(FILE *f, char **buf, size_t *cap, int *nlines, exprec_t *rec) {
+    while (read_text_line(f, buf, cap, 0)) {
+        char *p = skip_ws(*buf);
+        if (strlen(p) == 0)
+            continue;
+        (*nlines)++;
+
+        // Skip CSV header line.
+        if (*nlines == 1 && (*p < '0' || *p > '9'))
+            continue;
+
+        // The separator after the date tells the format, since quoted CSV
+        // fields can contain ';'.
+        char *sep = p;
+        while ((*sep >= '0' && *sep <= '9') || *sep == '-')
+            sep++;
+        sep = skip_ws(sep);
+        int z;
+        if (*sep == ';')
+            z = read_exprec(p, rec);
+        else {
+            z = read_csv_exprec(p, rec);
+            // ';' separates fields in the expense file.
+            for (char *s = rec->desc; (s = strchr(s, ';')) != NULL; )
+                *s = ',';
+            for (char *s = rec->cat; (s = strchr(s, ';')) != NULL; )
+                *s = ',';
+        }
+        if (rec->date == 0) {
+            fprintf(errout(), "Skipping invalid record on line %d\n", *nlines);
+            continue;
+        }
+        if (z != 0) {
+            fprintf(errout(), "Skipping record with invalid amount on line %d\n", *nlines);
+            continue;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Return next CSV field in *pp, unquoting it in place if needed.
+static char *next_csv_field(char **pp) {
+    char *p = skip_ws(*pp);
+    char *field = p;
+
+    if (*p != '"') {
+        while (*p != '\0' && *p != ',')
+            p++;
+        if (*p == ',')
+            *p++ = '\0';
+        *pp = p;
+        return field;
+    }
+
+    // Quoted field, "" is an escaped quote.
+    char *dst = field;
+    p++;
+    while (*p != '\0') {
+        if (*p == '"') {
+            if (p[1] != '"')
+                break;
+            p++;
+        }
+        *dst++ = *p++;
+    }
+    if (*p == '"')
+        p++;
+    while (*p != '\0' && *p != ',')
+        p++;
+    if (*p == ',')
+        p++;
+    *dst = '\0';
+    *pp = p;
+    return field;
+}
+
+// Parse amount s into *amt. Returns 1 if s isn't just a number
+// (ex. "1,234.50"), in which case *amt is what atof() would make of it.
+static int read_amount(const char *s, float *amt) {
+    char *end;
+    *amt = strtod(s, &end);
+    while (*end == ' ')
+        end++;
+    return end == s || *end != '\0';
+}
+
+// Returns 1 if the amount is invalid.
+static int read_csv_exprec(char *buf, exprec_t *rec) {
+    // Sample CSV line:
+    // 2016-05-01,00:00,"Mochi Cream coffee",100.00,coffee
+
+    char *p = buf;
+    char *pdate = next_csv_field(&p);
+    char *ptime = next_csv_field(&p);
+    char *pdesc = next_csv_field(&p);
+    char *pamt = next_csv_field(&p);
+    char *pcat = next_csv_field(&p);
+
+    rec->date = date_from_sdatetime(pdate, ptime);
+    rec->desc = pdesc;
+    int z = read_amount(pamt, &rec->amt);
+    rec->cat = pcat;
+    rec->id = 0;
+    return z;
+}
+
+static exp_t read_expense(char *buf, exptbl_t *et) {
+    exprec_t rec;
+    exp_t retexp;
+
+    read_exprec(buf, &rec);
+    retexp.date = rec.date;
+    retexp.descid = strtbl_intern(&et->strings, rec.desc);
+    retexp.amt = rec.amt;
+    retexp.catid = strtbl_intern(&et->cats, rec.cat);
+    retexp.id = rec.id;
+    return retexp;
+}
+
+// Returns 1 if the amount is invalid.
+static int read_exprec(char *buf, exprec_t *rec) {
+    char *pdate, *ptime;
+
+    // Sample expense line:
+    // 2016-05-01; 00:00; Mochi Cream coffee; 100.00; coffee; #123
+    //
+    // The trailing #id field is optional. Expenses without one are
+    // assigned an id when loaded.
+
+    char *pfield;
+    char *nextp;
+
+    // date
+    pdate = buf;
+    nextp = next_field(pdate);
+
+    // time
+    ptime = nextp;
+    nextp = next_field(ptime);
+    rec->date = date_from_sdatetime(pdate, ptime);
+
+    // description
+    rec->desc = nextp;
+    nextp = next_field(rec->desc);
+
+    // amount
+    pfield = nextp;
     nextp = next_field(pfield);
-    retexp.amt = atof(pfield);
+    int z = read_amount(pfield, &rec->amt);
 
     // category
+    rec->cat = nextp;
+    nextp = next_field(rec->cat);
+
+    // id
     pfield = nextp;
     nextp = next_field(pfield);
-    retexp.catid = strtbl_find(et->cats, pfield);
-    if (retexp.catid == 0) {
-        retexp.catid = strtbl_add(&et->cats, pfield);
-    }
-
-    return retexp;
+    rec->id = 0;
+    if (*pfield == '#')
+        rec->id = atoi(pfield+1);
+    return z;
 }
 
 // Remove trailing \n or \r chars.
@@ -300,40 +2586,892 @@ static char *next_field(char *startp) {
     return p;
 }
 
-int save_expense_file(exptbl_t et, arena_t scratch) {
+// Create a temp file for a new version of expfile, in the same directory
+// so that it can be renamed over expfile. The name is put in tmpfile.
+static FILE *create_expense_tmpfile(const char *expfile, char *tmpfile, size_t tmpfile_len, int archive) {
     FILE *f;
-    char isodate[ISO_DATE_LEN+1];
-    char hhmmtime[HHMM_TIME_LEN+1];
+#ifdef WINDOWS
+    snprintf(tmpfile, tmpfile_len, "%s.tmp", expfile);
+    f = fopen(tmpfile, archive ? "wb" : "w");
+#else
+    snprintf(tmpfile, tmpfile_len, "%s.tmpXXXXXX", expfile);
+    int fd = mkstemp(tmpfile);
+    if (fd == -1) {
+        fprintf(errout(), "Error creating '%s': ", tmpfile);
+        print_error(NULL);
+        return NULL;
+    }
+    // Keep permissions of the existing expense file, or use the default
+    // permissions for a new file.
+    struct stat st;
+    if (stat(expfile, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    f = fdopen(fd, "w");
+#endif
+    if (f == NULL) {
+        fprintf(errout(), "Error opening '%s': ", tmpfile);
+        print_error(NULL);
+        return NULL;
+    }
+    // Write the file in large sequential chunks.
+    static char iobuf[SIZE_MEDIUM];
+    setvbuf(f, iobuf, _IOFBF, sizeof(iobuf));
+    return f;
+}
 
-    str_t expfile = get_expense_filename(&scratch);
+// Write one expense line to f. The line is put together in line[] and
+// written in one go, only the amount goes through printf formatting.
+static void put_expense_line(FILE *f, time_t date, str_t sdesc, float amt, str_t scat, int id) {
+    char line[SIZE_SMALL];
+    if (sdesc.len + scat.len > sizeof(line) - 128) {
+        char isodate[ISO_DATE_LEN+1];
+        char hhmmtime[HHMM_TIME_LEN+1];
+        date_to_iso(date, isodate, sizeof(isodate));
+        date_to_hhmm(date, hhmmtime, sizeof(hhmmtime));
+        fprintf(f, "%s; %s; %s; %.2f; %s; #%d\n", isodate, hhmmtime, sdesc.bytes, amt, scat.bytes, id);
+        return;
+    }
 
-    // Back up expense file to .bak before overwriting it.
-    if (file_exists(expfile.bytes)) {
-        char backupfile[2048];
-        snprintf(backupfile, sizeof(backupfile), "%s.bak", expfile.bytes);
+    // Years past 9999 or before 0 take more than ISO_DATE_LEN characters.
+    char *p = line;
+    date_to_iso(date, p, 32);
+    p += strlen(p);
+    *p++ = ';';
+    *p++ = ' ';
+    date_to_hhmm(date, p, HHMM_TIME_LEN+1);
+    p += HHMM_TIME_LEN;
+    *p++ = ';';
+    *p++ = ' ';
+    memcpy(p, sdesc.bytes, sdesc.len);
+    p += sdesc.len;
+    p += sprintf(p, "; %.2f; ", amt);
+    memcpy(p, scat.bytes, scat.len);
+    p += scat.len;
+    p += sprintf(p, "; #%d\n", id);
+    fwrite(line, 1, p - line, f);
+}
+
+// Flush, fsync and close temp file f, then atomically rename it over
+// expfile. Readers either see the old file or the new one, never a
+// partially written file. The previous file is kept as a hard link to
+// expfile.bak. z is nonzero if writing f already failed, then f is only
+// removed.
+static int replace_expense_file(FILE *f, const char *tmpfile, const char *expfile, int z, expfile_state_t *fs) {
+    char backupfile[2048];
+    snprintf(backupfile, sizeof(backupfile), "%s.bak", expfile);
+
+    if (fflush(f) != 0)
+        z = 1;
+    expfile_state_t fstate;
+    get_file_state(f, &fstate);
+#ifndef WINDOWS
+    if (z == 0 && fsync(fileno(f)) != 0)
+        z = 1;
+#endif
+    if (fclose(f) != 0)
+        z = 1;
+    if (z != 0) {
+        fprintf(errout(), "Error writing '%s': ", tmpfile);
+        print_error(NULL);
+        remove(tmpfile);
+        return 1;
+    }
+
+#ifdef WINDOWS
+    // No atomic replace of an existing file, fall back to rename via backup.
+    remove(backupfile);
+    if (file_exists(expfile) && rename(expfile, backupfile))
+        perror("Error creating backup file");
+    if (rename(tmpfile, expfile)) {
+        fprintf(errout(), "Error replacing '%s': ", expfile);
+        print_error(NULL);
+        return 1;
+    }
+#else
+    // Swap in the new file while no reader is opening the expense file.
+    if (open_lock_file() == 0)
+        set_file_lock(g_lockfd, F_WRLCK, LOCK_COMMIT_BYTE, NULL);
 
+    // Back up expense file to .bak as a hard link to the current file.
+    if (file_exists(expfile)) {
         remove(backupfile);
-        if (rename(expfile.bytes, backupfile))
+        if (link(expfile, backupfile))
             perror("Error creating backup file");
     }
+    z = rename(tmpfile, expfile);
+    if (g_lockfd != -1)
+        set_file_lock(g_lockfd, F_UNLCK, LOCK_COMMIT_BYTE, NULL);
+    if (z != 0) {
+        fprintf(errout(), "Error replacing '%s': ", expfile);
+        print_error(NULL);
+        remove(tmpfile);
+        return 1;
+    }
+    sync_parent_dir(expfile);
+#endif
+    if (fs != NULL)
+        *fs = fstate;
+    return 0;
+}
+
+// Write expenses [istart, iend) to a new version of expfile.
+// If archive is set, expenses are written in archive format.
+static int write_expenses(const char *expfile, exptbl_t *et, int istart, int iend, expfile_state_t *fs, int archive) {
+    char tmpfile[2048];
+    FILE *f = create_expense_tmpfile(expfile, tmpfile, sizeof(tmpfile), archive);
+    if (f == NULL)
+        return 1;
+
+    for (int i=istart; !archive && i < iend; i++) {
+        exp_t exp = et->base[i];
+        put_expense_line(f, exp.date, strtbl_get(et->strings, exp.descid), exp.amt, strtbl_get(et->cats, exp.catid), exp.id);
+    }
+
+    int z = 0;
+    if (archive && write_archive(f, et, istart, iend) != 0)
+        z = 1;
+    return replace_expense_file(f, tmpfile, expfile, z, fs);
+}
+
+// Save expenses to the expense file, or for a year partitioned expense
+// directory, to the partition files of the years that were changed.
+int save_expense_file(exptbl_t *et, arena_t scratch) {
+    if (et->nfiles > 1) {
+        fprintf(errout(), "Can't save expenses loaded from more than one expense file.\n");
+        return 1;
+    }
+
+    stats_mark_t t = stats_start();
+    sort_exptbl(et, cmp_exp_date);
+    t = stats_end("sort", t);
+
+    int z = 0;
+    str_t expfile = get_expense_filename(&scratch);
+    expfile_state_t fstate;
+    if (et->partitioned) {
+        z = save_partitions(expfile.bytes, et);
+    } else if ((z = write_expenses(expfile.bytes, et, 0, et->len, &fstate, 0)) == 0) {
+        et->fstate = fstate;
+        remove_expense_journal(expfile.bytes);
+        et->journal_size = 0;
+        write_expense_cache(expfile.bytes, et);
+    }
+    stats_end("save", t);
+    return z;
+}
+
+// Expense journal
+//
+// With async saves, a command that changes expenses appends the changed
+// expenses to <expfile>.journal and returns, and a detached writer process
+// rewrites the expense file later. Loads apply the journal on top of the
+// expense file, so readers see the changes right away. Each line of the
+// journal is an intent:
+//
+//   + 2016-05-01; 00:00; Mochi Cream coffee; 100.00; coffee; #123
+//   - #123
+//
+// '+' adds expense #123 or replaces it if it exists, '-' deletes it. Both
+// are idempotent, so a journal applied to an expense file that already has
+// its changes gives the same expenses. Lines are only appended and only
+// applied once complete, so a torn write at the end is ignored.
+//
+// The journal is written and removed by processes holding EXPLOCK_WRITE:
+// the command that journals changes, and any save, which writes out all
+// expenses loaded with the journal applied.
+
+static void get_journal_filename(const char *expfile, char *buf, size_t buf_len) {
+    snprintf(buf, buf_len, "%s.journal", expfile);
+}
+static long get_journal_size(const char *expfile) {
+    char path[2048];
+    struct stat st;
+    get_journal_filename(expfile, path, sizeof(path));
+    if (stat(path, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+// Read the next line of f of any length into *buf, growing it as needed,
+// without the newline. Returns 0 at end of file. If whole_lines is set, a
+// last line without a newline (ex. a journal line only partly written)
+// is treated as end of file too.
+static int read_text_line(FILE *f, char **buf, size_t *cap, int whole_lines) {
+    size_t len = 0;
+    while (1) {
+        if (*cap - len < 2) {
+            size_t newcap = *cap == 0 ? SIZE_SMALL : *cap * 2;
+            char *p = realloc(*buf, newcap);
+            if (p == NULL)
+                panic_err("realloc() error");
+            *buf = p;
+            *cap = newcap;
+        }
+        if (fgets(*buf + len, *cap - len, f) == NULL) {
+            if (whole_lines || len == 0)
+                return 0;
+            chomp(*buf);
+            return 1;
+        }
+        len += strlen(*buf + len);
+        if (len > 0 && (*buf)[len-1] == '\n') {
+            chomp(*buf);
+            return 1;
+        }
+    }
+}
+
+// Apply the journal of expfile, if any, to et.
+// Returns 1 if there was a journal, 0 if not.
+static int read_expense_journal(const char *expfile, exptbl_t *et) {
+    char path[2048];
+    char *buf = NULL;
+    size_t cap = 0;
+
+    get_journal_filename(expfile, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (read_text_line(f, &buf, &cap, 1)) {
+        if (buf[0] == '-' && buf[1] == ' ' && buf[2] == '#') {
+            int slot = find_exp_id(et, atoi(buf+3));
+            if (slot != -1)
+                del_exp(et, slot);
+        } else if (buf[0] == '+' && buf[1] == ' ') {
+            exp_t exp = read_expense(buf+2, et);
+            if (exp.id <= 0)
+                continue;
+            int slot = find_exp_id(et, exp.id);
+            if (slot != -1)
+                replace_exp(et, slot, exp);
+            else
+                add_exp(et, exp);
+        }
+    }
+    et->journal_size = ftell(f);
+    fclose(f);
+    free(buf);
+    return 1;
+}
+
+// Remove the journal after its changes were saved to the expense file.
+static void remove_expense_journal(const char *expfile) {
+    char path[2048];
+    get_journal_filename(expfile, path, sizeof(path));
+    if (remove(path) != 0 && errno != ENOENT)
+        perror("Error removing expense journal");
+}
+
+// Start recording the ids of expenses changed in et, so that they can be
+// saved with save_expense_file_async().
+void track_exp_changes(exptbl_t *et) {
+    et->changes = aalloc(et->arena, sizeof(int) * JOURNAL_MAX_CHANGES);
+    et->nchanges = 0;
+}
+
+#ifndef WINDOWS
+// Append an intent for each changed expense of et to the journal and sync it.
+static int write_expense_journal(const char *expfile, exptbl_t *et) {
+    char path[2048];
+    char isodate[ISO_DATE_LEN+1];
+    char hhmmtime[HHMM_TIME_LEN+1];
 
-    f = fopen(expfile.bytes, "w");
+    get_journal_filename(expfile, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        fprintf(errout(), "Error opening '%s': ", path);
+        print_error(NULL);
+        return 1;
+    }
+    // A failed append is cut back off, so that none of its intents are
+    // applied by later loads.
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        print_error("Error reading journal size");
+        close(fd);
+        return 1;
+    }
+    FILE *f = fdopen(fd, "a");
     if (f == NULL) {
-        fprintf(stderr, "Error opening '%s': ", expfile.bytes);
+        close(fd);
+        return 1;
+    }
+    for (int i=0; i < et->nchanges; i++) {
+        int id = et->changes[i];
+        int seen = 0;
+        for (int j=0; j < i && !seen; j++)
+            seen = et->changes[j] == id;
+        if (seen || id <= 0)
+            continue;
+
+        exp_t *exp = get_exp(et, find_exp_id(et, id));
+        if (exp == NULL) {
+            fprintf(f, "- #%d\n", id);
+            continue;
+        }
+        date_to_iso(exp->date, isodate, sizeof(isodate));
+        date_to_hhmm(exp->date, hhmmtime, sizeof(hhmmtime));
+        fprintf(f, "+ %s; %s; %s; %.2f; %s; #%d\n", isodate, hhmmtime,
+                strtbl_get(et->strings, exp->descid).bytes, exp->amt,
+                strtbl_get(et->cats, exp->catid).bytes, exp->id);
+    }
+
+    int z = 0;
+    if (ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0)
+        z = 1;
+    if (z != 0) {
+        fprintf(errout(), "Error writing '%s': ", path);
+        print_error(NULL);
+        if (ftruncate(fileno(f), st.st_size) == 0)
+            fsync(fileno(f));
+        fclose(f);
+        return 1;
+    }
+    if (fclose(f) != 0) {
+        fprintf(errout(), "Error writing '%s': ", path);
         print_error(NULL);
         return 1;
     }
-    sort_exptbl(&et, cmp_exp_date);
+    sync_parent_dir(path);
+    et->nchanges = 0;
+    et->journal_size = get_journal_size(expfile);
+    return 0;
+}
+
+// Apply the journal to the expense file: load expenses with the journal
+// applied and save them, which removes the journal. Runs in the detached
+// writer process.
+static int flush_expense_journal(arena_t scratch) {
+    char path[2048];
+    str_t expfile = get_expense_filename(&scratch);
+
+    // The writer doesn't hold the lock of the command that started it.
+    // Its fd shares the command's lock, so take the lock on a new one.
+    if (g_lockfd != -1)
+        close(g_lockfd);
+    g_lockfd = -1;
+    g_write_locked = 0;
+    if (lock_expense_file(EXPLOCK_WRITE) != 0)
+        return 1;
+
+    // Nothing to do if a save since then already wrote the changes.
+    int z = 0;
+    get_journal_filename(expfile.bytes, path, sizeof(path));
+    if (file_exists(path)) {
+        arena_t exp_arena;
+        exptbl_t et;
+        init_arena(&exp_arena, get_expense_arena_size(scratch, 0));
+        z = load_expense_file(&exp_arena, scratch, &et);
+        if (z == 0)
+            z = save_expense_file(&et, scratch);
+        free_arena(&exp_arena);
+    }
+    unlock_expense_file(EXPLOCK_WRITE);
+    return z;
+}
+
+// Start a writer process to flush the journal, detached so that the
+// command can exit right away. The writer waits for the write lock, which
+// the command holds until it's done.
+static void start_journal_writer(arena_t scratch) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork() error");
+        return;
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    // Fork again so that the writer isn't a child of the command.
+    setsid();
+    if (fork() != 0)
+        _exit(0);
+
+    int fd = open("/dev/null", O_RDWR);
+    if (fd != -1) {
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
+    }
+    g_stats.enabled = 0;
+    _exit(flush_expense_journal(scratch));
+}
+#endif
+
+// Save changes tracked since track_exp_changes() to the journal and leave
+// rewriting the expense file to a background writer. Falls back to
+// save_expense_file() when changes weren't tracked, there are too many of
+// them, or the expenses are in a year partitioned directory, whose saves
+// only rewrite the changed years.
+int save_expense_file_async(exptbl_t *et, arena_t scratch) {
+#ifndef WINDOWS
+    if (et->nchanges >= 0 && et->nchanges <= JOURNAL_MAX_CHANGES && !et->partitioned && et->nfiles == 1) {
+        stats_mark_t t = stats_start();
+        str_t expfile = get_expense_filename(&scratch);
+        int z = write_expense_journal(expfile.bytes, et);
+        if (z == 0)
+            start_journal_writer(scratch);
+        stats_end("journal", t);
+        return z;
+    }
+#endif
+    return save_expense_file(et, scratch);
+}
+
+// Streaming
+//
+// Expense files too large to load are streamed instead, see
+// use_external_memory(). scan_expense_file() passes each record to a
+// callback without keeping it, applying the journal on the way, and
+// import_expenses_ext() merges imported records into the expense file with
+// an external sort.
+
+typedef struct {
+    int id;
+    int seq;
+    char *line;         // expense line, NULL if deleted
+} jentry_t;
+
+typedef struct {
+    expscan_func_t func;
+    void *ctx;
+    jentry_t *journal;
+    int njournal;
+    int maxid;
+} scanner_t;
+
+static int cmp_jentry_id(const void *a, const void *b) {
+    const jentry_t *ja = a;
+    const jentry_t *jb = b;
+    return (ja->id > jb->id) - (ja->id < jb->id);
+}
+static int cmp_jentry_id_seq(const void *a, const void *b) {
+    const jentry_t *ja = a;
+    const jentry_t *jb = b;
+    int z = cmp_jentry_id(a, b);
+    if (z != 0)
+        return z;
+    return (ja->seq > jb->seq) - (ja->seq < jb->seq);
+}
+
+// Read the last intent for each expense in the journal of expfile into
+// *pentries, sorted by id. Returns the number of entries.
+static int read_journal_entries(const char *expfile, jentry_t **pentries) {
+    char path[2048];
+    char *buf = NULL;
+    size_t bufcap = 0;
+    jentry_t *entries = NULL;
+    int n = 0, cap = 0;
+
+    *pentries = NULL;
+    get_journal_filename(expfile, path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (read_text_line(f, &buf, &bufcap, 1)) {
+        jentry_t e = {0, n, NULL};
+        if (buf[0] == '-' && buf[1] == ' ' && buf[2] == '#') {
+            e.id = atoi(buf+3);
+        } else if (buf[0] == '+' && buf[1] == ' ') {
+            exprec_t rec;
+            e.line = strdup(buf+2);
+            if (e.line == NULL)
+                panic_err("strdup() error");
+            read_exprec(buf+2, &rec);
+            e.id = rec.id;
+        }
+        if (e.id <= 0) {
+            free(e.line);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap == 0 ? 64 : cap*2;
+            entries = realloc(entries, sizeof(jentry_t) * cap);
+            if (entries == NULL)
+                panic("realloc() error");
+        }
+        entries[n++] = e;
+    }
+    fclose(f);
+    free(buf);
+
+    qsort(entries, n, sizeof(jentry_t), cmp_jentry_id_seq);
+    int nlast = 0;
+    for (int i=0; i < n; i++) {
+        if (i+1 < n && entries[i+1].id == entries[i].id) {
+            free(entries[i].line);
+            continue;
+        }
+        entries[nlast++] = entries[i];
+    }
+    *pentries = entries;
+    return nlast;
+}
+
+// Records of the expense file changed by the journal are skipped, the
+// journal's version is passed after the expense file.
+static void scan_record(void *ctx, exprec_t *rec) {
+    scanner_t *sc = ctx;
+    if (rec->id > sc->maxid)
+        sc->maxid = rec->id;
+    if (rec->id > 0 && sc->njournal > 0) {
+        jentry_t key = {rec->id, 0, NULL};
+        if (bsearch(&key, sc->journal, sc->njournal, sizeof(jentry_t), cmp_jentry_id) != NULL)
+            return;
+    }
+    sc->func(sc->ctx, rec);
+}
+
+// Call func on each expense of the expense file in file order, then on
+// the expenses added or changed by its journal. Records are parsed in
+// place and only valid during the call. Expenses without an id are passed
+// with id 0, they would be given ids from *maxid+1 in file order when
+// loaded. *maxid is set to the largest id in the expense file.
+// Returns 0 on success.
+int scan_expense_file(arena_t scratch, expscan_func_t func, void *ctx, int *maxid) {
+    str_t expfile = get_expense_filename(&scratch);
+    stats_mark_t t = stats_start();
 
-    for (int i=0; i < et.len; i++) {
-        exp_t exp = et.base[i];
-        date_to_iso(exp.date, isodate, sizeof(isodate));
-        date_to_hhmm(exp.date, hhmmtime, sizeof(hhmmtime));
-        str_t sdesc = strtbl_get(et.strings, exp.descid);
-        str_t scat = strtbl_get(et.cats, exp.catid);
-        fprintf(f, "%s; %s; %s; %.2f; %s\n", isodate, hhmmtime, sdesc.bytes, exp.amt, scat.bytes);
+    int z = touch_expense_file(expfile.bytes);
+    if (z != 0)
+        return z;
+    if (lock_expense_file(EXPLOCK_READ) != 0)
+        return 1;
+    FILE *f = fopen(expfile.bytes, "r");
+    if (f == NULL) {
+        fprintf(errout(), "Error opening '%s': ", expfile.bytes);
+        print_error(NULL);
+        unlock_expense_file(EXPLOCK_READ);
+        return 1;
     }
+
+    scanner_t sc = {func, ctx, NULL, 0, 0};
+    sc.njournal = read_journal_entries(expfile.bytes, &sc.journal);
+    lineparser_t lp = {NULL, 0, scan_record, &sc, 0, NULL, 0, 0};
+    parse_expense_file(f, &lp);
     fclose(f);
+    unlock_expense_file(EXPLOCK_READ);
+
+    *maxid = sc.maxid;
+    for (int i=0; i < sc.njournal; i++) {
+        if (sc.journal[i].line == NULL)
+            continue;
+        exprec_t rec;
+        read_exprec(sc.journal[i].line, &rec);
+        func(ctx, &rec);
+        free(sc.journal[i].line);
+    }
+    free(sc.journal);
+    stats_end("scan", t);
     return 0;
 }
 
+typedef struct {
+    extsort_t xs;
+    int nnoid;          // expenses without an id
+    int maxid;          // largest id, including the journal
+    int maxfileid;      // largest id in the expense file
+    int next_id;        // id of the first imported expense
+    FILE *out;
+} extimport_t;
+
+static void import_scan_record(void *ctx, exprec_t *rec) {
+    extimport_t *im = ctx;
+    int64_t idkey = rec->id;
+    if (rec->id <= 0)
+        idkey = EXT_NOID + ++im->nnoid;
+    else if (rec->id > im->maxid)
+        im->maxid = rec->id;
+    extsort_add_exp(&im->xs, rec, idkey);
+}
+
+static void write_import_record(void *ctx, void *rec, int len) {
+    extimport_t *im = ctx;
+    extexp_t *x = rec;
+    int id = x->idkey;
+    if (x->idkey >= EXT_NOID) {
+        int seq = x->idkey - EXT_NOID;
+        id = seq <= im->nnoid ? im->maxfileid + seq : im->next_id + seq - im->nnoid - 1;
+    }
+    str_t sdesc = {x->text, x->catoff-1};
+    str_t scat = {x->text + x->catoff, strlen(x->text + x->catoff)};
+    put_expense_line(im->out, x->date, sdesc, x->amt, scat, id);
+}
+
+// Import records from f into the expense file without loading it: the
+// expense file and the imported records are sorted by date with an
+// external sort and merged straight into the new expense file.
+// Expenses without an id and imported expenses are numbered after the
+// others, and given ids as when loaded and imported in memory.
+// Returns the number of records imported, or -1 on error.
+int import_expenses_ext(FILE *f, arena_t scratch) {
+    extimport_t im;
+    memset(&im, 0, sizeof(im));
+    init_extsort(&im.xs, get_memory_budget(), cmp_extexp_date);
+    if (scan_expense_file(scratch, import_scan_record, &im, &im.maxfileid) != 0) {
+        extsort_finish(&im.xs, NULL, NULL);
+        return -1;
+    }
+
+    char *buf = NULL;
+    size_t cap = 0;
+    int nlines = 0;
+    int nimported = 0;
+    exprec_t rec;
+    im.next_id = im.maxfileid + im.nnoid;
+    if (im.maxid > im.next_id)
+        im.next_id = im.maxid;
+    im.next_id++;
+    while (read_import_record(f, &buf, &cap, &nlines, &rec)) {
+        nimported++;
+        extsort_add_exp(&im.xs, &rec, EXT_NOID + im.nnoid + nimported);
+    }
+    free(buf);
+    if (ferror(f)) {
+        print_error("Error reading import file");
+        extsort_finish(&im.xs, NULL, NULL);
+        return -1;
+    }
+    if (nimported == 0) {
+        extsort_finish(&im.xs, NULL, NULL);
+        return 0;
+    }
+
+    stats_mark_t t = stats_start();
+    char tmpfile[2048];
+    str_t expfile = get_expense_filename(&scratch);
+    im.out = create_expense_tmpfile(expfile.bytes, tmpfile, sizeof(tmpfile), 0);
+    if (im.out == NULL) {
+        extsort_finish(&im.xs, NULL, NULL);
+        return -1;
+    }
+    int z = extsort_finish(&im.xs, write_import_record, &im);
+    z = replace_expense_file(im.out, tmpfile, expfile.bytes, z, NULL);
+    stats_end("save", t);
+    if (z != 0)
+        return -1;
+
+    // The journal was merged in, and the cache is of the old file.
+    remove_expense_journal(expfile.bytes);
+    get_cache_filename(expfile.bytes, tmpfile, sizeof(tmpfile));
+    remove(tmpfile);
+    return nimported;
+}
+
+// Statistics
+//
+// With stats enabled (exp --stats or EXP2STATS=1), phases are timed and
+// counters are printed to stderr by print_stats(). When disabled,
+// stats_start() and stats_end() return without reading the clock.
+//
+// On Linux, phases also count cycles, instructions, last level cache misses
+// and branch misses with perf_event_open(), when the kernel allows it.
+// Counters are opened per thread on first use, and count user space only.
+
+expstats_t g_stats;
+#ifndef WINDOWS
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static double stats_now() {
+#ifdef WINDOWS
+    return clock() * 1000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+static void stats_lock() {
+#ifndef WINDOWS
+    pthread_mutex_lock(&g_stats_lock);
+#endif
+}
+static void stats_unlock() {
+#ifndef WINDOWS
+    pthread_mutex_unlock(&g_stats_lock);
+#endif
+}
+
+#ifdef __linux__
+// Counter group leader of this thread, -2 if not opened yet, -1 if
+// counters are unavailable. t_perf_idx[] is the position of each counter
+// in the group, or -1 if the counter couldn't be opened.
+static __thread int t_perf_fd = -2;
+static __thread int t_perf_idx[STATS_NCOUNTERS];
+
+static void open_counters() {
+    static const unsigned long long events[STATS_NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    int n = 0;
+
+    t_perf_fd = -1;
+    for (int i=0; i < STATS_NCOUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, t_perf_fd, PERF_FLAG_FD_CLOEXEC);
+        t_perf_idx[i] = -1;
+        if (fd == -1 && i == 0) {
+            stats_lock();
+            if (g_stats.counters_error[0] == '\0')
+                snprintf(g_stats.counters_error, sizeof(g_stats.counters_error), "%s", strerror(errno));
+            stats_unlock();
+            return;
+        }
+        if (fd == -1)
+            continue;
+        if (i == 0)
+            t_perf_fd = fd;
+        t_perf_idx[i] = n++;
+    }
+
+    stats_lock();
+    for (int i=0; i < STATS_NCOUNTERS; i++) {
+        if (t_perf_idx[i] != -1)
+            g_stats.counters_avail |= 1 << i;
+    }
+    stats_unlock();
+}
+#endif
+
+static void read_counters(unsigned long long *counters) {
+    memset(counters, 0, sizeof(unsigned long long) * STATS_NCOUNTERS);
+#ifdef __linux__
+    if (t_perf_fd == -2)
+        open_counters();
+    if (t_perf_fd < 0)
+        return;
+
+    unsigned long long buf[1 + STATS_NCOUNTERS];
+    ssize_t n = read(t_perf_fd, buf, sizeof(buf));
+    if (n < (ssize_t)sizeof(buf[0]))
+        return;
+    for (int i=0; i < STATS_NCOUNTERS; i++) {
+        int idx = t_perf_idx[i];
+        if (idx != -1 && idx < (int)buf[0])
+            counters[i] = buf[1 + idx];
+    }
+#endif
+}
+
+void init_stats(int enabled) {
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_stats.output_bytes = -1;
+    char *env = getenv("EXP2STATS");
+    if (env != NULL && env[0] != '\0' && !szequals(env, "0"))
+        enabled = 1;
+    g_stats.enabled = enabled;
+}
+// Returns start of a phase, to be passed to stats_end().
+stats_mark_t stats_start() {
+    stats_mark_t mark;
+    if (!g_stats.enabled) {
+        mark.ms = 0;
+        return mark;
+    }
+    read_counters(mark.counters);
+    mark.ms = stats_now();
+    return mark;
+}
+// Record phase as taking from start until now. Returns now so that the
+// next phase can start from it.
+stats_mark_t stats_end(const char *phase, stats_mark_t start) {
+    stats_mark_t now;
+    if (!g_stats.enabled) {
+        now.ms = 0;
+        return now;
+    }
+    now.ms = stats_now();
+    read_counters(now.counters);
+
+    stats_lock();
+    if (g_stats.nphases < MAX_STATS_PHASES) {
+        stats_phase_t *p = &g_stats.phases[g_stats.nphases];
+        p->name = phase;
+        p->ms = now.ms - start.ms;
+        for (int i=0; i < STATS_NCOUNTERS; i++)
+            p->counters[i] = now.counters[i] - start.counters[i];
+        g_stats.nphases++;
+    }
+    stats_unlock();
+    return now;
+}
+void stats_add_parsed(long nrecs, long nbytes) {
+    if (!g_stats.enabled)
+        return;
+    stats_lock();
+    g_stats.records_parsed += nrecs;
+    g_stats.bytes_parsed += nbytes;
+    stats_unlock();
+}
+
+static void print_stats_arena(const char *name, arena_t *a) {
+    if (a == NULL)
+        return;
+    fprintf(errout(), "    %-18s%12lu peak %12lu pos %12lu cap\n", name, arena_peak(a), a->pos, a->cap);
+}
+void print_stats(exptbl_t *et, arena_t *exp_arena, arena_t *scratch) {
+    if (!g_stats.enabled)
+        return;
+
+    static const char *counter_names[STATS_NCOUNTERS] = {"cycles", "instr", "llc-miss", "br-miss"};
+    int avail = g_stats.counters_avail;
+
+    fprintf(errout(), "\nexp stats\n\n");
+    fprintf(errout(), "    %-18s%12s", "phase", "ms");
+    for (int i=0; i < STATS_NCOUNTERS; i++) {
+        if (avail & (1 << i))
+            fprintf(errout(), " %12s", counter_names[i]);
+    }
+    if ((avail & 3) == 3)
+        fprintf(errout(), " %6s", "ipc");
+    fprintf(errout(), "\n");
+
+    for (int i=0; i < g_stats.nphases; i++) {
+        stats_phase_t *p = &g_stats.phases[i];
+        fprintf(errout(), "    %-18s%12.3f", p->name, p->ms);
+        for (int k=0; k < STATS_NCOUNTERS; k++) {
+            if (avail & (1 << k))
+                fprintf(errout(), " %12llu", p->counters[k]);
+        }
+        if ((avail & 3) == 3)
+            fprintf(errout(), " %6.2f", p->counters[0] ? (double)p->counters[1] / p->counters[0] : 0.0);
+        fprintf(errout(), "\n");
+    }
+    if (avail == 0 && g_stats.counters_error[0] != '\0')
+        fprintf(errout(), "\n    Hardware counters unavailable: %s\n", g_stats.counters_error);
+    fprintf(errout(), "\n");
+    fprintf(errout(), "    %-18s%12ld\n", "records parsed", g_stats.records_parsed);
+    fprintf(errout(), "    %-18s%12ld\n", "bytes parsed", g_stats.bytes_parsed);
+    if (et != NULL) {
+        fprintf(errout(), "    %-18s%12d len %12d cap\n", "expenses", et->len, et->cap);
+        fprintf(errout(), "    %-18s%12d len %12d cap\n", "strings", et->strings.len, et->strings.cap);
+        fprintf(errout(), "    %-18s%12u len %12u cap\n", "string pool", et->strings.pool_len, et->strings.pool_cap);
+        fprintf(errout(), "    %-18s%12d len %12d cap\n", "categories", et->cats.len, et->cats.cap);
+    }
+    print_stats_arena("exp arena", exp_arena);
+    print_stats_arena("scratch arena", scratch);
+    if (g_stats.output_bytes >= 0)
+        fprintf(errout(), "    %-18s%12ld\n", "output bytes", g_stats.output_bytes);
+}
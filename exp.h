@@ -9,37 +9,199 @@
 
 typedef struct {
     time_t date;
-    short descid;
+    int descid;
     float amt;
-    short catid;
+    int catid;
+    int id;
 } exp_t;
 
+// Expense record parsed in place from a line of expense text, with desc
+// and cat pointing into the line.
+typedef struct {
+    time_t date;
+    char *desc;
+    float amt;
+    char *cat;
+    int id;
+} exprec_t;
+
+// Expense file state as of the last load or save, used to detect when
+// the expense file was changed by another program.
+typedef struct {
+    unsigned long long ino;
+    long size;
+    unsigned long long tailhash;
+} expfile_state_t;
+
+// State of one of several expense files when loaded.
+typedef struct {
+    expfile_state_t fstate;
+    long journal_size;
+    int partitioned;
+} ledgerstate_t;
+
+// Years covered by a year partitioned expense directory.
+#define PART_MIN_YEAR 1900
+#define PART_YEARS    256
+
 typedef struct {
     arena_t *arena;
     exp_t *base;
-    short cap;
-    short len;
+    int cap;
+    int len;
 
     strtbl_t strings;
     strtbl_t cats;
+
+    // Next unused expense id.
+    int next_id;
+
+    // Open addressing hash index of expense id to slot in base[].
+    // Built on demand by find_exp_id(), invalidated when slots move.
+    int *idindex;
+    int idindex_cap;
+    int idindex_valid;
+
+    expfile_state_t fstate;
+
+    // Number of expense files loaded. Expenses from more than one
+    // expense file can't be saved. When there are more, ledgers[] has the
+    // state of each.
+    int nfiles;
+    ledgerstate_t *ledgers;
+
+    // Set when loaded from a year partitioned expense directory.
+    // Bitmaps of years loaded, years with changes to save and years
+    // stored as compressed archives.
+    int partitioned;
+    unsigned char part_loaded[PART_YEARS/8];
+    unsigned char part_dirty[PART_YEARS/8];
+    unsigned char part_archived[PART_YEARS/8];
+
+    // Ids of expenses changed since track_exp_changes(), for journaled
+    // saves. -1 if changes aren't tracked, more than JOURNAL_MAX_CHANGES
+    // if there were too many to journal.
+    int *changes;
+    int nchanges;
+
+    // Size of the expense journal applied when loaded.
+    long journal_size;
 } exptbl_t;
 
+#define JOURNAL_MAX_CHANGES 1024
+
+#define MAX_EXPENSE_FILES 64
+
+// When more than one expense file is loaded, ids of the expenses of the
+// k-th file are offset by k * LEDGER_ID_SPAN to keep them unique.
+#define LEDGER_ID_SPAN 10000000
+
+// Per-phase timings and counters, see init_stats().
+// Hardware counters: cycles, instructions, LLC misses, branch misses.
+#define MAX_STATS_PHASES 32
+#define STATS_NCOUNTERS  4
+
+typedef struct {
+    double ms;
+    unsigned long long counters[STATS_NCOUNTERS];
+} stats_mark_t;
+
+typedef struct {
+    const char *name;
+    double ms;
+    unsigned long long counters[STATS_NCOUNTERS];
+} stats_phase_t;
+
+typedef struct {
+    int enabled;
+    stats_phase_t phases[MAX_STATS_PHASES];
+    int nphases;
+    long records_parsed;
+    long bytes_parsed;
+    long output_bytes;
+
+    // Bit i set if hardware counter i could be opened.
+    int counters_avail;
+    char counters_error[64];
+} expstats_t;
+
+extern expstats_t g_stats;
+void init_stats(int enabled);
+stats_mark_t stats_start();
+stats_mark_t stats_end(const char *phase, stats_mark_t start);
+void stats_add_parsed(long nrecs, long nbytes);
+void print_stats(exptbl_t *et, arena_t *exp_arena, arena_t *scratch);
+
 str_t get_expense_filename(arena_t *a);
+int get_expense_filenames(arena_t *a, str_t *files, int maxfiles);
+str_t get_socket_filename(arena_t *a);
 int touch_expense_file(const char *expfile);
+unsigned long get_expense_arena_size(arena_t scratch, unsigned long extra);
 int load_expense_file(arena_t *exp_arena, arena_t scratch, exptbl_t *et);
-int save_expense_file(exptbl_t et, arena_t scratch);
+int load_expense_range(arena_t *exp_arena, arena_t scratch, exptbl_t *et, time_t startdt, time_t enddt);
+int save_expense_file(exptbl_t *et, arena_t scratch);
+int save_expense_file_async(exptbl_t *et, arena_t scratch);
+void track_exp_changes(exptbl_t *et);
+int import_expenses(FILE *f, exptbl_t *et, arena_t scratch);
+
+typedef void (*expscan_func_t)(void *ctx, exprec_t *rec);
+int scan_expense_file(arena_t scratch, expscan_func_t func, void *ctx, int *maxid);
+int import_expenses_ext(FILE *f, arena_t scratch);
+
+#define EXPFILE_UNCHANGED 0
+#define EXPFILE_APPENDED  1
+#define EXPFILE_REPLACED  2
+int check_expense_file(exptbl_t *et, arena_t scratch);
 
-void init_exptbl(exptbl_t *et, short cap, arena_t *a);
-exp_t *get_exp(exptbl_t *et, short idx);
-short add_exp(exptbl_t *et, exp_t exp);
-void replace_exp(exptbl_t *et, short idx, exp_t exp);
-void del_exp(exptbl_t *et, short idx);
+// Expense file locks, see lock_expense_file().
+#define EXPLOCK_READ   1
+#define EXPLOCK_WRITE  2
+int lock_expense_file(int lock);
+void unlock_expense_file(int lock);
+int load_expense_tail(exptbl_t *et, arena_t scratch);
+
+void init_exptbl(exptbl_t *et, int cap, arena_t *a);
+exp_t *get_exp(exptbl_t *et, int idx);
+int add_exp(exptbl_t *et, exp_t exp);
+void replace_exp(exptbl_t *et, int idx, exp_t exp);
+void del_exp(exptbl_t *et, int idx);
+void mark_exp_dirty(exptbl_t *et, exp_t exp);
+int archive_expense_year(exptbl_t *et, short year);
+int is_year_in_range(exptbl_t *et, time_t dt);
+int new_exp_id(exptbl_t *et);
+int find_exp_id(exptbl_t *et, int id);
+long long exp_cents(exp_t exp);
 
 typedef int (*exptbl_cmpfunc_t)(exptbl_t *et, void *a, void *b);
 void sort_exptbl(exptbl_t *et, exptbl_cmpfunc_t cmp);
 void sort_exptbl_part(exptbl_t *et, int start, int end, exptbl_cmpfunc_t cmp);
+void merge_exptbl_tail(exptbl_t *et, int istart, exptbl_cmpfunc_t cmp);
 int cmp_exp_date(exptbl_t *et, void *a, void *b);
 int cmp_exp_date_cat(exptbl_t *et, void *a, void *b);
 int cmp_exp_cat(exptbl_t *et, void *a, void *b);
 
+#define DUPE_EXACT 1
+#define DUPE_NEAR  2
+typedef void (*dupe_func_t)(void *ctx, int idx, int match, int kind);
+int find_exp_dupes(exptbl_t *et, int istart, int iend, long window, int new_id, dupe_func_t func, void *ctx);
+
+// Count, mean, min and max of expense amounts, and the sum of squared
+// differences from the mean (m2) for the variance.
+typedef struct {
+    long count;
+    double mean;
+    double m2;
+    double min;
+    double max;
+} catstat_t;
+
+void catstat_add(catstat_t *cs, double amt);
+void catstat_merge(catstat_t *cs, catstat_t *other);
+double catstat_variance(catstat_t *cs);
+void get_cat_stats(exptbl_t *et, int istart, int iend, catstat_t *stats);
+
+typedef void (*parallel_func_t)(void *ctx, int i);
+int parallel_threads();
+void run_parallel(int ntasks, parallel_func_t func, void *ctx);
+
 #endif
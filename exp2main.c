@@ -1,7 +1,12 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 #include <time.h>
 #include <assert.h>
 #include <errno.h>
@@ -9,8 +14,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <regex.h>
+#include <setjmp.h>
 #include "clib.h"
 #include "exp.h"
+#include "expext.h"
+#ifndef WINDOWS
+#include <unistd.h>
+#include <pthread.h>
+#include "expsrv.h"
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 typedef struct {
     short year;
@@ -19,41 +34,80 @@ typedef struct {
 } shortdate_t;
 
 int match_date(char *sz, shortdate_t *sd);
-void list_expenses(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-void list_categories(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-void prompt_add(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-void prompt_edit(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-void prompt_del(char *argv[], int argc, arena_t exp_arena, arena_t scratch);
-short prompt_cat(strtbl_t *cats, short default_catid);
+void list_expenses(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void list_categories(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void list_ytd(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void prompt_add(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void prompt_edit(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void prompt_del(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void import_file(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void list_dupes(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void list_stats(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+void archive_year(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+static int is_expense_command(const char *scmd);
+static int is_server_command(char *argv[], int argc);
+static int is_update_command(const char *scmd);
+static int is_stream_command(const char *scmd);
+static int can_update(exptbl_t *et);
+static void get_command_range(char *argv[], int argc, time_t *startdt, time_t *enddt, arena_t scratch);
+static int read_dupes_opts(char *argv[], int argc, char *args[], long *window, int *check);
+static int read_stats_opts(char *argv[], int argc, char *args[], double *sigma);
+void read_filter_args(char *argv[], int argc, str_t *scat, time_t *startdt, time_t *enddt, arena_t *scratch);
+int run_command(char *argv[], int argc, exptbl_t *et, arena_t scratch);
+int commit_expenses(exptbl_t *et, arena_t scratch);
+int run_shell(FILE *f, int interactive, exptbl_t *et, arena_t scratch);
+void print_help(const char *scmd);
+void serve_expenses(arena_t scratch);
+int prompt_cat(strtbl_t *cats, int default_catid);
 time_t prompt_date(time_t default_dt);
+static void chomp(char *buf);
+#ifdef __linux__
+static void count_output_bytes();
+#endif
 
 const char HELP_ROOT[] = 
 R"(exp - Utility for keeping track and reporting of daily expenses.
 
 Usage:
 
-    exp <command> [arguments]
+    exp [--stats] <command> [arguments]
+
+    --stats : print time spent in each phase, records parsed, table and
+              memory sizes, and output bytes to stderr when done.
+              Same as setting EXP2STATS=1.
 
 Commands:
 
     add     add an expense
     edit    edit an expense
     del     delete an expense
+    import  add expenses from a file
+    archive compress a past year's expenses
     list    display list of expenses
     cat     display category subtotals
     ytd     display year to date subtotals
+    dupes   display duplicate expenses
+    stats   display category statistics and outliers
     info    display expense file location and other info
+    serve   keep expenses loaded and answer commands from other exp processes
+    shell   run commands interactively, saving once at the end
+    batch   run commands from a file, saving once at the end
 
 Use "exp help [command]" to display information about a command.
 
 Examples:
     exp add DESC AMT CAT [DATE]
-    exp edit RECNO
-    exp del RECNO
+    exp edit ID
+    exp del ID
+    exp import [--dupes] [FILE]
+    exp archive YEAR
     exp list [CAT] [STARTDATE] [ENDDATE]
     exp cat [STARTDATE] [ENDDATE]
     exp ytd [YEAR]
+    exp dupes [--window DAYS] [CAT] [STARTDATE] [ENDDATE]
+    exp stats [--sigma K] [CAT] [STARTDATE] [ENDDATE]
+    exp shell
+    exp batch FILE
 
     exp help
     exp help add
@@ -136,6 +190,39 @@ R"(exp info - Display configuration information (expense file location, etc.)
     Set the WINEXPFILE environment var to change the active expense file.
     Expense file will be created automatically when you add or display expenses
 
+    Set EXP2FILE to a list of expense files separated by ':' (';' on Windows)
+    to display expenses from all of them together, for example:
+
+    EXP2FILE=~/expenses-me:~/expenses-partner exp cat 2025
+
+    Expense files are loaded in parallel and combined in date order.
+    Expenses can't be added, edited or deleted while more than one
+    expense file is set. Ids of the second file's expenses are shown
+    offset by 10000000, those of the third file by 20000000, and so on.
+
+    If the expense file is a directory, expenses are kept in one file per
+    year named by the year (ex. ~/expenses.d/2025). Reports only read the
+    years they cover, and changes only rewrite the years that changed:
+
+    mkdir ~/expenses.d
+    EXP2FILE=~/expenses.d exp import ~/expenses.csv
+
+    Loaded expenses are cached in expense file name + ".cache", so that
+    the next run only reads the lines added to the end of the file since.
+
+    Set EXP2ASYNC=1 to have add, edit and del return without waiting for
+    the expense file to be rewritten. Changes are synced to a journal
+    (expense file name + ".journal") that is applied whenever expenses are
+    loaded, and a background process saves them to the expense file.
+
+    Large expense tables are sorted on one thread per CPU. Set EXP2THREADS
+    to change the number of threads.
+
+    Set EXP2MEMLIMIT to a size in MB to stream expense files that would
+    take more memory than that to load. list, cat, ytd and import then
+    sort and sum in a fixed memory budget, spilling to temp files in
+    $TMPDIR as needed.
+
 )";
 const char HELP_ADD[] =
 R"(exp add - Add expense.
@@ -162,12 +249,13 @@ R"(exp edit - Edit expense.
 
 Usage:
 
-    exp edit RECNO
+    exp edit ID
 
-    RECNO : record number of expense to edit
+    ID : id of expense to edit
 
-    The record number is the #nnn number in rightmost column of the expense
-    displayed from the [exp list] command.
+    The id is the #nnn number in rightmost column of the expense
+    displayed from the [exp list] command. An expense keeps its id when
+    other expenses are added, edited or deleted.
 
 Example:
     exp edit 1895
@@ -178,25 +266,218 @@ R"(exp del - Delete expense.
 
 Usage:
 
-    exp del RECNO
+    exp del ID
 
-    RECNO : record number of expense to delete
+    ID : id of expense to delete
 
-    The record number is the #nnn number in rightmost column of the expense
-    displayed from the [exp list] command.
+    The id is the #nnn number in rightmost column of the expense
+    displayed from the [exp list] command. An expense keeps its id when
+    other expenses are added, edited or deleted.
 
 Example:
     exp del 1895
 
+)";
+const char HELP_IMPORT[] =
+R"(exp import - Add expenses from a file.
+
+Usage:
+
+    exp import [--dupes] [--window DAYS] [FILE]
+
+    FILE    : file containing expenses to add, or '-' for stdin
+    --dupes : skip expenses that duplicate existing ones
+    DAYS    : days apart duplicates can be (default 2)
+
+    If FILE is not specified, expenses are read from stdin.
+
+    Each line is an expense in expense file format or CSV format:
+
+    2019-04-01; 17:30; buy groceries; 250.00; groceries
+    2019-04-01,17:30,"buy groceries",250.00,groceries
+
+    A CSV header line is skipped. All expenses are added and the expense
+    file is saved once.
+
+    With --dupes, expenses that duplicate an existing expense up to DAYS
+    before or after them are listed and not added (see "exp help dupes").
+    Duplicates aren't checked when the expense file is over EXP2MEMLIMIT.
+
+Example:
+    exp import statement.csv
+    exp import --dupes statement.csv
+    cat statement.csv | exp import
+
+)";
+const char HELP_DUPES[] =
+R"(exp dupes - Display duplicate expenses.
+
+Usage:
+
+    exp dupes [--window DAYS] [CAT] [YEAR | YEAR-MONTH | DATE | STARTDATE ENDDATE]
+
+    DAYS        : days apart duplicates can be (default 2)
+    CAT         : category
+    YEAR        : year in YYYY format
+    YEAR-MONTH  : year and month in YYYY-MM format
+    DATE        : date in iso date format YYYY-MM-DD
+    STARTDATE   : start date in iso date format YYYY-MM-DD
+    ENDDATE     : end date in iso date format YYYY-MM-DD
+
+    Lists expenses that duplicate an earlier expense, with the id of the
+    closest earlier one. All expenses are checked if no dates are given.
+    Specify CAT to only list duplicates in that category.
+
+    Expenses with the same amount and the same description, ignoring case,
+    spaces and punctuation, are near duplicates if they're no more than
+    DAYS apart. They're exact duplicates ("same as") if their date, time,
+    description and category are the same too.
+
+Example:
+    exp dupes
+    exp dupes 2025
+    exp dupes groceries 2025
+    exp dupes --window 0 2025-06
+
+)";
+const char HELP_STATS[] =
+R"(exp stats - Display category statistics and outliers.
+
+Usage:
+
+    exp stats [--sigma K] [CAT] [YEAR | YEAR-MONTH | DATE | STARTDATE ENDDATE]
+
+    K           : standard deviations from the mean an outlier is (default 3)
+    CAT         : category
+    YEAR        : year in YYYY format
+    YEAR-MONTH  : year and month in YYYY-MM format
+    DATE        : date in iso date format YYYY-MM-DD
+    STARTDATE   : start date in iso date format YYYY-MM-DD
+    ENDDATE     : end date in iso date format YYYY-MM-DD
+
+    Displays the number of expenses and the mean, standard deviation,
+    minimum and maximum amount of each category, followed by the outliers:
+    expenses more than K standard deviations from their category's mean.
+
+    Specify CAT to only show that category. Dates work the same as in
+    "exp list". If called without any dates, the current month is used.
+
+Example:
+    exp stats 2019
+    exp stats groceries 2015-01-01 2019-12-31
+    exp stats --sigma 2 2019-04
+
+)";
+const char HELP_ARCHIVE[] =
+R"(exp archive - Compress a past year's expenses.
+
+Usage:
+
+    exp archive YEAR
+
+    YEAR : year to archive
+
+    Stores the expenses of YEAR as a compressed archive (ex. 2023.xa)
+    in place of the year's expense file. Archives are smaller and load
+    faster than expense files. Archived expenses can still be listed and
+    changed, the archive is rewritten when they change.
+
+    Only works when the expense file is a year partitioned directory,
+    see "exp help info".
+
+Example:
+    exp archive 2023
+
+)";
+const char HELP_SERVE[] =
+R"(exp serve - Keep expenses loaded and answer commands from other exp processes.
+
+Usage:
+
+    exp serve
+
+    Loads the expense file once and listens on a unix socket next to the
+    expense file (expense file name + ".sock"). With more than one expense
+    file, the socket is named after the first one plus a hash of the list,
+    and only commands run with the same list of files are forwarded.
+
+    While the server is running, the list, cat and ytd commands of other
+    exp processes, and add commands given all of DESC, AMT, CAT and DATE,
+    are forwarded to it and run against the loaded expenses instead of
+    reloading the expense file. Commands that prompt for input run in
+    their own process, so they don't hold up the server.
+    Requests are handled one at a time. A client that stops sending or
+    reading for 5 seconds is disconnected.
+
+    The socket can only be used by the user running the server.
+
+    Changes made to the expense file by other programs are picked up
+    automatically. Added lines are read as they are appended; other changes
+    reload the whole file in the background while requests continue to be
+    answered from the previously loaded expenses.
+
+    Stop the server with Ctrl-C or SIGTERM.
+
+)";
+const char HELP_SHELL[] =
+R"(exp shell, exp batch - Run many commands against the expenses loaded once.
+
+Usage:
+
+    exp shell
+    exp batch FILE
+
+    FILE : file containing commands, one per line, or '-' for stdin
+
+    The expense file is loaded once and commands are run against the
+    loaded expenses. Changes are saved when 'commit' is entered and
+    when the shell or batch file ends.
+
+    From the first change until it is saved, other exp processes wait
+    before changing the expense file. Reading it is never blocked.
+
+    Commands are entered the same way as on the command line, without the
+    leading 'exp'. Use double or single quotes for arguments containing
+    spaces. Lines starting with '#' are ignored.
+
+    exp batch exits with status 1 if a command in FILE is unknown, is
+    cut short by the end of input or its changes couldn't be saved.
+
+    list, cat, ytd, dupes, stats, add,      : expense commands
+    edit, del, import
+    commit                                  : save changes now
+    help [command]                          : display help
+    quit                                    : save changes and exit
+
+Example:
+    exp> add "buy groceries" 250.00 groceries 2019-04-01
+    exp> add "bus fare" 2.50 commute 2019-04-01
+    exp> cat 2019-04
+    exp> commit
+
 )";
 
 regex_t g_regdate, g_regtime;
 
+// Set while running a command in server or shell mode, so that end of
+// input aborts the command instead of exiting.
+jmp_buf *g_input_abort = NULL;
+
+// Set in shell mode: changes are saved by commit instead of by each command.
+int g_defer_save = 0;
+int g_unsaved_changes = 0;
+// Set when saving a command's changes fails.
+int g_commit_failed = 0;
+
+// Set by EXP2ASYNC=1: changes are journaled and the expense file is
+// rewritten in the background.
+int g_async_save = 0;
+
 int main(int argc, char *argv[]) {
     int z;
+    int status = 0;
     arena_t exp_arena;
     arena_t scratch_arena;
-    init_arena(&exp_arena, SIZE_LARGE);
     init_arena(&scratch_arena, SIZE_MEDIUM);
 
     z = regcomp(&g_regdate, "^[0-9]{4}-[0-9]{2}-[0-9]{2}$", REG_EXTENDED);
@@ -204,59 +485,741 @@ int main(int argc, char *argv[]) {
     z = regcomp(&g_regtime, "^[0-2][0-9]:[0-5][0-9]$", REG_EXTENDED);
     assert(z == 0);
 
-    // argv[]: exp2 CMD [args...]
+    // argv[]: exp2 [--stats] CMD [args...]
     // Skip over program name.
     argv++;
     argc--;
 
+    int stats = 0;
+    if (argc >= 1 && szequals(argv[0], "--stats")) {
+        stats = 1;
+        argv++;
+        argc--;
+    }
+    init_stats(stats);
+    stats_mark_t tstart = stats_start();
+    char *async = getenv("EXP2ASYNC");
+    g_async_save = async != NULL && async[0] != '\0' && !szequals(async, "0");
+#ifdef __linux__
+    if (g_stats.enabled)
+        count_output_bytes();
+#endif
+    exptbl_t et;
+    exptbl_t *loaded = NULL;
+
+    // Reserve room for the expense files and for a file being imported,
+    // unless it's over the memory limit and they're streamed instead.
+    struct stat st;
+    unsigned long importsize = 0;
+    if (argc >= 2 && szequals(argv[0], "import") && stat(argv[argc-1], &st) == 0)
+        importsize = st.st_size;
+    unsigned long arena_size = get_expense_arena_size(scratch_arena, importsize);
+    int stream = argc >= 1 && is_stream_command(argv[0]) && use_external_memory(scratch_arena, arena_size);
+    init_arena(&exp_arena, stream ? SIZE_MEDIUM : arena_size);
+
     char *scmd = *argv;
     if (scmd == NULL)
         printf(HELP_ROOT);
     else if (szequals(scmd, "help")) {
-        argv++;
-        if (*argv == NULL)
-            printf(HELP_ROOT);
-        else if (szequals(*argv, "list"))
-            printf(HELP_LIST);
-        else if (szequals(*argv, "cat"))
-            printf(HELP_CAT);
-        else if (szequals(*argv, "ytd"))
-            printf(HELP_YTD);
-        else if (szequals(*argv, "info"))
-            printf(HELP_INFO);
-        else if (szequals(*argv, "add"))
-            printf(HELP_ADD);
-        else if (szequals(*argv, "edit"))
-            printf(HELP_EDIT);
-        else if (szequals(*argv, "del"))
-            printf(HELP_DEL);
-        else
-            printf(HELP_ROOT);
+        print_help(argv[1]);
     } else if (szequals(scmd, "info")) {
-        str_t expfile = get_expense_filename(&scratch_arena);
+        str_t files[MAX_EXPENSE_FILES];
+        int nfiles = get_expense_filenames(&scratch_arena, files, countof(files));
         printf("exp config info\n\n");
-        printf("    expense file  : %s\n\n", expfile.bytes);
+        for (int i=0; i < nfiles; i++)
+            printf("    expense file  : %s\n", files[i].bytes);
+        printf("\n");
         printf("Set the WINEXPFILE environment var to change the active expense file.\n");
         printf("Expense file will be created automatically when you add or display expenses.\n\n");
-    } else if (szequals(scmd, "list"))
-        list_expenses(argv+1, argc-1, exp_arena, scratch_arena);
+    } else if (szequals(scmd, "serve")) {
+        serve_expenses(scratch_arena);
+    } else if (is_expense_command(scmd)) {
+#ifndef WINDOWS
+        // Let running server handle the command if there is one.
+        // Run it here instead when stats are wanted.
+        if (is_server_command(argv, argc) && !g_stats.enabled) {
+            str_t sockfile = get_socket_filename(&scratch_arena);
+            z = srv_forward(sockfile.bytes, argv, argc);
+            if (z != -1) {
+                status = z;
+                goto done;
+            }
+        }
+#endif
+        // Keep other processes from changing expenses until our change is saved.
+        if (is_update_command(scmd) && lock_expense_file(EXPLOCK_WRITE) != 0) {
+            status = 1;
+            goto done;
+        }
+        time_t startdt=0, enddt=0;
+        if (!is_update_command(scmd))
+            get_command_range(argv, argc, &startdt, &enddt, scratch_arena);
+        // Streamed commands read the expense file themselves.
+        z = 0;
+        if (!stream)
+            z = load_expense_range(&exp_arena, scratch_arena, &et, startdt, enddt);
+        if (z == 0 && !stream)
+            loaded = &et;
+        if (loaded != NULL && is_update_command(scmd) && g_async_save)
+            track_exp_changes(&et);
+        if (z == 0 && (!is_update_command(scmd) || loaded == NULL || can_update(&et))) {
+            stats_mark_t t = stats_start();
+            run_command(argv, argc, loaded, scratch_arena);
+            stats_end("command", t);
+        } else
+            status = 1;
+        if (g_commit_failed)
+            status = 1;
+        unlock_expense_file(EXPLOCK_WRITE);
+    } else if (szequals(scmd, "shell") || szequals(scmd, "batch")) {
+        FILE *f = stdin;
+        int interactive = szequals(scmd, "shell");
+        if (!interactive) {
+            if (argc < 2) {
+                printf(HELP_SHELL);
+                status = 1;
+                goto done;
+            }
+            if (!szequals(argv[1], "-"))
+                f = fopen(argv[1], "r");
+            if (f == NULL) {
+                fprintf(stderr, "Error opening '%s': ", argv[1]);
+                print_error(NULL);
+                status = 1;
+                goto done;
+            }
+        }
+        z = load_expense_file(&exp_arena, scratch_arena, &et);
+        if (z == 0) {
+            loaded = &et;
+            stats_mark_t t = stats_start();
+            z = run_shell(f, interactive, &et, scratch_arena);
+            stats_end("commands", t);
+            // Only a batch reports failed commands, shell users see them.
+            if (z != 0 && !interactive)
+                status = 1;
+        } else
+            status = 1;
+        if (f != stdin)
+            fclose(f);
+    } else
+        printf(HELP_ROOT);
+
+done:
+    if (g_stats.enabled) {
+        fflush(stdout);
+        stats_end("total", tstart);
+        print_stats(loaded, &exp_arena, &scratch_arena);
+    }
+    regfree(&g_regdate);
+    regfree(&g_regtime);
+    free_arena(&exp_arena);
+    free_arena(&scratch_arena);
+    return status;
+}
+
+#ifdef __linux__
+static ssize_t write_counted(void *cookie, const char *buf, size_t len) {
+    size_t nwritten = 0;
+    while (nwritten < len) {
+        ssize_t n = write(STDOUT_FILENO, buf + nwritten, len - nwritten);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+            return nwritten > 0 ? (ssize_t)nwritten : -1;
+        nwritten += n;
+    }
+    g_stats.output_bytes += nwritten;
+    return nwritten;
+}
+// Replace stdout with a stream that counts the bytes written through it.
+static void count_output_bytes() {
+    cookie_io_functions_t io = {NULL, write_counted, NULL, NULL};
+    FILE *f = fopencookie(NULL, "w", io);
+    if (f == NULL)
+        return;
+    fflush(stdout);
+    stdout = f;
+    g_stats.output_bytes = 0;
+}
+#endif
+
+void print_help(const char *scmd) {
+    if (scmd == NULL)
+        printf(HELP_ROOT);
+    else if (szequals(scmd, "list"))
+        printf(HELP_LIST);
     else if (szequals(scmd, "cat"))
-        list_categories(argv+1, argc-1, exp_arena, scratch_arena);
+        printf(HELP_CAT);
     else if (szequals(scmd, "ytd"))
-        list_ytd(argv+1, argc-1, exp_arena, scratch_arena);
+        printf(HELP_YTD);
+    else if (szequals(scmd, "dupes"))
+        printf(HELP_DUPES);
+    else if (szequals(scmd, "stats"))
+        printf(HELP_STATS);
+    else if (szequals(scmd, "info"))
+        printf(HELP_INFO);
     else if (szequals(scmd, "add"))
-        prompt_add(argv+1, argc-1, exp_arena, scratch_arena);
+        printf(HELP_ADD);
     else if (szequals(scmd, "edit"))
-        prompt_edit(argv+1, argc-1, exp_arena, scratch_arena);
+        printf(HELP_EDIT);
     else if (szequals(scmd, "del"))
-        prompt_del(argv+1, argc-1, exp_arena, scratch_arena);
+        printf(HELP_DEL);
+    else if (szequals(scmd, "import"))
+        printf(HELP_IMPORT);
+    else if (szequals(scmd, "archive"))
+        printf(HELP_ARCHIVE);
+    else if (szequals(scmd, "serve"))
+        printf(HELP_SERVE);
+    else if (szequals(scmd, "shell") || szequals(scmd, "batch"))
+        printf(HELP_SHELL);
     else
         printf(HELP_ROOT);
+}
 
-    regfree(&g_regdate);
-    regfree(&g_regtime);
-    free_arena(&exp_arena);
-    free_arena(&scratch_arena);
+static int is_expense_command(const char *scmd) {
+    return szequals(scmd, "list") || szequals(scmd, "cat") || szequals(scmd, "ytd") ||
+           szequals(scmd, "add") || szequals(scmd, "edit") || szequals(scmd, "del") ||
+           szequals(scmd, "import") || szequals(scmd, "archive") || szequals(scmd, "dupes") ||
+           szequals(scmd, "stats");
+}
+// Commands that change expenses.
+static int is_update_command(const char *scmd) {
+    return szequals(scmd, "add") || szequals(scmd, "edit") || szequals(scmd, "del") ||
+           szequals(scmd, "import") || szequals(scmd, "archive");
+}
+// Commands that can stream expense files too large to load.
+static int is_stream_command(const char *scmd) {
+    return szequals(scmd, "list") || szequals(scmd, "cat") || szequals(scmd, "ytd") ||
+           szequals(scmd, "import");
+}
+// Changes can only be saved when a single expense file is loaded.
+static int can_update(exptbl_t *et) {
+    if (et->nfiles > 1) {
+        fprintf(stderr, "Expenses from %d expense files are loaded, changes can't be saved.\n", et->nfiles);
+        fprintf(stderr, "Set EXP2FILE to a single expense file to make changes.\n");
+        return 0;
+    }
+    return 1;
+}
+// Commands that are forwarded to a running server. Requests are handled
+// one at a time, so commands that prompt for input aren't forwarded.
+static int is_server_command(char *argv[], int argc) {
+    char *scmd = argv[0];
+    if (szequals(scmd, "list") || szequals(scmd, "cat") || szequals(scmd, "ytd"))
+        return 1;
+    // add DESC AMT CAT DATE [TIME]
+    if (szequals(scmd, "add"))
+        return argc >= 5 && !szequals(argv[2], "-1");
+    return 0;
+}
+
+// Date range [startdt, enddt) of expenses read by command argv[0], so that
+// year partitions outside of it don't need to be loaded.
+// Zero startdt or enddt means the range is open on that end.
+static void get_command_range(char *argv[], int argc, time_t *startdt, time_t *enddt, arena_t scratch) {
+    char *scmd = argv[0];
+    *startdt = 0;
+    *enddt = 0;
+
+    if (szequals(scmd, "list") || szequals(scmd, "cat")) {
+        // Filter args are parsed again by the command, so parse a copy.
+        char *args[argc];
+        for (int i=1; i < argc; i++)
+            args[i-1] = new_str(&scratch, argv[i]).bytes;
+        str_t scat;
+        read_filter_args(args, argc-1, &scat, startdt, enddt, &scratch);
+    } else if (szequals(scmd, "ytd")) {
+        short year = 0;
+        if (argc > 1)
+            year = atoi(argv[1]);
+        if (year == 0)
+            date_to_cal(date_today(), &year, NULL, NULL);
+        *startdt = date_from_cal(year, 1, 1);
+        *enddt = date_from_cal(year+1, 1, 1);
+    } else if (szequals(scmd, "dupes")) {
+        // All expenses unless dates are given, and the window before them.
+        char *args[argc];
+        long window;
+        int check;
+        int nargs = read_dupes_opts(argv+1, argc-1, args, &window, &check);
+        if (nargs == 0)
+            return;
+        for (int i=0; i < nargs; i++)
+            args[i] = new_str(&scratch, args[i]).bytes;
+        str_t scat;
+        read_filter_args(args, nargs, &scat, startdt, enddt, &scratch);
+        // A category alone doesn't narrow the dates.
+        if (nargs == (scat.len > 0 ? 1 : 0)) {
+            *startdt = 0;
+            *enddt = 0;
+            return;
+        }
+        *startdt -= window;
+    } else if (szequals(scmd, "stats")) {
+        char *args[argc];
+        double sigma;
+        int nargs = read_stats_opts(argv+1, argc-1, args, &sigma);
+        for (int i=0; i < nargs; i++)
+            args[i] = new_str(&scratch, args[i]).bytes;
+        str_t scat;
+        read_filter_args(args, nargs, &scat, startdt, enddt, &scratch);
+    }
+}
+
+// Run expense command argv[0] against loaded expenses.
+// Returns 0 if command was run, -1 if unknown command.
+int run_command(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    char *scmd = argv[0];
+    if (szequals(scmd, "list"))
+        list_expenses(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "cat"))
+        list_categories(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "ytd"))
+        list_ytd(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "add"))
+        prompt_add(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "edit"))
+        prompt_edit(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "del"))
+        prompt_del(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "import"))
+        import_file(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "archive"))
+        archive_year(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "dupes"))
+        list_dupes(argv+1, argc-1, et, scratch);
+    else if (szequals(scmd, "stats"))
+        list_stats(argv+1, argc-1, et, scratch);
+    else
+        return -1;
+    return 0;
+}
+
+// Save changes made by a command, or just note them if saving is deferred
+// until commit in shell mode.
+int commit_expenses(exptbl_t *et, arena_t scratch) {
+    if (g_defer_save) {
+        // Keep expenses in date order for the commands that follow.
+        sort_exptbl(et, cmp_exp_date);
+        g_unsaved_changes = 1;
+        return 0;
+    }
+    int z;
+    if (g_async_save)
+        z = save_expense_file_async(et, scratch);
+    else
+        z = save_expense_file(et, scratch);
+    if (z != 0)
+        g_commit_failed = 1;
+    return z;
+}
+
+// Split line into whitespace separated args in place. Double or single
+// quotes group words into one arg. Returns number of args.
+static int split_args(char *line, char *args[], int maxargs) {
+    int nargs = 0;
+    char *p = line;
+
+    while (nargs < maxargs) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0')
+            break;
+
+        char *dst = p;
+        args[nargs++] = p;
+        char quote = 0;
+        while (*p != '\0') {
+            if (quote) {
+                if (*p == quote) {
+                    quote = 0;
+                    p++;
+                    continue;
+                }
+            } else if (*p == '"' || *p == '\'') {
+                quote = *p++;
+                continue;
+            } else if (*p == ' ' || *p == '\t') {
+                p++;
+                break;
+            }
+            *dst++ = *p++;
+        }
+        *dst = '\0';
+    }
+    args[nargs] = NULL;
+    return nargs;
+}
+
+static int shell_commit(exptbl_t *et, arena_t scratch) {
+    if (g_unsaved_changes) {
+        if (save_expense_file(et, scratch) != 0) {
+            printf("Changes not saved.\n");
+            return 1;
+        }
+        g_unsaved_changes = 0;
+        printf("Changes saved.\n");
+    }
+    unlock_expense_file(EXPLOCK_WRITE);
+    return 0;
+}
+// Lock out other writers before the first change since the last commit.
+// If the expense file was changed by someone else since it was loaded,
+// reload it first so that the change isn't lost on commit.
+static int shell_begin_update(exptbl_t *et, arena_t scratch) {
+    if (!can_update(et))
+        return -1;
+    if (g_unsaved_changes)
+        return 0;
+    if (lock_expense_file(EXPLOCK_WRITE) != 0)
+        return -1;
+    if (check_expense_file(et, scratch) != EXPFILE_UNCHANGED) {
+        printf("Expense file changed, reloading.\n");
+        if (load_expense_file(et->arena, scratch, et) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Read commands from f and run them against et, saving changes on commit
+// and at the end.
+// Returns 1 if a command was unknown, aborted or failed to save, else 0.
+int run_shell(FILE *f, int interactive, exptbl_t *et, arena_t scratch) {
+    char line[2048];
+    char *args[64];
+    jmp_buf abort_jmp;
+    int status = 0;
+
+    g_defer_save = 1;
+    g_unsaved_changes = 0;
+    while (1) {
+        if (interactive) {
+            printf("exp> ");
+            fflush(stdout);
+        }
+        if (fgets(line, sizeof(line), f) == NULL)
+            break;
+        chomp(line);
+
+        int nargs = split_args(line, args, countof(args)-1);
+        if (nargs == 0 || args[0][0] == '#')
+            continue;
+
+        if (szequals(args[0], "quit") || szequals(args[0], "exit"))
+            break;
+        else if (szequals(args[0], "commit")) {
+            if (shell_commit(et, scratch) != 0)
+                status = 1;
+        } else if (szequals(args[0], "help"))
+            print_help(args[1]);
+        else if (is_expense_command(args[0])) {
+            if (is_update_command(args[0]) && shell_begin_update(et, scratch) != 0) {
+                status = 1;
+                continue;
+            }
+            g_input_abort = &abort_jmp;
+            if (setjmp(abort_jmp) == 0)
+                run_command(args, nargs, et, scratch);
+            else
+                status = 1;
+            g_input_abort = NULL;
+        } else {
+            printf("Unknown command '%s'. Enter 'help' for list of commands.\n", args[0]);
+            status = 1;
+        }
+    }
+
+    if (shell_commit(et, scratch) != 0)
+        status = 1;
+    g_defer_save = 0;
+    return status;
+}
+
+#ifndef WINDOWS
+// Loaded expenses that server requests are answered from.
+// Reloads build a new snapshot in the background and swap it in.
+typedef struct {
+    arena_t arena;
+    exptbl_t et;
+} snapshot_t;
+
+typedef struct {
+    snapshot_t *snap;
+    arena_t scratch;
+
+    // Background full reload
+    pthread_t reload_thread;
+    int reloading;
+    int reload_again;
+    int reload_pipe[2];
+    snapshot_t *reloaded;
+
+    // Server's own stderr, for messages that aren't part of a request
+    // while stderr may be redirected to a client.
+    FILE *log;
+} server_t;
+
+static snapshot_t *load_snapshot() {
+    arena_t scratch;
+    snapshot_t *snap = malloc(sizeof(snapshot_t));
+    if (snap == NULL)
+        return NULL;
+    init_arena(&scratch, SIZE_MEDIUM);
+    init_arena(&snap->arena, get_expense_arena_size(scratch, 0));
+    int z = load_expense_file(&snap->arena, scratch, &snap->et);
+    free_arena(&scratch);
+    if (z != 0) {
+        free_arena(&snap->arena);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+static void free_snapshot(snapshot_t *snap) {
+    free_arena(&snap->arena);
+    free(snap);
+}
+
+static void *reload_thread_main(void *arg) {
+    server_t *srv = arg;
+    set_errout(srv->log);
+    srv->reloaded = load_snapshot();
+    char ch = 1;
+    if (write(srv->reload_pipe[1], &ch, 1) != 1)
+        print_error("Error signaling reload");
+    return NULL;
+}
+// Start full reload of the expense file in the background.
+// Requests are answered from the current snapshot until it's done.
+static void start_reload(server_t *srv) {
+    if (srv->reloading) {
+        srv->reload_again = 1;
+        return;
+    }
+    srv->reloading = 1;
+    srv->reload_again = 0;
+    srv->reloaded = NULL;
+    if (pthread_create(&srv->reload_thread, NULL, reload_thread_main, srv) != 0) {
+        fprintf(srv->log, "Error starting reload\n");
+        srv->reloading = 0;
+    }
+}
+// Wait for background reload to finish and swap in the new snapshot.
+static void finish_reload(server_t *srv) {
+    char ch;
+    if (!srv->reloading)
+        return;
+    pthread_join(srv->reload_thread, NULL);
+    if (read(srv->reload_pipe[0], &ch, 1) != 1)
+        fprintf(srv->log, "Error reading reload signal: %s\n", strerror(errno));
+    srv->reloading = 0;
+
+    if (srv->reloaded == NULL)
+        fprintf(srv->log, "Error reloading expenses, answering from previously loaded ones.\n");
+    if (srv->reloaded != NULL) {
+        snapshot_t *old = srv->snap;
+        srv->snap = srv->reloaded;
+        srv->reloaded = NULL;
+        free_snapshot(old);
+    }
+}
+static void on_reload_done(int fd, void *ctx) {
+    server_t *srv = ctx;
+    finish_reload(srv);
+    if (srv->reload_again)
+        start_reload(srv);
+}
+
+// Bring snapshot up to date with the expense file. Appended expenses are
+// parsed in place, any other change starts a background reload.
+// If wait is set, don't return until the snapshot is current.
+static void refresh_snapshot(server_t *srv, int wait) {
+    if (wait)
+        finish_reload(srv);
+
+    reset_arena(&srv->scratch);
+    exptbl_t *et = &srv->snap->et;
+    int z = check_expense_file(et, srv->scratch);
+    if (z == EXPFILE_APPENDED) {
+        if (load_expense_tail(et, srv->scratch) != 0)
+            z = EXPFILE_REPLACED;
+    }
+    if (z == EXPFILE_REPLACED)
+        start_reload(srv);
+
+    if (wait)
+        finish_reload(srv);
+}
+
+#ifdef __linux__
+// Watched directory of each expense file, and the name of the file in it,
+// or "" for a year partitioned expense directory.
+typedef struct {
+    int wd;
+    char name[2048];
+} expwatch_t;
+
+static expwatch_t g_expwatches[MAX_EXPENSE_FILES];
+static int g_nexpwatches = 0;
+
+static int is_expfile_event(struct inotify_event *ev) {
+    for (int i=0; i < g_nexpwatches; i++) {
+        expwatch_t *w = &g_expwatches[i];
+        if (w->wd == ev->wd && (w->name[0] == 0 || szequals(ev->name, w->name)))
+            return 1;
+    }
+    return 0;
+}
+static void on_expfile_event(int fd, void *ctx) {
+    server_t *srv = ctx;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    for (char *p = buf; n > 0 && p < buf + n; ) {
+        struct inotify_event *ev = (struct inotify_event *) p;
+        if (ev->mask & IN_Q_OVERFLOW)
+            changed = 1;
+        else if (ev->len > 0 && is_expfile_event(ev))
+            changed = 1;
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (changed)
+        refresh_snapshot(srv, 0);
+}
+// Watch directory of each expense file so that changes by other programs,
+// including replacing a file with a new one, are picked up.
+static void watch_expense_file(server_t *srv) {
+    char dir[2048];
+    str_t files[MAX_EXPENSE_FILES];
+    int nfiles = get_expense_filenames(&srv->scratch, files, countof(files));
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        print_error("inotify_init1() error");
+        return;
+    }
+    g_nexpwatches = 0;
+    for (int k=0; k < nfiles; k++) {
+        expwatch_t *w = &g_expwatches[g_nexpwatches];
+        snprintf(dir, sizeof(dir), "%s", files[k].bytes);
+        char *p = strrchr(dir, '/');
+        struct stat st;
+        if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+            // Year partitioned expense directory, any file in it may change.
+            w->name[0] = 0;
+        } else if (p == NULL) {
+            snprintf(w->name, sizeof(w->name), "%s", dir);
+            snprintf(dir, sizeof(dir), ".");
+        } else {
+            snprintf(w->name, sizeof(w->name), "%s", p+1);
+            if (p == dir)
+                p[1] = 0;
+            else
+                *p = 0;
+        }
+
+        // Files in the same directory share its watch descriptor.
+        w->wd = inotify_add_watch(fd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (w->wd == -1) {
+            fprintf(stderr, "Error watching '%s': ", dir);
+            print_error(NULL);
+            close(fd);
+            return;
+        }
+        g_nexpwatches++;
+    }
+    srv_watch(fd, on_expfile_event);
+}
+#endif
+
+static int serve_command(char *argv[], int argc, void *ctx) {
+    server_t *srv = ctx;
+    jmp_buf abort_jmp;
+
+    if (argc == 0 || !is_server_command(argv, argc)) {
+        printf(HELP_ROOT);
+        return 1;
+    }
+
+    // Changes are made to the latest expense file, with other writers
+    // locked out until saved.
+    int is_update = is_update_command(argv[0]);
+    if (is_update) {
+        if (!can_update(&srv->snap->et))
+            return 1;
+        if (lock_expense_file(EXPLOCK_WRITE) != 0)
+            return 1;
+        refresh_snapshot(srv, 1);
+    }
+
+    reset_arena(&srv->scratch);
+    volatile int aborted = 1;
+    g_commit_failed = 0;
+    g_input_abort = &abort_jmp;
+    if (setjmp(abort_jmp) == 0) {
+        run_command(argv, argc, &srv->snap->et, srv->scratch);
+        aborted = 0;
+    }
+    g_input_abort = NULL;
+
+    // An update cut short by end of input, or one that failed to save, may
+    // leave changes in the snapshot that the next update would save.
+    // Replace it with the expense file before anything else runs.
+    if (is_update && (aborted || g_commit_failed)) {
+        start_reload(srv);
+        finish_reload(srv);
+    }
+    if (is_update)
+        unlock_expense_file(EXPLOCK_WRITE);
+
+    // Reload expenses to reclaim expense arena space used up by
+    // added and edited strings.
+    if (srv->snap->arena.pos > srv->snap->arena.cap / 2)
+        start_reload(srv);
+    return aborted || g_commit_failed;
+}
+#endif
+
+void serve_expenses(arena_t scratch) {
+#ifdef WINDOWS
+    fprintf(stderr, "exp serve is not supported on Windows.\n");
+#else
+    static server_t srv;
+    srv.scratch = scratch;
+    srv.log = fdopen(dup(STDERR_FILENO), "w");
+    if (srv.log == NULL) {
+        print_error("Error opening server log");
+        return;
+    }
+    setvbuf(srv.log, NULL, _IONBF, 0);
+    srv.snap = load_snapshot();
+    if (srv.snap == NULL)
+        return;
+    if (pipe(srv.reload_pipe) != 0) {
+        print_error("pipe() error");
+        return;
+    }
+
+    // srv.scratch is reset for every request, so the socket path that's
+    // removed on shutdown is kept apart from it.
+    char sockfile[2048];
+    snprintf(sockfile, sizeof(sockfile), "%s", get_socket_filename(&srv.scratch).bytes);
+    int fd = srv_listen(sockfile);
+    if (fd == -1)
+        return;
+    srv_watch(srv.reload_pipe[0], on_reload_done);
+#ifdef __linux__
+    watch_expense_file(&srv);
+#endif
+    printf("Serving %d expenses on %s\n", srv.snap->et.len, sockfile);
+    fflush(stdout);
+
+    srv_serve(fd, sockfile, serve_command, &srv);
+    finish_reload(&srv);
+    free_snapshot(srv.snap);
+#endif
 }
 
 void read_filter_args(char *argv[], int argc, str_t *scat, time_t *startdt, time_t *enddt, arena_t *scratch) {
@@ -338,18 +1301,81 @@ void read_filter_args(char *argv[], int argc, str_t *scat, time_t *startdt, time
 
 }
 
-void list_expenses(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
+// Streamed reports, run with a NULL et when the expense file is too large
+// to load. Expenses are sorted and summed in the memory budget, see
+// expext.c.
+typedef struct {
+    extsort_t xs;
+    extagg_t xa;
+    const char *scat;
+    time_t startdt;
+    time_t enddt;
+    int nnoid;
+    int maxid;
+    int nexpenses;
+    long long total;
+    long long *month_total;
+} extreport_t;
+
+static void print_list_row(time_t date, const char *desc, float amt, const char *cat, int id) {
+    char sdate[ISO_DATE_LEN+1];
+    date_to_iso(date, sdate, sizeof(sdate));
+    printf("%-12s %-30.30s %9.2f  %-10s  #%-5d\n", sdate, desc, amt, cat, id);
+}
+
+static long long rec_cents(float amt) {
+    exp_t xp;
+    xp.amt = amt;
+    return exp_cents(xp);
+}
+
+// Expenses without an id are counted in file order to number them as
+// loading would.
+static void list_scan_record(void *ctx, exprec_t *rec) {
+    extreport_t *r = ctx;
+    int64_t idkey = rec->id;
+    if (rec->id <= 0)
+        idkey = EXT_NOID + ++r->nnoid;
+    if (rec->date < r->startdt || rec->date >= r->enddt)
+        return;
+    if (r->scat[0] != '\0' && strcmp(rec->cat, r->scat) != 0)
+        return;
+    extsort_add_exp(&r->xs, rec, idkey);
+}
+
+static void list_print_record(void *ctx, void *rec, int len) {
+    extreport_t *r = ctx;
+    extexp_t *x = rec;
+    int id = x->idkey >= EXT_NOID ? r->maxid + (int)(x->idkey - EXT_NOID) : (int)x->idkey;
+    print_list_row(x->date, x->text, x->amt, x->text + x->catoff, id);
+    r->nexpenses++;
+    r->total += rec_cents(x->amt);
+}
+
+static int list_expenses_ext(str_t scat, time_t startdt, time_t enddt, int *nexpenses, long long *total, arena_t scratch) {
+    extreport_t r;
+    memset(&r, 0, sizeof(r));
+    r.scat = scat.bytes;
+    r.startdt = startdt;
+    r.enddt = enddt;
+    init_extsort(&r.xs, get_memory_budget(), cmp_extexp_date);
+    if (scan_expense_file(scratch, list_scan_record, &r, &r.maxid) != 0) {
+        extsort_finish(&r.xs, NULL, NULL);
+        return 1;
+    }
+    int z = extsort_finish(&r.xs, list_print_record, &r);
+    *nexpenses = r.nexpenses;
+    *total = r.total;
+    return z;
+}
+
+void list_expenses(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
     // exp list [CAT] [YYYY | YYYY-MM | YYYY-MM-DD | STARTDATE ENDDATE]
 
     str_t scat = STR("");
     time_t startdt=0, enddt=0;
     read_filter_args(argv, argc, &scat, &startdt, &enddt, &scratch);
 
-    exptbl_t et;
-    int z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
-
     char startdt_iso[ISO_DATE_LEN+1], enddt_iso[ISO_DATE_LEN+1];
     date_to_iso(startdt, startdt_iso, sizeof(startdt_iso));
     date_to_iso(date_prev_day(enddt), enddt_iso, sizeof(enddt_iso));
@@ -359,49 +1385,124 @@ void list_expenses(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
         printf("Filter by category [%s]\n", scat.bytes);
     printf("\n");
 
-    double total = 0.0;
+    long long total = 0;
     int nexpenses = 0;
-    for (int i=0; i < et.len; i++) {
-        exp_t xp = et.base[i];
+    stats_mark_t t = stats_start();
+    if (et == NULL && list_expenses_ext(scat, startdt, enddt, &nexpenses, &total, scratch) != 0)
+        return;
+    for (int i=0; et != NULL && i < et->len; i++) {
+        exp_t xp = et->base[i];
         if (xp.date < startdt)
             continue;
         if (xp.date >= enddt)
             break;
 
-        str_t catname = strtbl_get(et.cats, xp.catid);
+        str_t catname = strtbl_get(et->cats, xp.catid);
         if (scat.len > 0 && strcmp(catname.bytes, scat.bytes) != 0)
             continue;
 
-        char sdate[ISO_DATE_LEN+1];
-        date_to_iso(xp.date, sdate, sizeof(sdate));
-        str_t desc = strtbl_get(et.strings, xp.descid);
-        printf("%-12s %-30.30s %9.2f  %-10s  #%-5d\n", sdate, desc.bytes, xp.amt, catname.bytes, i+1);
+        str_t desc = strtbl_get(et->strings, xp.descid);
+        print_list_row(xp.date, desc.bytes, xp.amt, catname.bytes, xp.id);
 
         nexpenses++;
-        total += xp.amt;
+        total += exp_cents(xp);
     }
 
+    stats_end("print", t);
+
     if (nexpenses == 0) {
         printf("No expenses found.\n");
         return;
     }
 
     printf("------------------------------------------------------------------------\n");
-    printf("%-12s %-30s %9.2f    %-10s\n", "Totals", "", total, "");
+    printf("%-12s %-30s %9.2f    %-10s\n", "Totals", "", total / 100.0, "");
+}
+
+typedef struct {
+    double val;
+    char name[];
+} cattotal_t;
+
+// Same order as sort_entrytbl() with cmp_entry_val, ties by name.
+static int cmp_cattotal_val(const void *a, const void *b) {
+    const cattotal_t *ca = a;
+    const cattotal_t *cb = b;
+    if (ca->val < cb->val) return 1;
+    if (ca->val > cb->val) return -1;
+    int z = strcasecmp(ca->name, cb->name);
+    if (z != 0)
+        return z;
+    return strcmp(ca->name, cb->name);
+}
+
+static void cat_scan_record(void *ctx, exprec_t *rec) {
+    extreport_t *r = ctx;
+    if (rec->date < r->startdt || rec->date >= r->enddt)
+        return;
+    long long cents = rec_cents(rec->amt);
+    extagg_add(&r->xa, rec->cat, cents);
+    r->nexpenses++;
+    r->total += cents;
 }
 
-void list_categories(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
+static void cat_add_total(void *ctx, const char *name, long long cents) {
+    extreport_t *r = ctx;
+    int len = strlen(name);
+    cattotal_t *ct = extsort_alloc(&r->xs, sizeof(cattotal_t) + len+1);
+    ct->val = cents / 100.0;
+    memcpy(ct->name, name, len+1);
+}
+
+static void print_cat_row(const char *name, double val) {
+    printf("%-12.12s %12.2f\n", name, val);
+}
+
+static void cat_print_total(void *ctx, void *rec, int len) {
+    cattotal_t *ct = rec;
+    print_cat_row(ct->name, ct->val);
+}
+
+// Category totals are summed by extagg_t, then sorted by value.
+static void list_categories_ext(time_t startdt, time_t enddt, arena_t scratch) {
+    extreport_t r;
+    memset(&r, 0, sizeof(r));
+    r.startdt = startdt;
+    r.enddt = enddt;
+
+    stats_mark_t t = stats_start();
+    long budget = get_memory_budget();
+    init_extagg(&r.xa, budget);
+    if (scan_expense_file(scratch, cat_scan_record, &r, &r.maxid) != 0) {
+        extagg_finish(&r.xa, NULL, NULL);
+        return;
+    }
+    init_extsort(&r.xs, budget/2, cmp_cattotal_val);
+    if (extagg_finish(&r.xa, cat_add_total, &r) != 0) {
+        extsort_finish(&r.xs, NULL, NULL);
+        return;
+    }
+    t = stats_end("aggregate", t);
+
+    if (r.nexpenses == 0) {
+        extsort_finish(&r.xs, NULL, NULL);
+        printf("No expenses found.\n");
+        return;
+    }
+    if (extsort_finish(&r.xs, cat_print_total, &r) != 0)
+        return;
+    printf("------------------------------------------------------------------------\n");
+    print_cat_row("Totals", r.total / 100.0);
+    stats_end("print", t);
+}
+
+void list_categories(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
     // exp cat [YYYY | YYYY-MM | YYYY-MM-DD | STARTDATE ENDDATE]
 
     str_t scat = STR("");
     time_t startdt=0, enddt=0;
     read_filter_args(argv, argc, &scat, &startdt, &enddt, &scratch);
 
-    exptbl_t et;
-    int z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
-
     char startdt_iso[ISO_DATE_LEN+1], enddt_iso[ISO_DATE_LEN+1];
     date_to_iso(startdt, startdt_iso, sizeof(startdt_iso));
     date_to_iso(date_prev_day(enddt), enddt_iso, sizeof(enddt_iso));
@@ -409,11 +1510,16 @@ void list_categories(char *argv[], int argc, arena_t exp_arena, arena_t scratch)
     printf("Date range [%s] to [%s]\n", startdt_iso, enddt_iso);
     printf("\n");
 
+    if (et == NULL) {
+        list_categories_ext(startdt, enddt, scratch);
+        return;
+    }
+
     // istart = index to first exp record within date range
     // iend = index to last exp record within date range
     int istart=-1, iend=-1;
-    for (int i=0; i < et.len; i++) {
-        exp_t xp = et.base[i];
+    for (int i=0; i < et->len; i++) {
+        exp_t xp = et->base[i];
 
         if (xp.date < startdt)
             continue;
@@ -430,55 +1536,76 @@ void list_categories(char *argv[], int argc, arena_t exp_arena, arena_t scratch)
         return;
     }
 
-    // Sort expenses within the date range by categories
-    sort_exptbl_part(&et, istart, iend, cmp_exp_cat);
-
+    // Sort a copy of the expenses within the date range by categories
+    // so that the expense table stays in date order.
+    stats_mark_t t = stats_start();
+    arena_t view_arena = *et->arena;
+    exptbl_t view = *et;
+    view.len = iend-istart+1;
+    view.base = aalloc(&view_arena, sizeof(exp_t) * view.len);
+    memcpy(view.base, et->base + istart, sizeof(exp_t) * view.len);
+    sort_exptbl(&view, cmp_exp_cat);
+
+    // One entry per category, which can be more than fit in scratch.
     entry_t catentry;
     entrytbl_t cattbl;
-    init_entrytbl(&cattbl, &scratch, 20);
+    init_entrytbl(&cattbl, &view_arena, 20);
 
-    double total = 0.0;
-    double catsubtotal = 0.0;
-    short cur_catid = -1;
-    for (int i=istart; i <= iend; i++) {
-        exp_t xp = et.base[i];
+    long long total = 0;
+    long long catsubtotal = 0;
+    int cur_catid = -1;
+    for (int i=0; i < view.len; i++) {
+        exp_t xp = view.base[i];
         assert(xp.date >= startdt && xp.date < enddt);
-        total += xp.amt;
+        total += exp_cents(xp);
 
         if (cur_catid != -1 && xp.catid != cur_catid) {
-            catentry.desc = strtbl_get(et.cats, cur_catid);
-            catentry.val = catsubtotal;
+            catentry.desc = strtbl_get(et->cats, cur_catid);
+            catentry.val = catsubtotal / 100.0;
             entrytbl_add(&cattbl, catentry);
 
             cur_catid = xp.catid;
-            catsubtotal = xp.amt;
+            catsubtotal = exp_cents(xp);
             continue;
         }
 
         cur_catid = xp.catid;
-        catsubtotal += xp.amt;
+        catsubtotal += exp_cents(xp);
     }
     assert(cur_catid != -1);
 
-    catentry.desc = strtbl_get(et.cats, cur_catid);
-    catentry.val = catsubtotal;
+    catentry.desc = strtbl_get(et->cats, cur_catid);
+    catentry.val = catsubtotal / 100.0;
     entrytbl_add(&cattbl, catentry);
 
     sort_entrytbl(&cattbl, cmp_entry_val);
+    t = stats_end("aggregate", t);
 
     for (int i=0; i < cattbl.len; i++) {
         entry_t e = cattbl.base[i];
-        printf("%-12.12s %12.2f\n", e.desc.bytes, e.val);
+        print_cat_row(e.desc.bytes, e.val);
     }
     printf("------------------------------------------------------------------------\n");
-    printf("%-12.12s %12.2f\n", "Totals", total);
+    print_cat_row("Totals", total / 100.0);
+    stats_end("print", t);
 }
 
-void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
+static void ytd_scan_record(void *ctx, exprec_t *rec) {
+    extreport_t *r = ctx;
+    if (rec->date < r->startdt || rec->date >= r->enddt)
+        return;
+    short month;
+    date_to_cal(rec->date, NULL, &month, NULL);
+    long long cents = rec_cents(rec->amt);
+    r->month_total[month] += cents;
+    r->total += cents;
+}
+
+void list_ytd(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
     // exp ytd [YYYY]
 
-    double month_total[13];
-    double total = 0.0;
+    long long month_total[13];
+    long long total = 0;
     char monthname[32];
     short year;
 
@@ -490,12 +1617,8 @@ void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
         date_to_cal(date_today(), &year, NULL, NULL);
 
     for (int i=0; i < countof(month_total); i++)
-        month_total[i] = 0.0;
+        month_total[i] = 0;
 
-    exptbl_t et;
-    int z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
 
     time_t startdt = date_from_cal(year, 1, 1);
     time_t enddt = date_from_cal(year+1, 1, 1);
@@ -504,9 +1627,21 @@ void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
     printf("Year: %d\n", year);
     printf("\n");
 
-    // Sum month totals to month_total[month]
-    for (int i=0; i < et.len; i++) {
-        exp_t xp = et.base[i];
+    // Sum month totals to month_total[month]. Streamed expenses only
+    // need the 12 month totals, so nothing is spilled.
+    stats_mark_t t = stats_start();
+    if (et == NULL) {
+        extreport_t r;
+        memset(&r, 0, sizeof(r));
+        r.startdt = startdt;
+        r.enddt = enddt;
+        r.month_total = month_total;
+        if (scan_expense_file(scratch, ytd_scan_record, &r, &r.maxid) != 0)
+            return;
+        total = r.total;
+    }
+    for (int i=0; et != NULL && i < et->len; i++) {
+        exp_t xp = et->base[i];
         if (xp.date < startdt)
             continue;
         if (xp.date >= enddt)
@@ -514,10 +1649,12 @@ void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
 
         short month;
         date_to_cal(xp.date, NULL, &month, NULL);
-        month_total[month] += xp.amt;
-        total += xp.amt;
+        month_total[month] += exp_cents(xp);
+        total += exp_cents(xp);
     }
 
+    t = stats_end("aggregate", t);
+
     // Determine longest month name
     int longest_monthlen = 0;
     for (int i=1; i <= 12; i++) {
@@ -530,10 +1667,236 @@ void list_ytd(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
     for (int i=1; i <= 12; i++) {
         time_t dt = date_from_cal(year, i, 1);
         date_strftime(dt, "%B", monthname, sizeof(monthname));
-        printf("%-*s   %12.2f\n", longest_monthlen, monthname, month_total[i]);
+        printf("%-*s   %12.2f\n", longest_monthlen, monthname, month_total[i] / 100.0);
     }
     printf("------------------------\n");
-    printf("%-*s   %12.2f\n", longest_monthlen, "Total", total);
+    printf("%-*s   %12.2f\n", longest_monthlen, "Total", total / 100.0);
+    stats_end("print", t);
+}
+
+#define DUPES_WINDOW_DAYS 2
+
+// Read the --dupes and --window DAYS options of the dupes and import
+// commands. Other args are copied to args. Returns the number of them.
+static int read_dupes_opts(char *argv[], int argc, char *args[], long *window, int *check) {
+    int nargs = 0;
+    *window = DUPES_WINDOW_DAYS * 24*60*60;
+    *check = 0;
+    for (int i=0; i < argc; i++) {
+        if (szequals(argv[i], "--dupes"))
+            *check = 1;
+        else if (szequals(argv[i], "--window") && i+1 < argc) {
+            *window = atol(argv[++i]) * 24*60*60;
+            if (*window < 0)
+                *window = 0;
+        } else
+            args[nargs++] = argv[i];
+    }
+    return nargs;
+}
+
+static void print_dupe_row(exptbl_t *et, int idx, int match, int kind) {
+    exp_t xp = et->base[idx];
+    char sdate[ISO_DATE_LEN+1];
+    date_to_iso(xp.date, sdate, sizeof(sdate));
+    printf("%-12s %-30.30s %9.2f  %-10s  #%-5d %s #%d\n", sdate, strtbl_get(et->strings, xp.descid).bytes,
+           xp.amt, strtbl_get(et->cats, xp.catid).bytes, xp.id,
+           kind == DUPE_EXACT ? "same as" : "near", et->base[match].id);
+}
+
+typedef struct {
+    exptbl_t *et;
+    time_t startdt;
+    const char *scat;
+    int nexact;
+    int nnear;
+} dupereport_t;
+
+static void list_dupe(void *ctx, int idx, int match, int kind) {
+    dupereport_t *r = ctx;
+    // Expenses before the range are only scanned as earlier matches.
+    if (r->et->base[idx].date < r->startdt)
+        return;
+    if (r->scat[0] != '\0' && strcmp(strtbl_get(r->et->cats, r->et->base[idx].catid).bytes, r->scat) != 0)
+        return;
+    print_dupe_row(r->et, idx, match, kind);
+    if (kind == DUPE_EXACT)
+        r->nexact++;
+    else
+        r->nnear++;
+}
+
+void list_dupes(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // exp dupes [--window DAYS] [CAT] [YYYY | YYYY-MM | YYYY-MM-DD | STARTDATE ENDDATE]
+    char *args[argc+1];
+    long window;
+    int check;
+    int nargs = read_dupes_opts(argv, argc, args, &window, &check);
+
+    printf("Display: Duplicates\n");
+    if (et->len == 0) {
+        printf("\nNo expenses found.\n");
+        return;
+    }
+    str_t scat = STR("");
+    time_t startdt = et->base[0].date;
+    time_t enddt = et->base[et->len-1].date + 1;
+    int ndates = 0;
+    if (nargs > 0) {
+        time_t dt1, dt2;
+        read_filter_args(args, nargs, &scat, &dt1, &dt2, &scratch);
+        ndates = nargs - (scat.len > 0 ? 1 : 0);
+        if (ndates > 0) {
+            startdt = dt1;
+            enddt = dt2;
+        }
+    }
+
+    char startdt_iso[ISO_DATE_LEN+1], enddt_iso[ISO_DATE_LEN+1];
+    date_to_iso(startdt, startdt_iso, sizeof(startdt_iso));
+    date_to_iso(ndates > 0 ? date_prev_day(enddt) : enddt-1, enddt_iso, sizeof(enddt_iso));
+    printf("Date range [%s] to [%s]\n", startdt_iso, enddt_iso);
+    if (scat.len > 0)
+        printf("Filter by category [%s]\n", scat.bytes);
+    printf("Window: %ld days\n\n", window / (24*60*60));
+
+    // Start window seconds early so expenses at the start of the range
+    // are compared with the ones before it.
+    int istart = 0;
+    while (istart < et->len && et->base[istart].date < startdt - window)
+        istart++;
+    int iend = istart;
+    while (iend < et->len && et->base[iend].date < enddt)
+        iend++;
+
+    dupereport_t r = {et, startdt, scat.bytes, 0, 0};
+    stats_mark_t t = stats_start();
+    find_exp_dupes(et, istart, iend, window, 0, list_dupe, &r);
+    stats_end("dupes", t);
+
+    if (r.nexact + r.nnear == 0) {
+        printf("No duplicates found.\n");
+        return;
+    }
+    printf("------------------------------------------------------------------------\n");
+    printf("%d duplicates, %d exact and %d near.\n", r.nexact + r.nnear, r.nexact, r.nnear);
+}
+
+#define STATS_SIGMA 3.0
+
+// Read the --sigma K option of the stats command. Other args are copied
+// to args. Returns the number of them.
+static int read_stats_opts(char *argv[], int argc, char *args[], double *sigma) {
+    int nargs = 0;
+    *sigma = STATS_SIGMA;
+    for (int i=0; i < argc; i++) {
+        if (szequals(argv[i], "--sigma") && i+1 < argc) {
+            *sigma = atof(argv[++i]);
+            if (*sigma <= 0)
+                *sigma = STATS_SIGMA;
+        } else
+            args[nargs++] = argv[i];
+    }
+    return nargs;
+}
+
+typedef struct {
+    const char *name;
+    int catid;
+} statrow_t;
+
+static int cmp_statrow_name(const void *a, const void *b) {
+    return strcmp(((statrow_t *)a)->name, ((statrow_t *)b)->name);
+}
+
+static void print_stats_row(const char *name, catstat_t *cs) {
+    printf("%-12.12s %7ld %11.2f %11.2f %11.2f %11.2f\n", name, cs->count, cs->mean,
+           sqrt(catstat_variance(cs)), cs->min, cs->max);
+}
+
+void list_stats(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // exp stats [--sigma K] [CAT] [YYYY | YYYY-MM | YYYY-MM-DD | STARTDATE ENDDATE]
+    char *args[argc+1];
+    double sigma;
+    int nargs = read_stats_opts(argv, argc, args, &sigma);
+
+    str_t scat = STR("");
+    time_t startdt=0, enddt=0;
+    read_filter_args(args, nargs, &scat, &startdt, &enddt, &scratch);
+
+    char startdt_iso[ISO_DATE_LEN+1], enddt_iso[ISO_DATE_LEN+1];
+    date_to_iso(startdt, startdt_iso, sizeof(startdt_iso));
+    date_to_iso(date_prev_day(enddt), enddt_iso, sizeof(enddt_iso));
+    printf("Display: Category statistics\n");
+    printf("Date range [%s] to [%s]\n", startdt_iso, enddt_iso);
+    if (scat.len > 0)
+        printf("Filter by category [%s]\n", scat.bytes);
+    printf("\n");
+
+    int istart = 0;
+    while (istart < et->len && et->base[istart].date < startdt)
+        istart++;
+    int iend = istart;
+    while (iend < et->len && et->base[iend].date < enddt)
+        iend++;
+
+    // Borrow the unused end of the expense arena for the statistics.
+    stats_mark_t t = stats_start();
+    arena_t tmp = *et->arena;
+    catstat_t *stats = aalloc(&tmp, sizeof(catstat_t) * (et->cats.len+1));
+    get_cat_stats(et, istart, iend, stats);
+
+    statrow_t *rows = aalloc(&tmp, sizeof(statrow_t) * (et->cats.len+1));
+    int nrows = 0;
+    catstat_t total;
+    memset(&total, 0, sizeof(total));
+    for (int catid=0; catid < et->cats.len; catid++) {
+        str_t catname = strtbl_get(et->cats, catid);
+        if (stats[catid].count == 0)
+            continue;
+        if (scat.len > 0 && strcmp(catname.bytes, scat.bytes) != 0)
+            continue;
+        rows[nrows].name = catname.bytes;
+        rows[nrows].catid = catid;
+        nrows++;
+        catstat_merge(&total, &stats[catid]);
+    }
+    qsort(rows, nrows, sizeof(statrow_t), cmp_statrow_name);
+    t = stats_end("aggregate", t);
+
+    if (nrows == 0) {
+        printf("No expenses found.\n");
+        return;
+    }
+    printf("%-12s %7s %11s %11s %11s %11s\n", "Category", "Count", "Mean", "Std Dev", "Min", "Max");
+    for (int i=0; i < nrows; i++)
+        print_stats_row(rows[i].name, &stats[rows[i].catid]);
+    printf("------------------------------------------------------------------------\n");
+    print_stats_row("Totals", &total);
+
+    // Second pass for the expenses far from their category's mean.
+    printf("\nOutliers, more than %.1f standard deviations from category mean:\n\n", sigma);
+    int noutliers = 0;
+    for (int i=istart; i < iend; i++) {
+        exp_t xp = et->base[i];
+        catstat_t *cs = &stats[xp.catid];
+        double sd = sqrt(catstat_variance(cs));
+        double dev = exp_cents(xp) / 100.0 - cs->mean;
+        if (sd == 0 || fabs(dev) <= sigma * sd)
+            continue;
+        str_t catname = strtbl_get(et->cats, xp.catid);
+        if (scat.len > 0 && strcmp(catname.bytes, scat.bytes) != 0)
+            continue;
+
+        char sdate[ISO_DATE_LEN+1];
+        date_to_iso(xp.date, sdate, sizeof(sdate));
+        printf("%-12s %-30.30s %9.2f  %-10s  #%-5d %+.1f sd\n", sdate, strtbl_get(et->strings, xp.descid).bytes,
+               xp.amt, catname.bytes, xp.id, dev / sd);
+        noutliers++;
+    }
+    if (noutliers == 0)
+        printf("No outliers found.\n");
+    stats_end("print", t);
 }
 
 // Remove trailing \n or \r chars.
@@ -545,40 +1908,40 @@ static void chomp(char *buf) {
     }
 }
 static void read_input(const char *prompt, char *buf, short bufsize) {
-    if (prompt != NULL)
+    if (prompt != NULL) {
         printf("%s", prompt);
+        fflush(stdout);
+    }
 
     memset(buf, 0, bufsize);
     char *pz = fgets(buf, bufsize, stdin);
     if (pz == NULL) {
         perror("Error reading input");
+        // Abort current command only when running in server mode.
+        if (g_input_abort != NULL)
+            longjmp(*g_input_abort, 1);
         exit(1);
     }
     chomp(buf);
 }
-void prompt_add(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
+void prompt_add(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
     char buf[1024];
-    short descid=0;
+    int descid=0;
     float amt=-1;
-    short catid=0;
+    int catid=0;
     time_t dt=0;
     int z;
 
-    exptbl_t et;
-    z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
-
     // argv[]: [DESC] [AMT] [CAT] [DATE] [TIME]
     if (argc >= 1)
-        descid = strtbl_add(&et.strings, argv[0]);
+        descid = strtbl_add(&et->strings, argv[0]);
     if (argc >= 2)
         amt = atof(argv[1]);
     if (argc >= 3) {
         // Add new category name to cats table if necessary. 
-        catid = strtbl_find(et.cats, argv[2]);
+        catid = strtbl_find(et->cats, argv[2]);
         if (catid == 0)
-            catid = strtbl_add(&et.cats, argv[2]);
+            catid = strtbl_add(&et->cats, argv[2]);
     }
     if (argc == 4) {
         if (szequals(argv[3], "-") || szequals(argv[3], "today"))
@@ -606,7 +1969,7 @@ void prompt_add(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
         read_input("Expense Description: ", buf, sizeof(buf));
         if (strlen(buf) == 0)
             continue;
-        descid = strtbl_add(&et.strings, buf);
+        descid = strtbl_add(&et->strings, buf);
     }
 
     // AMT
@@ -619,39 +1982,49 @@ void prompt_add(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
 
     // CAT
     if (catid == 0)
-        catid = prompt_cat(&et.cats, 0);
+        catid = prompt_cat(&et->cats, 0);
 
     // DATE
     if (dt == 0)
         dt = prompt_date(0);
 
     assert(descid > 0 && catid > 0 && dt > 0);
+    if (!is_year_in_range(et, dt)) {
+        fprintf(stderr, "Year is out of range, expense directories hold years %d to %d.\n", PART_MIN_YEAR, PART_MIN_YEAR+PART_YEARS-1);
+        printf("Record not added.\n");
+        return;
+    }
 
     exp_t exp;
     exp.date = dt;
     exp.descid = descid;
     exp.amt = amt;
     exp.catid = catid;
+    exp.id = new_exp_id(et);
 
-    add_exp(&et, exp);
-    z = save_expense_file(et, scratch);
+    add_exp(et, exp);
+    z = commit_expenses(et, scratch);
     if (z != 0) {
+        // Take it back out, so it isn't saved by a later command.
+        int slot = find_exp_id(et, exp.id);
+        if (slot != -1)
+            del_exp(et, slot);
         printf("Record not added.\n");
         return;
     }
     printf("Record added.\n");
     char isodate[ISO_DATE_LEN+1];
     date_to_iso(exp.date, isodate, sizeof(isodate));
-    printf("%s; %s; %.2f; %s\n", isodate, strtbl_get(et.strings, descid).bytes, exp.amt, strtbl_get(et.cats, catid).bytes);
+    printf("%s; %s; %.2f; %s\n", isodate, strtbl_get(et->strings, descid).bytes, exp.amt, strtbl_get(et->cats, catid).bytes);
 }
 
-void prompt_edit(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
-    // edit RECNO
-    // RECNO should be in the range from 1 to [NUM EXPENSES]
-    // exptbl array of expenses is indexed from 0 to [NUM EXPENSES] - 1
-    // so exptbl.base[0] is RECNO 1, exptbl.base[1] is RECNO 2, etc.
+void prompt_edit(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // edit ID
+    // ID is the expense id shown as #nnn by the list command.
+    // It is looked up through the expense id index, so it doesn't depend
+    // on the expense's position in the expense table.
     //
-    // argv[]: [RECNO]
+    // argv[]: [ID]
 
     char prompt[2048];
     char buf[1024];
@@ -661,59 +2034,67 @@ void prompt_edit(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
         printf(HELP_EDIT);
         return;
     }
-    int recno = atoi(argv[0]);
-    if (recno == 0) {
+    int id = atoi(argv[0] + (argv[0][0] == '#'));
+    if (id <= 0) {
         printf(HELP_EDIT);
         return;
     }
 
-    exptbl_t et;
-    z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
-    if (recno < 0 || recno > et.len) {
-        fprintf(stderr, "Record out of range.\n");
-        return;
-    }
-    exp_t *exp = get_exp(&et, recno-1);
-    if (exp == NULL) {
-        fprintf(stderr, "Record out of range.\n");
+    int slot = find_exp_id(et, id);
+    exp_t *pexp = get_exp(et, slot);
+    if (pexp == NULL) {
+        fprintf(stderr, "Record #%d not found.\n", id);
         return;
     }
 
+    // Edit a copy, so that the expense is left as it was if input ends
+    // before all of it is entered.
+    exp_t oldexp = *pexp;
+    exp_t exp = oldexp;
+
     // DESC
-    snprintf(prompt, sizeof(prompt), "Description [%s]: ", strtbl_get(et.strings, exp->descid).bytes);
+    snprintf(prompt, sizeof(prompt), "Description [%s]: ", strtbl_get(et->strings, exp.descid).bytes);
     read_input(prompt, buf, sizeof(buf));
     if (strlen(buf) > 0)
-        exp->descid = strtbl_add(&et.strings, buf);
+        exp.descid = strtbl_add(&et->strings, buf);
 
     // AMT
-    snprintf(prompt, sizeof(prompt), "Amount [%.2f]: ", exp->amt);
+    snprintf(prompt, sizeof(prompt), "Amount [%.2f]: ", exp.amt);
     read_input(prompt, buf, sizeof(buf));
     if (strlen(buf) > 0)
-        exp->amt = atof(buf);
+        exp.amt = atof(buf);
 
     // CAT
-    exp->catid = prompt_cat(&et.cats, exp->catid);
+    exp.catid = prompt_cat(&et->cats, exp.catid);
 
     // DATE
-    exp->date = prompt_date(exp->date);
+    exp.date = prompt_date(exp.date);
+    if (!is_year_in_range(et, exp.date)) {
+        fprintf(stderr, "Year is out of range, expense directories hold years %d to %d.\n", PART_MIN_YEAR, PART_MIN_YEAR+PART_YEARS-1);
+        printf("Record not updated.\n");
+        return;
+    }
 
-    z = save_expense_file(et, scratch);
+    replace_exp(et, slot, exp);
+    z = commit_expenses(et, scratch);
     if (z != 0) {
+        // Saving may have sorted the expenses, look it up again.
+        slot = find_exp_id(et, id);
+        if (slot != -1)
+            replace_exp(et, slot, oldexp);
         printf("Record not updated.\n");
         return;
     }
     printf("Record updated.\n");
 }
 
-void prompt_del(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
-    // del RECNO
-    // RECNO should be in the range from 1 to [NUM EXPENSES]
-    // exptbl array of expenses is indexed from 0 to [NUM EXPENSES] - 1
-    // so exptbl.base[0] is RECNO 1, exptbl.base[1] is RECNO 2, etc.
+void prompt_del(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // del ID
+    // ID is the expense id shown as #nnn by the list command.
+    // It is looked up through the expense id index, so it doesn't depend
+    // on the expense's position in the expense table.
     //
-    // argv[]: [RECNO]
+    // argv[]: [ID]
 
     char buf[5];
     int z;
@@ -722,37 +2103,153 @@ void prompt_del(char *argv[], int argc, arena_t exp_arena, arena_t scratch) {
         printf(HELP_DEL);
         return;
     }
-    int recno = atoi(argv[0]);
-    if (recno == 0) {
+    int id = atoi(argv[0] + (argv[0][0] == '#'));
+    if (id <= 0) {
         printf(HELP_DEL);
         return;
     }
 
-    exptbl_t et;
-    z = load_expense_file(&exp_arena, scratch, &et);
-    if (z != 0)
-        return;
-    if (recno < 0 || recno > et.len) {
-        fprintf(stderr, "Record out of range.\n");
-        return;
-    }
-    exp_t *exp = get_exp(&et, recno-1);
+    int slot = find_exp_id(et, id);
+    exp_t *exp = get_exp(et, slot);
     if (exp == NULL) {
-        fprintf(stderr, "Record out of range.\n");
+        fprintf(stderr, "Record #%d not found.\n", id);
         return;
     }
     char isodate[ISO_DATE_LEN+1];
     date_to_iso(exp->date, isodate, sizeof(isodate));
-    printf("\n%s; %s; %.2f; %s\n", isodate, strtbl_get(et.strings, exp->descid).bytes, exp->amt, strtbl_get(et.cats, exp->catid).bytes);
+    printf("\n%s; %s; %.2f; %s\n", isodate, strtbl_get(et->strings, exp->descid).bytes, exp->amt, strtbl_get(et->cats, exp->catid).bytes);
     read_input("Delete? (y/n): ", buf, sizeof(buf));
 
     if (strcasecmp(buf, "y") != 0)
         return;
 
-    del_exp(&et, recno-1);
-    z = save_expense_file(et, scratch);
-    if (z == 0)
-        printf("Record deleted.\n");
+    exp_t oldexp = *exp;
+    del_exp(et, slot);
+    z = commit_expenses(et, scratch);
+    if (z != 0) {
+        add_exp(et, oldexp);
+        printf("Record not deleted.\n");
+        return;
+    }
+    printf("Record deleted.\n");
+}
+
+typedef struct {
+    int idx;
+    int match;
+    int kind;
+} dupe_t;
+
+typedef struct {
+    dupe_t *dupes;
+    int len;
+    int cap;
+} importdupes_t;
+
+static void collect_import_dupe(void *ctx, int idx, int match, int kind) {
+    importdupes_t *d = ctx;
+    if (d->len == d->cap) {
+        int newcap = d->cap > 0 ? d->cap*2 : 64;
+        dupe_t *p = realloc(d->dupes, sizeof(dupe_t) * newcap);
+        if (p == NULL)
+            panic_err("realloc() error");
+        d->dupes = p;
+        d->cap = newcap;
+    }
+    d->dupes[d->len++] = (dupe_t){idx, match, kind};
+}
+
+// Delete expenses imported as ids first_id and up that duplicate expenses
+// from before the import. Returns the number deleted.
+static int skip_import_dupes(exptbl_t *et, int first_id, long window) {
+    importdupes_t d = {NULL, 0, 0};
+    find_exp_dupes(et, 0, et->len, window, first_id, collect_import_dupe, &d);
+
+    if (d.len > 0)
+        printf("Skipping duplicates:\n");
+    for (int i=0; i < d.len; i++)
+        print_dupe_row(et, d.dupes[i].idx, d.dupes[i].match, d.dupes[i].kind);
+    // Found in date order, so deleting from the last keeps the indexes of
+    // the rest valid.
+    for (int i=d.len-1; i >= 0; i--)
+        del_exp(et, d.dupes[i].idx);
+    int nskipped = d.len;
+    free(d.dupes);
+    if (nskipped > 0)
+        sort_exptbl(et, cmp_exp_date);
+    return nskipped;
+}
+
+void import_file(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // import [--dupes] [--window DAYS] [FILE]
+    FILE *f = stdin;
+    int z;
+    char *args[argc+1];
+    long window;
+    int check;
+    int nargs = read_dupes_opts(argv, argc, args, &window, &check);
+
+    if (nargs >= 1 && !szequals(args[0], "-")) {
+        f = fopen(args[0], "r");
+        if (f == NULL) {
+            fprintf(stderr, "Error opening '%s': ", args[0]);
+            print_error(NULL);
+            return;
+        }
+    }
+
+    // Streamed imports are written to the expense file as they're merged.
+    int nimported;
+    int nskipped = 0;
+    if (et == NULL) {
+        if (check)
+            fprintf(stderr, "Expense file is over EXP2MEMLIMIT, duplicates not checked.\n");
+        nimported = import_expenses_ext(f, scratch);
+    } else {
+        int first_id = et->next_id;
+        nimported = import_expenses(f, et, scratch);
+        if (check && nimported > 0) {
+            nskipped = skip_import_dupes(et, first_id, window);
+            nimported -= nskipped;
+        }
+    }
+    if (nimported <= 0) {
+        printf("No records imported.\n");
+        goto done;
+    }
+    z = et != NULL ? commit_expenses(et, scratch) : 0;
+    if (z != 0) {
+        printf("Records not imported.\n");
+        goto done;
+    }
+    if (nskipped > 0)
+        printf("%d records imported, %d duplicates skipped.\n", nimported, nskipped);
+    else
+        printf("%d records imported.\n", nimported);
+
+done:
+    if (f != stdin)
+        fclose(f);
+}
+
+void archive_year(char *argv[], int argc, exptbl_t *et, arena_t scratch) {
+    // archive YEAR
+    if (argc == 0) {
+        printf(HELP_ARCHIVE);
+        return;
+    }
+    short year = atoi(argv[0]);
+    if (year == 0) {
+        printf(HELP_ARCHIVE);
+        return;
+    }
+    if (archive_expense_year(et, year) != 0)
+        return;
+    if (commit_expenses(et, scratch) != 0) {
+        printf("Year not archived.\n");
+        return;
+    }
+    printf("Year %d archived.\n", year);
 }
 
 void print_tables(exptbl_t et) {
@@ -824,10 +2321,10 @@ int match_date(char *sz, shortdate_t *sd) {
     return 1;
 }
 
-short prompt_cat(strtbl_t *cats, short default_catid) {
+int prompt_cat(strtbl_t *cats, int default_catid) {
     char prompt[2048];
     char buf[1024];
-    short catid=0;
+    int catid=0;
     short ask_catname = 1;
 
     if (default_catid < 1 || default_catid >= cats->len) {
@@ -866,7 +2363,7 @@ short prompt_cat(strtbl_t *cats, short default_catid) {
                 printf("Categories:\n");
                 printf("[0] (Enter new category)\n");
                 for (int i=1; i < cats->len; i++)
-                    printf("[%d] %s\n", i, cats->base[i].bytes);
+                    printf("[%d] %s\n", i, strtbl_get(*cats, i).bytes);
                 printf("\n");
 
                 read_input("Select category [n]: ", buf, sizeof(buf));
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "clib.h"
+#include "exp.h"
+#include "exparc.h"
+
+// Archive format, all integers are LEB128 varints unless noted:
+//
+//   "EXPA" version
+//   nrecs unit
+//   ncats  { len bytes }...            category dictionary
+//   ndescs { prefix len bytes }...     sorted descriptions, front coded
+//   blocks of ARC_BLOCK_LEN records:
+//     { zigzag date delta, cat, desc, zigzag cents, zigzag id delta }...
+//   block index: nblocks x { zigzag first date, last date - first date,
+//                            nrecs, offset }
+//   footer: index offset (u32 le), nblocks (u32 le), "EXPA"
+//
+// Dates are in units of 'unit' seconds, 60 when all dates fall on a minute,
+// and are delta coded from the previous record, or from the block's first
+// date for the first record of a block. Ids are delta coded the same way.
+// Blocks can be decoded independently, so blocks outside of the requested
+// date range are skipped using the block index.
+
+#define ARC_MAGIC      "EXPA"
+#define ARC_VERSION    1
+#define ARC_BLOCK_LEN  256
+#define ARC_FOOTER_LEN 12
+
+typedef struct {
+    FILE *f;
+    long pos;
+} arcw_t;
+
+typedef struct {
+    unsigned char *p;
+    unsigned char *end;
+    int err;
+} arcr_t;
+
+typedef struct {
+    str_t s;
+    int id;
+} descent_t;
+
+static void put_bytes(arcw_t *w, const void *buf, long len) {
+    fwrite(buf, 1, len, w->f);
+    w->pos += len;
+}
+static void put_varint(arcw_t *w, unsigned long long v) {
+    unsigned char buf[10];
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    put_bytes(w, buf, n);
+}
+static void put_u32(arcw_t *w, uint32_t v) {
+    unsigned char buf[4] = {v, v >> 8, v >> 16, v >> 24};
+    put_bytes(w, buf, 4);
+}
+static unsigned long long zigzag(long long v) {
+    return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+static long long unzigzag(unsigned long long v) {
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static unsigned long long get_varint(arcr_t *r) {
+    unsigned long long v = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        if (r->p >= r->end) {
+            r->err = 1;
+            return 0;
+        }
+        unsigned char b = *r->p++;
+        v |= (unsigned long long)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return v;
+    }
+    r->err = 1;
+    return 0;
+}
+static unsigned char *get_bytes(arcr_t *r, unsigned long long len) {
+    if (len > (unsigned long long)(r->end - r->p)) {
+        r->err = 1;
+        return NULL;
+    }
+    unsigned char *p = r->p;
+    r->p += len;
+    return p;
+}
+static uint32_t get_u32(unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int cmp_descent(const void *a, const void *b) {
+    return strcmp(((descent_t *)a)->s.bytes, ((descent_t *)b)->s.bytes);
+}
+
+// Write expenses [istart, iend) of et, sorted by date, to f as an archive.
+int write_archive(FILE *f, exptbl_t *et, int istart, int iend) {
+    arcw_t w = {f, 0};
+    int nrecs = iend - istart;
+
+    // Borrow the unused end of the expense arena for the dictionaries.
+    arena_t tmp = *et->arena;
+
+    int unit = 60;
+    for (int i=istart; i < iend; i++) {
+        if (et->base[i].date % 60 != 0) {
+            unit = 1;
+            break;
+        }
+    }
+
+    put_bytes(&w, ARC_MAGIC, 4);
+    put_varint(&w, ARC_VERSION);
+    put_varint(&w, nrecs);
+    put_varint(&w, unit);
+
+    // Categories in order of first use.
+    int *catmap = aalloc(&tmp, sizeof(int) * (et->cats.len+1));
+    int *cats = aalloc(&tmp, sizeof(int) * (et->cats.len+1));
+    for (int i=0; i < et->cats.len; i++)
+        catmap[i] = -1;
+    int ncats = 0;
+    for (int i=istart; i < iend; i++) {
+        int catid = et->base[i].catid;
+        if (catmap[catid] == -1) {
+            catmap[catid] = ncats;
+            cats[ncats++] = catid;
+        }
+    }
+    put_varint(&w, ncats);
+    for (int i=0; i < ncats; i++) {
+        str_t s = strtbl_get(et->cats, cats[i]);
+        put_varint(&w, s.len);
+        put_bytes(&w, s.bytes, s.len);
+    }
+
+    // Descriptions sorted, each stored as the length of the prefix shared
+    // with the previous one followed by the rest.
+    int *descmap = aalloc(&tmp, sizeof(int) * (et->strings.len+1));
+    descent_t *descs = aalloc(&tmp, sizeof(descent_t) * (et->strings.len+1));
+    for (int i=0; i < et->strings.len; i++)
+        descmap[i] = -1;
+    int ndescs = 0;
+    for (int i=istart; i < iend; i++) {
+        int descid = et->base[i].descid;
+        if (descmap[descid] == -1) {
+            descmap[descid] = 0;
+            descs[ndescs].s = strtbl_get(et->strings, descid);
+            descs[ndescs].id = descid;
+            ndescs++;
+        }
+    }
+    qsort(descs, ndescs, sizeof(descent_t), cmp_descent);
+    put_varint(&w, ndescs);
+    str_t prev = STR("");
+    for (int i=0; i < ndescs; i++) {
+        str_t s = descs[i].s;
+        long prefix = 0;
+        while (prefix < prev.len && prefix < s.len && prev.bytes[prefix] == s.bytes[prefix])
+            prefix++;
+        put_varint(&w, prefix);
+        put_varint(&w, s.len - prefix);
+        put_bytes(&w, s.bytes + prefix, s.len - prefix);
+        descmap[descs[i].id] = i;
+        prev = s;
+    }
+
+    // Records
+    int nblocks = (nrecs + ARC_BLOCK_LEN-1) / ARC_BLOCK_LEN;
+    long *blockpos = aalloc(&tmp, sizeof(long) * (nblocks+1));
+    long recstart = w.pos;
+    for (int b=0; b < nblocks; b++) {
+        int bstart = istart + b*ARC_BLOCK_LEN;
+        int bend = bstart + ARC_BLOCK_LEN;
+        if (bend > iend)
+            bend = iend;
+
+        blockpos[b] = w.pos - recstart;
+        long long prevdate = et->base[bstart].date / unit;
+        long long previd = 0;
+        for (int i=bstart; i < bend; i++) {
+            exp_t exp = et->base[i];
+            long long date = exp.date / unit;
+            put_varint(&w, zigzag(date - prevdate));
+            put_varint(&w, catmap[exp.catid]);
+            put_varint(&w, descmap[exp.descid]);
+            put_varint(&w, zigzag(exp_cents(exp)));
+            put_varint(&w, zigzag(exp.id - previd));
+            prevdate = date;
+            previd = exp.id;
+        }
+    }
+
+    // Block index
+    long indexpos = w.pos;
+    for (int b=0; b < nblocks; b++) {
+        int bstart = istart + b*ARC_BLOCK_LEN;
+        int bend = bstart + ARC_BLOCK_LEN;
+        if (bend > iend)
+            bend = iend;
+        long long first = et->base[bstart].date / unit;
+        long long last = et->base[bend-1].date / unit;
+        put_varint(&w, zigzag(first));
+        put_varint(&w, last - first);
+        put_varint(&w, bend - bstart);
+        put_varint(&w, blockpos[b]);
+    }
+
+    put_u32(&w, indexpos);
+    put_u32(&w, nblocks);
+    put_bytes(&w, ARC_MAGIC, 4);
+
+    if (ferror(f))
+        return 1;
+    return 0;
+}
+
+// Read archive f into et, skipping blocks that don't overlap
+// [startdt, enddt). Zero startdt or enddt leaves that end of the range open.
+// Returns ARC_FULL if all expenses were read, ARC_PARTIAL if some blocks
+// were skipped, or -1 on error, with none of its expenses added to et.
+int read_archive(FILE *f, exptbl_t *et, time_t startdt, time_t enddt) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0)
+        return -1;
+    long size = st.st_size;
+    if (size < ARC_FOOTER_LEN + 4)
+        return -1;
+
+    // Expenses of a block that fails to decode are taken back out.
+    int len0 = et->len;
+    int next_id0 = et->next_id;
+
+    // Whole archive, plus room for the dictionary maps and for rebuilding
+    // front coded descriptions.
+    arena_t a;
+    init_arena(&a, size*(1 + 2*sizeof(int)) + size+1 + 64);
+    unsigned char *buf = aalloc(&a, size);
+    if (fread(buf, 1, size, f) != (size_t)size) {
+        free_arena(&a);
+        return -1;
+    }
+
+    int z = -1;
+    unsigned char *footer = buf + size - ARC_FOOTER_LEN;
+    uint32_t indexpos = get_u32(footer);
+    uint32_t nblocks = get_u32(footer+4);
+    if (memcmp(buf, ARC_MAGIC, 4) != 0 || memcmp(footer+8, ARC_MAGIC, 4) != 0)
+        goto done;
+    if (indexpos > size - ARC_FOOTER_LEN)
+        goto done;
+
+    arcr_t r = {buf+4, buf + indexpos, 0};
+    if (get_varint(&r) != ARC_VERSION)
+        goto done;
+    get_varint(&r);
+    long long unit = get_varint(&r);
+    if (unit <= 0)
+        goto done;
+
+    unsigned long long ncats = get_varint(&r);
+    if (r.err || ncats > (unsigned long long)size)
+        goto done;
+    int *catmap = aalloc(&a, sizeof(int) * (ncats+1));
+    char *sbuf = aalloc(&a, size+1);
+    for (unsigned long long i=0; i < ncats; i++) {
+        unsigned long long len = get_varint(&r);
+        unsigned char *p = get_bytes(&r, len);
+        if (r.err)
+            goto done;
+        memcpy(sbuf, p, len);
+        sbuf[len] = 0;
+        catmap[i] = strtbl_intern(&et->cats, sbuf);
+    }
+
+    unsigned long long ndescs = get_varint(&r);
+    if (r.err || ndescs > (unsigned long long)size)
+        goto done;
+    int *descmap = aalloc(&a, sizeof(int) * (ndescs+1));
+    unsigned long long prevlen = 0;
+    for (unsigned long long i=0; i < ndescs; i++) {
+        unsigned long long prefix = get_varint(&r);
+        unsigned long long len = get_varint(&r);
+        unsigned char *p = get_bytes(&r, len);
+        if (r.err || prefix > prevlen)
+            goto done;
+        memcpy(sbuf + prefix, p, len);
+        prevlen = prefix + len;
+        sbuf[prevlen] = 0;
+        descmap[i] = strtbl_intern(&et->strings, sbuf);
+    }
+    unsigned char *recstart = r.p;
+
+    z = ARC_FULL;
+    arcr_t ir = {buf + indexpos, footer, 0};
+    for (uint32_t b=0; b < nblocks; b++) {
+        long long first = unzigzag(get_varint(&ir));
+        long long last = first + get_varint(&ir);
+        unsigned long long n = get_varint(&ir);
+        unsigned long long pos = get_varint(&ir);
+        if (ir.err || pos > (unsigned long long)(buf + indexpos - recstart)) {
+            z = -1;
+            break;
+        }
+        if ((startdt != 0 && last*unit < startdt) || (enddt != 0 && first*unit >= enddt)) {
+            z = ARC_PARTIAL;
+            continue;
+        }
+
+        arcr_t br = {recstart + pos, buf + indexpos, 0};
+        long long date = first;
+        long long id = 0;
+        for (unsigned long long i=0; i < n; i++) {
+            exp_t exp;
+            date += unzigzag(get_varint(&br));
+            unsigned long long cat = get_varint(&br);
+            unsigned long long desc = get_varint(&br);
+            long long cents = unzigzag(get_varint(&br));
+            id += unzigzag(get_varint(&br));
+            if (br.err || cat >= ncats || desc >= ndescs) {
+                z = -1;
+                break;
+            }
+            exp.date = date * unit;
+            exp.catid = catmap[cat];
+            exp.descid = descmap[desc];
+            exp.amt = cents / 100.0;
+            exp.id = id;
+            add_exp(et, exp);
+        }
+        if (z == -1)
+            break;
+    }
+
+done:
+    if (z == -1 && et->len != len0) {
+        et->len = len0;
+        et->next_id = next_id0;
+        et->idindex_valid = 0;
+    }
+    free_arena(&a);
+    return z;
+}
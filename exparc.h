@@ -0,0 +1,13 @@
+#ifndef EXPARC_H
+#define EXPARC_H
+
+// Compressed columnar archive of expenses, used for sealed years of a year
+// partitioned expense directory (ex. expenses.d/2023.xa).
+
+#define ARC_FULL     0
+#define ARC_PARTIAL  1
+
+int write_archive(FILE *f, exptbl_t *et, int istart, int iend);
+int read_archive(FILE *f, exptbl_t *et, time_t startdt, time_t enddt);
+
+#endif
@@ -0,0 +1,482 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "clib.h"
+#include "exp.h"
+#include "expext.h"
+
+// External merge sort
+//
+// Records are added to a buffer of the memory budget. When it fills up,
+// pointers to the records (kept at the end of the buffer) are sorted and
+// the records are written in order to a run file in $TMPDIR, unlinked as
+// soon as it's created. A run file is a sequence of { length (int32),
+// bytes } records. When finished, up to EXT_MAX_FANIN runs at a time are
+// merged into longer runs until the rest can be merged in one pass, which
+// emits the records. If nothing was spilled, records are sorted and
+// emitted from memory.
+//
+// Records are 8 byte aligned so that they can start with 64 bit fields.
+
+#define EXT_MIN_BUDGET  (256*1024)
+#define EXT_MAX_FANIN   32
+#define EXT_RUN_BUF     (64*1024)
+
+#define ALIGN8(n) (((n) + 7) & ~7L)
+
+typedef struct {
+    FILE *f;
+    char *rec;
+    int len;
+    int cap;
+} extrun_t;
+
+// Records are sorted through pointers, qsort() has no context arg.
+static extcmp_t g_sortcmp;
+
+static int cmp_rec_ptr(const void *a, const void *b) {
+    return g_sortcmp(*(char **)a, *(char **)b);
+}
+
+static FILE *open_spill_file() {
+    FILE *f;
+#ifdef WINDOWS
+    f = tmpfile();
+#else
+    char path[2048];
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0')
+        dir = "/tmp";
+    snprintf(path, sizeof(path), "%s/exp2spillXXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        fprintf(errout(), "Error creating '%s': ", path);
+        print_error(NULL);
+        return NULL;
+    }
+    unlink(path);
+    f = fdopen(fd, "w+b");
+    if (f == NULL)
+        close(fd);
+#endif
+    if (f == NULL) {
+        print_error("Error creating spill file");
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, EXT_RUN_BUF);
+    return f;
+}
+
+void init_extsort(extsort_t *xs, long budget, extcmp_t cmp) {
+    memset(xs, 0, sizeof(extsort_t));
+    xs->cmp = cmp;
+    if (budget < EXT_MIN_BUDGET)
+        budget = EXT_MIN_BUDGET;
+    xs->buf_cap = budget & ~7L;
+    xs->buf = malloc(xs->buf_cap);
+    if (xs->buf == NULL)
+        panic("Out of memory for sort buffer");
+}
+
+static char **sort_buf_recs(extsort_t *xs) {
+    char **ptrs = (char **)(xs->buf + xs->buf_cap) - xs->nrecs;
+    g_sortcmp = xs->cmp;
+    qsort(ptrs, xs->nrecs, sizeof(char *), cmp_rec_ptr);
+    return ptrs;
+}
+
+static void add_run(extsort_t *xs, FILE *f) {
+    if (xs->nruns == xs->runs_cap) {
+        xs->runs_cap = xs->runs_cap == 0 ? 16 : xs->runs_cap*2;
+        xs->runs = realloc(xs->runs, sizeof(FILE *) * xs->runs_cap);
+        if (xs->runs == NULL)
+            panic("realloc() error");
+    }
+    xs->runs[xs->nruns++] = f;
+}
+
+static int finish_run(FILE *f) {
+    if (fflush(f) != 0 || ferror(f)) {
+        print_error("Error writing spill file");
+        return 1;
+    }
+    rewind(f);
+    return 0;
+}
+
+// Sort the buffered records and write them out as a run. After an error
+// records are dropped, extsort_finish() fails.
+static void spill_run(extsort_t *xs) {
+    FILE *f = NULL;
+    if (xs->err == 0)
+        f = open_spill_file();
+    if (f == NULL) {
+        xs->err = 1;
+    } else {
+        char **ptrs = sort_buf_recs(xs);
+        for (int i=0; i < xs->nrecs; i++) {
+            int32_t len = ((int32_t *)ptrs[i])[-2];
+            fwrite(&len, sizeof(len), 1, f);
+            fwrite(ptrs[i], 1, len, f);
+        }
+        if (finish_run(f) != 0)
+            xs->err = 1;
+        add_run(xs, f);
+    }
+    xs->buf_len = 0;
+    xs->nrecs = 0;
+}
+
+// Return room for a record of len bytes, spilling the buffered records
+// first if it's full.
+void *extsort_alloc(extsort_t *xs, int len) {
+    long need = 8 + ALIGN8(len) + sizeof(char *);
+    if (xs->buf_len + xs->nrecs * (long)sizeof(char *) + need > xs->buf_cap) {
+        if (xs->nrecs > 0)
+            spill_run(xs);
+        if (need > xs->buf_cap) {
+            free(xs->buf);
+            xs->buf_cap = ALIGN8(need*2);
+            xs->buf = malloc(xs->buf_cap);
+            if (xs->buf == NULL)
+                panic("Out of memory for sort buffer");
+        }
+    }
+
+    char *p = xs->buf + xs->buf_len;
+    ((int32_t *)p)[0] = len;
+    p += 8;
+    xs->buf_len += 8 + ALIGN8(len);
+    xs->nrecs++;
+    ((char **)(xs->buf + xs->buf_cap))[-xs->nrecs] = p;
+    return p;
+}
+
+void extsort_add(extsort_t *xs, const void *rec, int len) {
+    memcpy(extsort_alloc(xs, len), rec, len);
+}
+
+// Read the next record of run r. Returns 1 if read, 0 at the end of the
+// run, -1 on error.
+static int read_run_rec(extrun_t *r) {
+    int32_t len;
+    if (fread(&len, sizeof(len), 1, r->f) != 1)
+        return ferror(r->f) ? -1 : 0;
+    if (len < 0)
+        return -1;
+    if (len+1 > r->cap) {
+        r->cap = len+1 > r->cap*2 ? len+1 : r->cap*2;
+        free(r->rec);
+        r->rec = malloc(ALIGN8(r->cap));
+        if (r->rec == NULL)
+            panic("Out of memory for run record");
+    }
+    if (fread(r->rec, 1, len, r->f) != (size_t)len)
+        return -1;
+    r->len = len;
+    return 1;
+}
+
+static void sift_down(extcmp_t cmp, extrun_t *rs, int *heap, int n, int i) {
+    while (1) {
+        int min = i;
+        int l = 2*i+1, r = 2*i+2;
+        if (l < n && cmp(rs[heap[l]].rec, rs[heap[min]].rec) < 0)
+            min = l;
+        if (r < n && cmp(rs[heap[r]].rec, rs[heap[min]].rec) < 0)
+            min = r;
+        if (min == i)
+            break;
+        int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Merge runs[0, n) into run file out, or emit the merged records if out
+// is NULL. The runs are closed.
+static int merge_runs(extsort_t *xs, FILE **runs, int n, FILE *out, extemit_t emit, void *ctx) {
+    extrun_t *rs = calloc(n, sizeof(extrun_t));
+    int *heap = malloc(sizeof(int) * n);
+    if (rs == NULL || heap == NULL)
+        panic("Out of memory for merge");
+
+    int z = 0;
+    int nheap = 0;
+    for (int i=0; i < n; i++) {
+        rs[i].f = runs[i];
+        int got = read_run_rec(&rs[i]);
+        if (got == -1)
+            z = 1;
+        if (got == 1)
+            heap[nheap++] = i;
+    }
+    for (int i=nheap/2-1; i >= 0; i--)
+        sift_down(xs->cmp, rs, heap, nheap, i);
+
+    while (nheap > 0 && z == 0) {
+        extrun_t *r = &rs[heap[0]];
+        if (out != NULL) {
+            int32_t len = r->len;
+            fwrite(&len, sizeof(len), 1, out);
+            fwrite(r->rec, 1, len, out);
+        } else {
+            emit(ctx, r->rec, r->len);
+        }
+
+        int got = read_run_rec(r);
+        if (got == -1)
+            z = 1;
+        if (got != 1)
+            heap[0] = heap[--nheap];
+        sift_down(xs->cmp, rs, heap, nheap, 0);
+    }
+    if (z != 0)
+        print_error("Error reading spill file");
+
+    for (int i=0; i < n; i++) {
+        fclose(rs[i].f);
+        free(rs[i].rec);
+    }
+    free(rs);
+    free(heap);
+    return z;
+}
+
+// Emit all records in sorted order, and free the sort. With a NULL emit,
+// the sort is only freed.
+// Returns 0 on success, 1 if a spill file couldn't be written or read.
+int extsort_finish(extsort_t *xs, extemit_t emit, void *ctx) {
+    int z = xs->err;
+
+    if (emit == NULL) {
+        for (int i=0; i < xs->nruns; i++)
+            fclose(xs->runs[i]);
+    } else if (z == 0 && xs->nruns == 0) {
+        char **ptrs = sort_buf_recs(xs);
+        for (int i=0; i < xs->nrecs; i++)
+            emit(ctx, ptrs[i], ((int32_t *)ptrs[i])[-2]);
+    } else if (z == 0) {
+        if (xs->nrecs > 0)
+            spill_run(xs);
+        free(xs->buf);
+        xs->buf = NULL;
+
+        // Merge the first runs into a longer one at the end until the
+        // rest can be merged in one pass.
+        int first = 0;
+        while (xs->err == 0 && xs->nruns - first > EXT_MAX_FANIN) {
+            FILE *out = open_spill_file();
+            if (out == NULL) {
+                xs->err = 1;
+                break;
+            }
+            if (merge_runs(xs, xs->runs + first, EXT_MAX_FANIN, out, NULL, NULL) != 0 || finish_run(out) != 0)
+                xs->err = 1;
+            first += EXT_MAX_FANIN;
+            add_run(xs, out);
+        }
+        if (xs->err == 0) {
+            z = merge_runs(xs, xs->runs + first, xs->nruns - first, NULL, emit, ctx);
+            first = xs->nruns;
+        }
+        z |= xs->err;
+        for (int i=first; i < xs->nruns; i++)
+            fclose(xs->runs[i]);
+    } else {
+        for (int i=0; i < xs->nruns; i++)
+            fclose(xs->runs[i]);
+    }
+
+    free(xs->buf);
+    free(xs->runs);
+    memset(xs, 0, sizeof(extsort_t));
+    return z;
+}
+
+// Order by expense date, then id
+int cmp_extexp_date(const void *a, const void *b) {
+    const extexp_t *xa = a;
+    const extexp_t *xb = b;
+    if (xa->date != xb->date)
+        return xa->date < xb->date ? -1 : 1;
+    if (xa->idkey != xb->idkey)
+        return xa->idkey < xb->idkey ? -1 : 1;
+    return 0;
+}
+
+extexp_t *extsort_add_exp(extsort_t *xs, exprec_t *rec, int64_t idkey) {
+    int desc_len = strlen(rec->desc);
+    int cat_len = strlen(rec->cat);
+    extexp_t *x = extsort_alloc(xs, sizeof(extexp_t) + desc_len+1 + cat_len+1);
+    x->date = rec->date;
+    x->idkey = idkey;
+    x->amt = rec->amt;
+    x->catoff = desc_len+1;
+    memcpy(x->text, rec->desc, desc_len+1);
+    memcpy(x->text + x->catoff, rec->cat, cat_len+1);
+    return x;
+}
+
+// External aggregation
+//
+// Spilled partial sums are { cents (int64), name }, sorted by name ignoring
+// case like the category table, then by exact name.
+
+typedef struct {
+    int64_t cents;
+    char name[];
+} extsum_t;
+
+static int cmp_extsum_name(const void *a, const void *b) {
+    const extsum_t *sa = a;
+    const extsum_t *sb = b;
+    int z = strcasecmp(sa->name, sb->name);
+    if (z != 0)
+        return z;
+    return strcmp(sa->name, sb->name);
+}
+
+static uint32_t hash_name(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+// Half of the budget goes to the hash table and names, half to the spill.
+void init_extagg(extagg_t *xa, long budget) {
+    memset(xa, 0, sizeof(extagg_t));
+    if (budget < EXT_MIN_BUDGET)
+        budget = EXT_MIN_BUDGET;
+    init_extsort(&xa->spill, budget/2, cmp_extsum_name);
+
+    xa->nslots = 1024;
+    while (xa->nslots * 2 * (long)(sizeof(uint64_t) + sizeof(long long)) <= budget/4)
+        xa->nslots *= 2;
+    xa->names_cap = budget/4;
+    xa->slots = calloc(xa->nslots, sizeof(uint64_t));
+    xa->sums = malloc(sizeof(long long) * xa->nslots);
+    xa->names = malloc(xa->names_cap);
+    if (xa->slots == NULL || xa->sums == NULL || xa->names == NULL)
+        panic("Out of memory for aggregate table");
+}
+
+static void spill_sums(extagg_t *xa) {
+    for (int i=0; i < xa->nslots; i++) {
+        if (xa->slots[i] == 0)
+            continue;
+        char *name = xa->names + (xa->slots[i] >> 32) - 1;
+        int len = strlen(name);
+        extsum_t *s = extsort_alloc(&xa->spill, sizeof(extsum_t) + len+1);
+        s->cents = xa->sums[i];
+        memcpy(s->name, name, len+1);
+    }
+    memset(xa->slots, 0, sizeof(uint64_t) * xa->nslots);
+    xa->nused = 0;
+    xa->names_len = 0;
+}
+
+void extagg_add(extagg_t *xa, const char *name, long long cents) {
+    uint32_t h = hash_name(name);
+    int mask = xa->nslots - 1;
+    int i = h & mask;
+    while (xa->slots[i] != 0) {
+        if ((uint32_t)xa->slots[i] == h && strcmp(xa->names + (xa->slots[i] >> 32) - 1, name) == 0) {
+            xa->sums[i] += cents;
+            return;
+        }
+        i = (i+1) & mask;
+    }
+
+    long len = strlen(name);
+    if (xa->nused*2 >= xa->nslots || xa->names_len + len+1 > xa->names_cap) {
+        spill_sums(xa);
+        if (len+1 > xa->names_cap) {
+            extsum_t *s = extsort_alloc(&xa->spill, sizeof(extsum_t) + len+1);
+            s->cents = cents;
+            memcpy(s->name, name, len+1);
+            return;
+        }
+        i = h & mask;
+    }
+    memcpy(xa->names + xa->names_len, name, len+1);
+    xa->slots[i] = (uint64_t)(xa->names_len+1) << 32 | h;
+    xa->sums[i] = cents;
+    xa->names_len += len+1;
+    xa->nused++;
+}
+
+static void emit_sum(void *ctx, void *rec, int len) {
+    extagg_t *xa = ctx;
+    extsum_t *s = rec;
+    if (xa->have_cur && strcmp(xa->cur, s->name) == 0) {
+        xa->cur_sum += s->cents;
+        return;
+    }
+    if (xa->have_cur)
+        xa->emit(xa->ctx, xa->cur, xa->cur_sum);
+
+    long name_len = strlen(s->name);
+    if (name_len+1 > xa->cur_cap) {
+        xa->cur_cap = name_len+1;
+        xa->cur = realloc(xa->cur, xa->cur_cap);
+        if (xa->cur == NULL)
+            panic("realloc() error");
+    }
+    memcpy(xa->cur, s->name, name_len+1);
+    xa->cur_sum = s->cents;
+    xa->have_cur = 1;
+}
+
+// Emit the total of each name, in name order, and free the aggregate.
+// With a NULL emit, the aggregate is only freed.
+int extagg_finish(extagg_t *xa, void (*emit)(void *ctx, const char *name, long long cents), void *ctx) {
+    if (emit != NULL)
+        spill_sums(xa);
+    free(xa->slots);
+    free(xa->sums);
+    free(xa->names);
+
+    xa->emit = emit;
+    xa->ctx = ctx;
+    int z = extsort_finish(&xa->spill, emit != NULL ? emit_sum : NULL, xa);
+    if (z == 0 && xa->have_cur)
+        emit(ctx, xa->cur, xa->cur_sum);
+    free(xa->cur);
+    memset(xa, 0, sizeof(extagg_t));
+    return z;
+}
+
+// Memory budget of a sort or aggregate, half of $EXP2MEMLIMIT.
+long get_memory_budget() {
+    char *s = getenv("EXP2MEMLIMIT");
+    long limit = s != NULL ? atol(s) : 0;
+    if (limit <= 0)
+        return EXT_MIN_BUDGET;
+    return limit * SIZE_MB / 2;
+}
+
+// Expenses are streamed from the expense file instead of being loaded
+// when the arena they need is larger than $EXP2MEMLIMIT MB.
+// Only a single expense file (not a year partitioned directory) can be
+// streamed.
+int use_external_memory(arena_t scratch, unsigned long arena_size) {
+    char *s = getenv("EXP2MEMLIMIT");
+    long limit = s != NULL ? atol(s) : 0;
+    if (limit <= 0 || arena_size <= (unsigned long)limit * SIZE_MB)
+        return 0;
+
+    str_t files[MAX_EXPENSE_FILES];
+    int nfiles = get_expense_filenames(&scratch, files, countof(files));
+    struct stat st;
+    if (nfiles != 1 || stat(files[0].bytes, &st) != 0 || S_ISDIR(st.st_mode))
+        return 0;
+    return 1;
+}
@@ -0,0 +1,75 @@
+#ifndef EXPEXT_H
+#define EXPEXT_H
+
+// External memory sort and aggregation, for expense files too large to
+// load into memory (see use_external_memory()).
+
+typedef int (*extcmp_t)(const void *a, const void *b);
+typedef void (*extemit_t)(void *ctx, void *rec, int len);
+
+// Sort of variable length records in a fixed memory budget. Records are
+// collected in buf until it fills up, then sorted and spilled to a run
+// file. Runs are k-way merged when finished.
+typedef struct {
+    extcmp_t cmp;
+    char *buf;          // records from the start, pointers to them
+    long buf_cap;       // from the end
+    long buf_len;
+    int nrecs;
+
+    FILE **runs;
+    int nruns;
+    int runs_cap;
+    int err;
+} extsort_t;
+
+void init_extsort(extsort_t *xs, long budget, extcmp_t cmp);
+void *extsort_alloc(extsort_t *xs, int len);
+void extsort_add(extsort_t *xs, const void *rec, int len);
+int extsort_finish(extsort_t *xs, extemit_t emit, void *ctx);
+
+// Expense as a sort record. text holds the description and category,
+// each null terminated.
+typedef struct {
+    int64_t date;
+    int64_t idkey;      // id, or EXT_NOID+n for the nth expense without one
+    float amt;
+    int catoff;
+    char text[];
+} extexp_t;
+
+#define EXT_NOID ((int64_t)1 << 32)
+
+int cmp_extexp_date(const void *a, const void *b);
+extexp_t *extsort_add_exp(extsort_t *xs, exprec_t *rec, int64_t idkey);
+
+// Sums of cents by name in a fixed memory budget. When the hash table fills
+// up, its partial sums are spilled to an external sort by name, and the
+// partial sums of each name are added up when finished.
+typedef struct {
+    extsort_t spill;
+    uint64_t *slots;    // name offset+1 << 32 | hash, 0 if empty
+    long long *sums;
+    int nslots;
+    int nused;
+    char *names;
+    long names_len;
+    long names_cap;
+
+    // Name being summed while merging.
+    char *cur;
+    long cur_cap;
+    long long cur_sum;
+    int have_cur;
+    void (*emit)(void *ctx, const char *name, long long cents);
+    void *ctx;
+} extagg_t;
+
+void init_extagg(extagg_t *xa, long budget);
+void extagg_add(extagg_t *xa, const char *name, long long cents);
+int extagg_finish(extagg_t *xa, void (*emit)(void *ctx, const char *name, long long cents), void *ctx);
+
+long get_memory_budget();
+int use_external_memory(arena_t scratch, unsigned long arena_size);
+
+#endif
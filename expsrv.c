@@ -0,0 +1,403 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdio_ext.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "clib.h"
+#include "expsrv.h"
+
+// Request protocol:
+//
+// Client sends a 4 byte request length in host byte order, followed by
+// argc NUL terminated argument strings:
+//
+//   [len] list\0 2025-06\0
+//
+// The write end of a status pipe is passed along with the length
+// (SCM_RIGHTS). Server runs the command with the connection as
+// stdin/stdout/stderr, writes the command's 4 byte exit status to the
+// status pipe and closes the connection when the command is done. Client
+// relays its own stdin to the connection.
+//
+// Requests are handled one at a time, so a client that stops sending or
+// reading gets cut off after SRV_TIMEOUT_MS, and commands that prompt for
+// input aren't forwarded to the server (see is_server_command()).
+
+#define SRV_MAX_REQ  SIZE_MEDIUM
+#define SRV_MAX_ARGS 64
+#define SRV_MAX_WATCHES 4
+#define SRV_TIMEOUT_MS 5000
+
+static volatile sig_atomic_t g_srv_quit = 0;
+
+static struct {
+    int fd;
+    srv_watch_t func;
+} g_srv_watches[SRV_MAX_WATCHES];
+static int g_srv_nwatches = 0;
+
+static void srv_on_signal(int sig) {
+    g_srv_quit = 1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read len bytes, waiting no more than SRV_TIMEOUT_MS for each read.
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int z = poll(&pfd, 1, SRV_TIMEOUT_MS);
+        if (z == -1 && errno == EINTR)
+            continue;
+        if (z <= 0)
+            return -1;
+        ssize_t n = read(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int make_sockaddr(const char *sockpath, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path too long: '%s'\n", sockpath);
+        return -1;
+    }
+    strcpy(addr->sun_path, sockpath);
+    return 0;
+}
+
+// Create unix socket listening on sockpath. Returns socket fd or -1 on error.
+int srv_listen(const char *sockpath) {
+    struct sockaddr_un addr;
+    if (make_sockaddr(sockpath, &addr) != 0)
+        return -1;
+
+    // Refuse to take over a socket that a running server is listening on.
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        print_error("socket() error");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Server already running on '%s'\n", sockpath);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(sockpath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        print_error("socket() error");
+        return -1;
+    }
+    // Only the owner may connect, since commands can change expenses.
+    mode_t oldmask = umask(0177);
+    int z = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(oldmask);
+    if (z == -1) {
+        fprintf(stderr, "Error binding '%s': ", sockpath);
+        print_error(NULL);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 16) == -1) {
+        print_error("listen() error");
+        close(fd);
+        unlink(sockpath);
+        return -1;
+    }
+    return fd;
+}
+
+// Have srv_serve() call func whenever fd is readable.
+int srv_watch(int fd, srv_watch_t func) {
+    if (g_srv_nwatches >= SRV_MAX_WATCHES)
+        return -1;
+    g_srv_watches[g_srv_nwatches].fd = fd;
+    g_srv_watches[g_srv_nwatches].func = func;
+    g_srv_nwatches++;
+    return 0;
+}
+
+// Read the request length, and the status pipe fd passed with it into
+// *statusfd (-1 if none).
+static int read_reqlen(int connfd, uint32_t *reqlen, int *statusfd) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {reqlen, sizeof(*reqlen)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    *statusfd = -1;
+    struct pollfd pfd = {connfd, POLLIN, 0};
+    if (poll(&pfd, 1, SRV_TIMEOUT_MS) <= 0)
+        return -1;
+    ssize_t n = recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(statusfd, CMSG_DATA(cmsg), sizeof(int));
+    if (n < (ssize_t)sizeof(*reqlen))
+        return read_all(connfd, (char *)reqlen + n, sizeof(*reqlen) - n);
+    return 0;
+}
+
+static void srv_handle_conn(int connfd, srv_handler_t handler, void *ctx) {
+    static char req[SRV_MAX_REQ];
+    char *argv[SRV_MAX_ARGS+1];
+    int argc = 0;
+    uint32_t reqlen;
+    int statusfd;
+
+    int z = read_reqlen(connfd, &reqlen, &statusfd);
+    if (z == 0 && (reqlen == 0 || reqlen >= sizeof(req)))
+        z = -1;
+    if (z == 0)
+        z = read_all(connfd, req, reqlen);
+    if (z != 0) {
+        if (statusfd != -1)
+            close(statusfd);
+        return;
+    }
+    req[reqlen] = 0;
+
+    char *p = req;
+    while (p < req+reqlen && argc < SRV_MAX_ARGS) {
+        argv[argc++] = p;
+        p += strlen(p)+1;
+    }
+    argv[argc] = NULL;
+
+    // A client that stops reading output or sending input doesn't hold up
+    // the server for longer than the timeout.
+    struct timeval tv = {SRV_TIMEOUT_MS / 1000, (SRV_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    // Redirect stdin/stdout/stderr to the connection while running the command.
+    fflush(stdout);
+    fflush(stderr);
+    int savedfds[3];
+    for (int i=0; i < 3; i++) {
+        savedfds[i] = dup(i);
+        dup2(connfd, i);
+    }
+    __fpurge(stdin);
+    clearerr(stdin);
+
+    int32_t status = handler(argv, argc, ctx);
+
+    fflush(stdout);
+    fflush(stderr);
+    __fpurge(stdout);
+    __fpurge(stderr);
+    clearerr(stdout);
+    clearerr(stderr);
+    __fpurge(stdin);
+    clearerr(stdin);
+    for (int i=0; i < 3; i++) {
+        dup2(savedfds[i], i);
+        close(savedfds[i]);
+    }
+    if (statusfd != -1) {
+        write_all(statusfd, &status, sizeof(status));
+        close(statusfd);
+    }
+}
+
+// Accept and run client requests one at a time until SIGINT/SIGTERM.
+// Watched fds are serviced between requests.
+int srv_serve(int listenfd, const char *sockpath, srv_handler_t handler, void *ctx) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = srv_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[SRV_MAX_WATCHES+1];
+    while (!g_srv_quit) {
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        for (int i=0; i < g_srv_nwatches; i++) {
+            fds[i+1].fd = g_srv_watches[i].fd;
+            fds[i+1].events = POLLIN;
+        }
+        if (poll(fds, g_srv_nwatches+1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            print_error("poll() error");
+            break;
+        }
+        for (int i=0; i < g_srv_nwatches; i++) {
+            if (fds[i+1].revents & POLLIN)
+                g_srv_watches[i].func(fds[i+1].fd, ctx);
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            print_error("accept() error");
+            break;
+        }
+        srv_handle_conn(connfd, handler, ctx);
+        close(connfd);
+    }
+
+    close(listenfd);
+    unlink(sockpath);
+    return 0;
+}
+
+// Send the request length with the write end of the status pipe.
+static int send_reqlen(int fd, uint32_t reqlen, int statusfd) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&reqlen, sizeof(reqlen)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &statusfd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (n == -1)
+        return -1;
+    return write_all(fd, (char *)&reqlen + n, sizeof(reqlen) - n);
+}
+
+// Send command to server listening on sockpath and relay its output.
+// Returns the command's exit status if it was run by the server, or -1
+// if no server is running.
+int srv_forward(const char *sockpath, char *argv[], int argc) {
+    static char req[SRV_MAX_REQ];
+    struct sockaddr_un addr;
+    char buf[4096];
+
+    uint32_t reqlen = 0;
+    for (int i=0; i < argc; i++) {
+        size_t len = strlen(argv[i])+1;
+        if (reqlen + len >= sizeof(req))
+            return -1;
+        memcpy(req+reqlen, argv[i], len);
+        reqlen += len;
+    }
+
+    if (make_sockaddr(sockpath, &addr) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int statuspipe[2];
+    if (pipe(statuspipe) != 0) {
+        close(fd);
+        return -1;
+    }
+    int z = send_reqlen(fd, reqlen, statuspipe[1]);
+    close(statuspipe[1]);
+    if (z != 0 || write_all(fd, req, reqlen) != 0) {
+        close(statuspipe[0]);
+        close(fd);
+        return -1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+    int nfds = 2;
+
+    while (1) {
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            write_all(STDOUT_FILENO, buf, n);
+        }
+        if (nfds > 1 && fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                // No more input, let server see EOF.
+                shutdown(fd, SHUT_WR);
+                nfds = 1;
+            } else if (write_all(fd, buf, n) != 0) {
+                nfds = 1;
+            }
+        }
+    }
+    close(fd);
+
+    // The server closes its end of the status pipe after writing the
+    // status, or without one if it gave up on the request.
+    int32_t status = 1;
+    if (read_all(statuspipe[0], &status, sizeof(status)) != 0)
+        status = 1;
+    close(statuspipe[0]);
+    return status;
+}
@@ -0,0 +1,17 @@
+#ifndef EXPSRV_H
+#define EXPSRV_H
+
+// Request handler called by srv_serve() for each client request.
+// stdin, stdout and stderr are redirected to the client connection for the
+// duration of the call. Returns the exit status of the command.
+typedef int (*srv_handler_t)(char *argv[], int argc, void *ctx);
+
+// Called by srv_serve() when a watched fd becomes readable.
+typedef void (*srv_watch_t)(int fd, void *ctx);
+
+int srv_listen(const char *sockpath);
+int srv_watch(int fd, srv_watch_t func);
+int srv_serve(int listenfd, const char *sockpath, srv_handler_t handler, void *ctx);
+int srv_forward(const char *sockpath, char *argv[], int argc);
+
+#endif